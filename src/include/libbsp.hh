@@ -3,5 +3,22 @@
 #include "libbsp_version.hh"
 
 #include "libbsp/reader.hh"
+#include "libbsp/mapped_file.hh"
 #include "libbsp/intermediate.hh"
 #include "libbsp/assembler.hh"
+#include "libbsp/parallel.hh"
+#include "libbsp/trace.hh"
+#include "libbsp/visibility.hh"
+#include "libbsp/scene.hh"
+#include "libbsp/patch.hh"
+#include "libbsp/export.hh"
+#include "libbsp/optimize.hh"
+#include "libbsp/merge.hh"
+#include "libbsp/compact.hh"
+#include "libbsp/garbage.hh"
+#include "libbsp/edit.hh"
+#include "libbsp/validate.hh"
+#include "libbsp/atlas.hh"
+#include "libbsp/image.hh"
+#include "libbsp/dedup.hh"
+#include "libbsp/color.hh"
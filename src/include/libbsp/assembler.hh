@@ -6,7 +6,12 @@
 #include <array>
 #include <cstring>
 #include <memory>
+#include <optional>
+#include <span>
 #include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 namespace BSP {
 	
@@ -21,6 +26,26 @@ namespace BSP {
 	struct LumpProvider {
 		virtual ~LumpProvider() = default;
 		virtual BSPI::ByteArray generate_lump(LumpIndex) = 0;
+		// providers that already hold the lump's bytes can return them here so the assembler can write them without a copy
+		// the returned memory must stay valid until the assembler is done
+		virtual std::optional<std::span<uint8_t const>> view_lump(LumpIndex) { return std::nullopt; }
+		// same as above for lumps held as several separate runs of memory, returned in order, which are written without being joined
+		virtual std::optional<std::vector<std::span<uint8_t const>>> view_lump_segments(LumpIndex idx) {
+			if (auto view = view_lump(idx)) return std::vector<std::span<uint8_t const>> { *view };
+			return std::nullopt;
+		}
+		// providers that can generate lumps concurrently with each other and with any other provider return true here
+		// providers that don't are run one after another on a single thread
+		virtual bool thread_safe() const { return false; }
+		// providers that know the exact size of a lump before generating it return it here
+		// the assembler then allocates the lump's final slot up front and fills it with generate_into instead of generate_lump
+		virtual std::optional<size_t> size_hint(LumpIndex) { return std::nullopt; }
+		// generate a lump into memory of exactly size_hint bytes, the default goes through generate_lump
+		virtual void generate_into(LumpIndex idx, std::span<uint8_t> out) {
+			auto bytes = generate_lump(idx);
+			if (bytes.size() != out.size()) throw std::logic_error {"lump size does not match its size hint"};
+			memcpy(out.data(), bytes.data(), bytes.size());
+		}
 	};
 	
 	using LumpProviderPtr = std::shared_ptr<LumpProvider>;
@@ -30,9 +55,41 @@ namespace BSP {
 		inline Assembler(LumpProviderPtr const & ptr) : providers { ptr, ptr, ptr, ptr, ptr, ptr, ptr, ptr, ptr, ptr, ptr, ptr, ptr, ptr, ptr, ptr, ptr, ptr } {}
 		inline LumpProviderPtr & operator [] (LumpIndex idx) { return providers[static_cast<size_t>(idx)]; }
 		inline void set_all(LumpProviderPtr const & ptr) { providers.fill(ptr); }
+		// number of threads used to generate lumps, 0 for one per hardware thread, defaults to 1 (everything on the calling thread)
+		inline void set_threads(size_t num) { threads = num; }
+		
+		struct WriteException : public std::exception {
+			WriteException(std::string what) : m_what(what) {}
+			inline char const * what() const noexcept override { return m_what.data(); }
+		private:
+			std::string m_what;
+		};
+		
+		// take over the lumps of the set, each becoming the provider of its lump
+		void provide(BSPI::IndexedLumps &&);
+		
 		BSPI::ByteArray assemble();
+		
+		// write the BSP straight to a file with a single gathered write, lumps that can be viewed are written without being copied
+		// the descriptor must be seekable, the BSP is written from offset 0 and the file is truncated to its size
+		void write_to(int fd);
+		// write to a temporary file next to path and rename it over path once complete, so path is never left partially written
+		// this is also safe when path is the file the lumps are being read from, as the old file stays alive until it is unmapped
+		void write_to(std::string const & path);
+		
 	private:
 		std::array<LumpProviderPtr, 18> providers;
+		size_t threads = 1;
+		
+		struct Lumps {
+			std::array<BSPI::ByteArray, 18> generated;
+			std::array<std::vector<std::span<uint8_t const>>, 18> data; // viewed or generated lumps, as runs of memory
+			std::array<std::optional<size_t>, 18> hinted;  // lumps to be generated in place, sized but not generated yet
+		};
+		void collect(Lumps &);
+		void generate_hinted(Lumps const &, std::array<std::span<uint8_t>, 18> const & slots);
+		template <typename F> void dispatch(std::vector<size_t> const & lumps, F && func);
+		static BSP::Header make_header(Lumps const &);
 	};
 	
 	struct BSPReaderLumpProvider : public LumpProvider {
@@ -42,6 +99,10 @@ namespace BSP {
 			auto data = bspr.get_data_span<uint8_t const>(idx);
 			return BSPI::ByteArray { data.begin(), data.end() };
 		}
+		std::optional<std::span<uint8_t const>> view_lump(LumpIndex idx) override {
+			return bspr.get_data_span<uint8_t const>(idx);
+		}
+		bool thread_safe() const override { return true; }
 	private:
 		BSP::Reader bspr;
 	};
@@ -60,6 +121,16 @@ namespace BSP {
 			ret[ent_str.size()] = 0;
 			return ret;
 		}
+		inline std::optional<size_t> size_hint(LumpIndex idx) override {
+			if (idx != LumpIndex::ENTITIES) throw UnprovidableLumpException(idx);
+			return ents->stringified_size() + 1;
+		}
+		inline void generate_into(LumpIndex idx, std::span<uint8_t> out) override {
+			if (idx != LumpIndex::ENTITIES) throw UnprovidableLumpException(idx);
+			ents->stringify_into(reinterpret_cast<char *>(out.data()));
+			out.back() = 0;
+		}
+		inline bool thread_safe() const override { return true; }
 	private:
 		std::shared_ptr<BSPI::EntityArray> ents;
 	};
@@ -72,58 +143,96 @@ namespace BSP {
 			if (idx != IDX) throw UnprovidableLumpException(idx);
 			return value->serialize();
 		}
+		inline std::optional<size_t> size_hint(LumpIndex idx) override {
+			if (idx != IDX) throw UnprovidableLumpException(idx);
+			return value->serialized_size();
+		}
+		inline void generate_into(LumpIndex idx, std::span<uint8_t> out) override {
+			if (idx != IDX) throw UnprovidableLumpException(idx);
+			value->serialize_into(out);
+		}
+		inline bool thread_safe() const override { return true; }
 	private:
 		std::shared_ptr<T> value;
 	};
 	
-	using BSPIShaderArrayLumpProvider = BSPIGenericLumpProvider<BSPI::ShaderArray, LumpIndex::SHADERS>;
-	using BSPILeafArrayLumpProvider = BSPIGenericLumpProvider<BSPI::LeafArray, LumpIndex::LEAFS>;
-	using BSPILeafSurfacesArrayLumpProvider = BSPIGenericLumpProvider<BSPI::LeafSurfaceArray, LumpIndex::LEAFSURFACES>;
-	using BSPIModelArrayLumpProvider = BSPIGenericLumpProvider<BSPI::ModelArray, LumpIndex::MODELS>;
-	using BSPIBrushArrayLumpProvider = BSPIGenericLumpProvider<BSPI::BrushArray, LumpIndex::BRUSHES>;
-	using BSPIBrushSidesArrayLumpProvider = BSPIGenericLumpProvider<BSPI::BrushSideArray, LumpIndex::BRUSHSIDES>;
-	
-	struct BSPIVertexArrayLumpProvider : public LumpProvider {
-		BSPIVertexArrayLumpProvider() = delete;
-		inline BSPIVertexArrayLumpProvider(std::shared_ptr<BSPI::VertexArray> const & vertices) : vertices(vertices) {}
+	// copy-on-write arrays hand their untouched runs of the source straight to the assembler
+	template <typename T, LumpIndex IDX>
+	struct BSPICowLumpProvider : public LumpProvider {
+		BSPICowLumpProvider() = delete;
+		inline BSPICowLumpProvider(std::shared_ptr<BSPI::CowArray<T>> const & value) : value(value) {}
 		inline BSPI::ByteArray generate_lump(LumpIndex idx) override {
-			if (idx != LumpIndex::DRAWVERTS) throw UnprovidableLumpException(idx);
-			return vertices->serialize();
+			if (idx != IDX) throw UnprovidableLumpException(idx);
+			return value->serialize();
 		}
-	private:
-		std::shared_ptr<BSPI::VertexArray> vertices;
-	};
-	
-	struct BSPIIndexArrayLumpProvider : public LumpProvider {
-		BSPIIndexArrayLumpProvider() = delete;
-		inline BSPIIndexArrayLumpProvider(std::shared_ptr<BSPI::IndexArray> const & indices) : indices(indices) {}
-		inline BSPI::ByteArray generate_lump(LumpIndex idx) override {
-			if (idx != LumpIndex::DRAWINDEXES) throw UnprovidableLumpException(idx);
-			return indices->serialize();
+		inline std::optional<std::vector<std::span<uint8_t const>>> view_lump_segments(LumpIndex idx) override {
+			if (idx != IDX) throw UnprovidableLumpException(idx);
+			return value->segments();
 		}
+		inline bool thread_safe() const override { return true; }
 	private:
-		std::shared_ptr<BSPI::IndexArray> indices;
+		std::shared_ptr<BSPI::CowArray<T>> value;
 	};
 	
-	struct BSPISurfaceArrayLumpProvider : public LumpProvider {
-		BSPISurfaceArrayLumpProvider() = delete;
-		inline BSPISurfaceArrayLumpProvider(std::shared_ptr<BSPI::SurfaceArray> const & surfaces) : surfaces(surfaces) {}
-		inline BSPI::ByteArray generate_lump(LumpIndex idx) override {
-			if (idx != LumpIndex::SURFACES) throw UnprovidableLumpException(idx);
-			return surfaces->serialize();
-		}
-	private:
-		std::shared_ptr<BSPI::SurfaceArray> surfaces;
-	};
+	using BSPICowLeafArrayLumpProvider = BSPICowLumpProvider<BSP::Leaf, LumpIndex::LEAFS>;
+	using BSPICowModelArrayLumpProvider = BSPICowLumpProvider<BSP::Model, LumpIndex::MODELS>;
+	using BSPICowBrushArrayLumpProvider = BSPICowLumpProvider<BSP::Brush, LumpIndex::BRUSHES>;
+	using BSPICowBrushSideArrayLumpProvider = BSPICowLumpProvider<BSP::BrushSide, LumpIndex::BRUSHSIDES>;
+	using BSPICowVertexArrayLumpProvider = BSPICowLumpProvider<BSP::DrawVert, LumpIndex::DRAWVERTS>;
+	using BSPICowIndexArrayLumpProvider = BSPICowLumpProvider<int32_t, LumpIndex::DRAWINDEXES>;
+	using BSPICowSurfaceArrayLumpProvider = BSPICowLumpProvider<BSP::Surface, LumpIndex::SURFACES>;
+	using BSPICowLightmapArrayLumpProvider = BSPICowLumpProvider<BSP::Lightmap, LumpIndex::LIGHTMAPS>;
+	
+	using BSPIShaderArrayLumpProvider = BSPIGenericLumpProvider<BSPI::ShaderArray, LumpIndex::SHADERS>;
 	
-	struct BSPILightmapArrayLumpProvider : public LumpProvider {
-		BSPILightmapArrayLumpProvider() = delete;
-		inline BSPILightmapArrayLumpProvider(std::shared_ptr<BSPI::LightmapArray> const & lightmaps) : lightmaps(lightmaps) {}
+	// plain lump arrays are already laid out as they are in the file, so the assembler takes them as they are
+	template <typename A>
+	struct BSPILumpArrayLumpProvider : public LumpProvider {
+		BSPILumpArrayLumpProvider() = delete;
+		inline BSPILumpArrayLumpProvider(std::shared_ptr<A> const & value) : value(value) {}
 		inline BSPI::ByteArray generate_lump(LumpIndex idx) override {
-			if (idx != LumpIndex::LIGHTMAPS) throw UnprovidableLumpException(idx);
-			return lightmaps->serialize();
+			if (idx != A::INDEX) throw UnprovidableLumpException(idx);
+			return value->serialize();
 		}
+		inline std::optional<std::span<uint8_t const>> view_lump(LumpIndex idx) override {
+			if (idx != A::INDEX) throw UnprovidableLumpException(idx);
+			return value->bytes();
+		}
+		inline bool thread_safe() const override { return true; }
 	private:
-		std::shared_ptr<BSPI::LightmapArray> lightmaps;
+		std::shared_ptr<A> value;
 	};
+	
+	using BSPIPlaneArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::PlaneArray>;
+	using BSPINodeArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::NodeArray>;
+	using BSPILeafArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::LeafArray>;
+	using BSPILeafSurfacesArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::LeafSurfaceArray>;
+	using BSPILeafBrushesArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::LeafBrushArray>;
+	using BSPIModelArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::ModelArray>;
+	using BSPIBrushArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::BrushArray>;
+	using BSPIBrushSidesArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::BrushSideArray>;
+	using BSPIVertexArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::VertexArray>;
+	using BSPIIndexArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::IndexArray>;
+	using BSPISurfaceArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::SurfaceArray>;
+	using BSPIFogArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::FogArray>;
+	using BSPILightmapArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::LightmapArray>;
+	using BSPILightgridArrayLumpProvider = BSPILumpArrayLumpProvider<BSPI::LightgridArray>;
+	
+	inline void Assembler::provide(BSPI::IndexedLumps && lumps) {
+		auto take = [](auto & array){ return std::make_shared<std::remove_reference_t<decltype(array)>>(std::move(array)); };
+		(*this)[LumpIndex::SHADERS] = std::make_shared<BSPIShaderArrayLumpProvider>(take(lumps.shaders));
+		(*this)[LumpIndex::PLANES] = std::make_shared<BSPIPlaneArrayLumpProvider>(take(lumps.planes));
+		(*this)[LumpIndex::NODES] = std::make_shared<BSPINodeArrayLumpProvider>(take(lumps.nodes));
+		(*this)[LumpIndex::LEAFS] = std::make_shared<BSPILeafArrayLumpProvider>(take(lumps.leafs));
+		(*this)[LumpIndex::LEAFSURFACES] = std::make_shared<BSPILeafSurfacesArrayLumpProvider>(take(lumps.leaf_surfaces));
+		(*this)[LumpIndex::LEAFBRUSHES] = std::make_shared<BSPILeafBrushesArrayLumpProvider>(take(lumps.leaf_brushes));
+		(*this)[LumpIndex::MODELS] = std::make_shared<BSPIModelArrayLumpProvider>(take(lumps.models));
+		(*this)[LumpIndex::BRUSHES] = std::make_shared<BSPIBrushArrayLumpProvider>(take(lumps.brushes));
+		(*this)[LumpIndex::BRUSHSIDES] = std::make_shared<BSPIBrushSidesArrayLumpProvider>(take(lumps.brush_sides));
+		(*this)[LumpIndex::DRAWVERTS] = std::make_shared<BSPIVertexArrayLumpProvider>(take(lumps.verts));
+		(*this)[LumpIndex::DRAWINDEXES] = std::make_shared<BSPIIndexArrayLumpProvider>(take(lumps.indices));
+		(*this)[LumpIndex::FOGS] = std::make_shared<BSPIFogArrayLumpProvider>(take(lumps.fogs));
+		(*this)[LumpIndex::SURFACES] = std::make_shared<BSPISurfaceArrayLumpProvider>(take(lumps.surfaces));
+		(*this)[LumpIndex::LIGHTMAPS] = std::make_shared<BSPILightmapArrayLumpProvider>(take(lumps.lightmaps));
+	}
 }
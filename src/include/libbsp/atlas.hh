@@ -0,0 +1,50 @@
+#pragma once
+
+#include "intermediate.hh"
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace BSP {
+
+	struct LightmapAtlasOptions {
+		// width and height of a page, a power of two from 256 to 4096 such as 1024, 2048, or 4096
+		// 0 picks the smallest that holds every lightmap on one page, or 4096 if none does
+		uint32_t size = 0;
+		size_t threads = 1; // threads filling pages, 0 for one per hardware thread
+		bool deluxe = false; // lightmaps are light and deluxe pairs, see Reader::deluxe_mapped
+	};
+
+	// where one lightmap went, in texels from the top left of its page
+	struct AtlasPlacement {
+		uint32_t page, x, y;
+	};
+
+	struct AtlasPage {
+		uint32_t size = 0;         // width and height
+		std::vector<Color> pixels; // size * size, row major
+	};
+
+	struct LightmapAtlas {
+		std::vector<AtlasPage> pages;
+		std::vector<AtlasPlacement> placements; // one per original lightmap, the remap table
+		bool deluxe = false;                    // pages are light and deluxe pairs, each deluxe map placed as its light map on the following page
+	};
+
+	// pack the lightmaps into square pages, each filled on its own thread
+	// lightmaps are all LIGHTMAP_DIM square, so they go in a grid in their original order, keeping those q3map2 allocated together next to each other
+	// every page is options.size except the last, which shrinks to the smallest power of two holding what is left
+	// with deluxe, pairs stay pairs: light maps are packed onto even pages and their deluxe maps into the same place on the odd page after
+	// throws std::invalid_argument if the size is not one of the above, or deluxe lightmaps don't come in pairs
+	LightmapAtlas pack_lightmaps(std::span<Lightmap const>, LightmapAtlasOptions const & = {});
+
+	// point surfaces at pages instead of lightmaps, leaving the lightmaps lump to be emptied by the caller
+	// no stock renderer loads the pages, the result only draws lightmapped with a renderer that loads them as listed in the caller's remap table
+	// lightmap indices become page indices, lightmap_x and lightmap_y move to the placement, and vertex lightmap UVs are scaled into the page, once per vertex range and style
+	// negative lightmap indices (vertex lit, or no lightmap in that style) are left alone
+	// throws std::out_of_range for lightmaps or vertices outside of their lumps, and std::logic_error if surfaces sharing vertices use different lightmaps in a style
+	// or a surface of a deluxe atlas refers to a deluxe map, in every case before anything is changed
+	void apply_lightmap_atlas(LightmapAtlas const &, BSPI::SurfaceArray &, BSPI::VertexArray &, size_t threads = 1);
+
+}
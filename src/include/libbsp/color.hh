@@ -0,0 +1,42 @@
+#pragma once
+
+#include "intermediate.hh"
+
+#include <cstdint>
+#include <span>
+
+namespace BSP {
+
+	enum struct Tonemap {
+		CLAMP,     // clip each channel at full brightness, shifting the hue of bright colors
+		NORMALIZE, // scale the whole color down by its brightest channel, as the engine does with overbright lightmaps
+		REINHARD,  // extended Reinhard per channel, reaching full brightness at the white point
+	};
+
+	// rebalancing of 8-bit lighting, applied in this order:
+	//   gamma, then 2^overbright_bits, then saturation around the luma, then the tonemap back into 8 bits
+	struct ColorTransform {
+		int32_t overbright_bits = 0; // from -8 to 8, negative darkens
+		float gamma = 1;             // above 1 brightens the shadows
+		float saturation = 1;        // 0 is greyscale
+		Tonemap tonemap = Tonemap::CLAMP;
+		float white = 2;             // with REINHARD, the brightness that maps to full
+
+		// whether each channel comes out independent of the others, so the transform reduces to a 256 entry table
+		inline bool per_channel() const { return saturation == 1 && tonemap != Tonemap::NORMALIZE; }
+	};
+
+	// in place, with a lookup table when the transform is per channel and SSE2 or AVX2 kernels otherwise where the target has them
+	// every path gives the same result for the same color
+	// throws std::invalid_argument if the transform is out of range, before anything is changed
+	void transform_colors(std::span<Color>, ColorTransform const &);
+
+	// every pixel of every lightmap, a lightmap per task
+	// when deluxe, the lightmaps are light and deluxe pairs and only the light maps are transformed
+	// throws std::invalid_argument if deluxe and the lightmaps don't pair up
+	void transform_lightmaps(BSPI::LightmapArray &, ColorTransform const &, size_t threads = 1, bool deluxe = false);
+
+	// the ambient and directed colors of every lightgrid cell, styles included
+	void transform_lightgrid(BSPI::LightgridArray &, ColorTransform const &, size_t threads = 1);
+
+}
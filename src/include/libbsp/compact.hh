@@ -0,0 +1,81 @@
+#pragma once
+
+#include "reader.hh"
+
+#include <cstdint>
+#include <ostream>
+
+namespace BSP {
+
+	// ================================
+	// FORMAT
+
+	// compact vertex files hold the drawverts and drawindexes of a BSP in a smaller form for streaming, all little endian:
+	//   CompactHeader
+	//   CompactSurface[surfaces], one per BSP surface and in the same order
+	//   vertex streams 1 to LIGHTSTYLES, stream k holding vertices with k styles, each stream_stride(k) bytes:
+	//     float    pos[3]
+	//     uint16_t uv[2]            half floats, less the surface's uv_shift to stay near zero
+	//     int16_t  normal[2]        octahedral, snorm
+	//     uint16_t lightmap[k][2]   half floats
+	//     uint8_t  color[k][4]
+	//   indices[index_count], index_size bytes each and relative to the surface's first vertex as in the BSP
+	//   uint32_t vertex_remap[source_verts], (stream - 1) << 30 | vertex within the stream, or COMPACT_UNUSED if no surface uses it
+
+	static constexpr ident_t  COMPACT_IDENT = { 'B', 'S', 'P', 'V' };
+	static constexpr uint32_t COMPACT_VERSION = 2;
+	static constexpr uint32_t COMPACT_UNUSED = 0xFFFFFFFF;
+
+	struct CompactHeader {
+		ident_t  ident;
+		uint32_t version;
+		uint32_t surfaces;
+		uint32_t source_verts;
+		uint32_t stream_verts[LIGHTSTYLES];
+		uint32_t index_count;
+		uint32_t index_size; // 2, or 4 if a surface has more than 65536 vertices
+	};
+	static_assert(sizeof(CompactHeader) == 40);
+
+	struct CompactSurface {
+		uint32_t stream;             // 1 to LIGHTSTYLES, 0 if the surface has no vertices
+		uint32_t first_vert, vert_count;
+		uint32_t first_index, index_count;
+		int32_t  uv_shift[2];        // whole number taken off the shader UVs of its vertices, add it back to get the BSP's UVs
+	};
+	static_assert(sizeof(CompactSurface) == 28);
+
+	inline constexpr size_t stream_stride(size_t styles) { return 20 + styles * 8; }
+
+	// IEEE half float conversions, rounding to nearest even
+	uint16_t to_half(float);
+	float from_half(uint16_t);
+
+	// unit vector to and from the octahedral mapping, each component a snorm16
+	std::array<int16_t, 2> to_octahedral(float const * normal);
+	vec3_t from_octahedral(std::array<int16_t, 2>);
+
+	// ================================
+
+	struct CompactVertexOptions {
+		size_t threads = 1; // threads encoding vertices, 0 for one per hardware thread
+	};
+
+	struct CompactVertexReport {
+		size_t source_verts = 0, verts = 0; // vertices in the BSP, and vertices written across all streams
+		size_t stream_verts[LIGHTSTYLES] = {};
+		size_t source_bytes = 0;             // drawverts and drawindexes in the BSP
+		size_t vertex_bytes = 0, index_bytes = 0, table_bytes = 0, bytes = 0;
+		float  max_uv_error = 0, max_lightmap_error = 0; // in UV units, after adding uv_shift back
+		float  max_normal_error = 0;                     // in degrees
+
+		inline double ratio() const { return source_bytes ? static_cast<double>(bytes) / source_bytes : 0; }
+	};
+
+	// write the vertices and indices of every surface in the compact format above
+	// a surface keeps only the styles up to its last one in use, per lightmap_styles and vertex_styles, and goes in the stream for that many
+	// vertex ranges shared by surfaces of the same stream are written once
+	// throws std::out_of_range if a surface references vertices or indices outside of their lumps
+	CompactVertexReport export_compact_vertices(Reader const &, std::ostream &, CompactVertexOptions const & = {});
+
+}
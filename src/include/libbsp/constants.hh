@@ -7,11 +7,13 @@
 namespace BSP {
 
 	using ident_t = std::array<char, 4>;
+	using vec3_t = std::array<float, 3>;
 	static constexpr ident_t  IDENT = { 'R', 'B', 'S', 'P' };
 	static constexpr int32_t  VERSION = 1;
 	static constexpr uint32_t PATH_LENGTH = 64;
 	
 	static constexpr uint32_t LIGHTSTYLES = 4; // usually referring to lightmap and vertex color usage
+	static constexpr uint8_t  LIGHTSTYLE_NONE = 255; // unused entry of Surface::lightmap_styles and vertex_styles
 	static constexpr uint32_t LIGHTMAP_DIM = 128; // hardcoded width and height of a lightmap
 	static constexpr uint32_t LIGHTMAP_PIXELS = LIGHTMAP_DIM * LIGHTMAP_DIM; // number of pixels per lightmap
 	static constexpr uint32_t LIGHTMAP_CHANNELS = 3; // RGB
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "intermediate.hh"
+
+#include <cstdint>
+
+namespace BSP {
+
+	// 64-bit hash of a lightmap's pixels, with SSE2 or AVX2 where the target has them and the same result from the scalar fallback
+	uint64_t hash_lightmap(Lightmap const &);
+
+	struct LightmapDedupReport {
+		size_t before = 0, after = 0; // lightmaps
+		size_t uniform = 0;           // lightmaps left that are a single color, such as all black or fullbright
+		size_t bytes = 0;             // bytes removed from the lightmaps lump
+
+		inline size_t removed() const { return before - after; }
+	};
+
+	struct LightmapDedupOptions {
+		bool deluxe = false; // lightmaps are light and deluxe pairs, see Reader::deluxe_mapped
+		size_t threads = 1;  // threads hashing lightmaps, 0 for one per hardware thread
+	};
+
+	// drop lightmaps identical to an earlier one, pointing their surfaces at the first of each, and keep the rest in order
+	// with deluxe, a pair is only dropped if both its maps match an earlier pair, so every light map stays followed by its own deluxe map
+	// lightmaps are hashed in parallel and only those with equal hashes are compared in full
+	// throws std::out_of_range if a surface refers past the lightmaps, and with deluxe std::invalid_argument if the lightmaps don't come in pairs
+	// or std::logic_error if a surface refers to a deluxe map, in every case before anything is changed
+	LightmapDedupReport dedup_lightmaps(BSPI::LightmapArray &, BSPI::SurfaceArray &, LightmapDedupOptions const & = {});
+
+}
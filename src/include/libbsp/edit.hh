@@ -0,0 +1,97 @@
+#pragma once
+
+#include "intermediate.hh"
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace BSP {
+
+	struct EditReport {
+		std::array<size_t, 18> inserted {}, removed {}; // elements per lump, indexed by LumpIndex
+	};
+
+	// insertions and removals of surfaces, brushes, and the elements they own, queued up and applied to every lump together by commit()
+	// indices given to and returned by the transaction count each lump's original elements followed by the ones added to it, in the order added
+	// commit() lays out each lump once and renumbers every reference to it in the same pass, so any number of edits takes linear time
+	// elements added to a range (a model's surfaces, a leaf's leafsurfaces, a surface's vertices, ...) go at its end, or at the end of the lump if it is empty
+	// data only removed elements used, such as a removed surface's vertices, stays behind for collect_garbage
+	// lumps nothing is inserted into the middle of (shaders, planes, fogs, lightmaps) can be appended to directly
+	struct EditTransaction {
+
+		explicit EditTransaction(BSPI::IndexedLumps & lumps) : m_lumps(lumps) {}
+		EditTransaction(EditTransaction const &) = delete;
+		EditTransaction & operator = (EditTransaction const &) = delete;
+
+		// add a surface at the end of the model's surfaces, returning its index
+		// its vertices and indices are best left empty and given with add_verts and add_indices
+		int32_t add_surface(int32_t model, Surface const &);
+		void remove_surface(int32_t surface);
+
+		// add a brush at the end of the model's brushes, returning its index, its sides are best left empty and given with add_brush_sides
+		int32_t add_brush(int32_t model, Brush const &);
+		void remove_brush(int32_t brush);
+		void add_brush_sides(int32_t brush, std::span<BrushSide const>);
+
+		void add_verts(int32_t surface, std::span<DrawVert const>);
+		// the indices of surfaces that used removed vertices are renumbered, commit() fails if one used a removed vertex itself
+		void remove_verts(int32_t first, int32_t count);
+		// relative to the surface's vertices, its original ones followed by those added to it
+		void add_indices(int32_t surface, std::span<int32_t const>);
+
+		void add_leaf_surface(int32_t leaf, int32_t surface);
+		// every entry of the surface in the leaf, including those added before, entries of removed surfaces go by themselves
+		void remove_leaf_surface(int32_t leaf, int32_t surface);
+		void add_leaf_brush(int32_t leaf, int32_t brush);
+		void remove_leaf_brush(int32_t leaf, int32_t brush);
+
+		// apply everything queued and start over empty
+		// throws std::out_of_range if anything refers outside of its lump, and std::logic_error for edits that contradict each other
+		// (such as adding to a removed surface, or a fog on a removed brush), in which case the lumps are left untouched
+		EditReport commit();
+
+	private:
+
+		struct Chunk {
+			int32_t owner;
+			uint32_t count;
+		};
+
+		// elements added to one lump, in runs each going at the end of an owner's range, and original elements removed
+		template <typename T>
+		struct Pending {
+			std::vector<T> added;
+			std::vector<Chunk> chunks;
+			std::vector<int32_t> removed;
+
+			inline void add(int32_t owner, std::span<T const> values) {
+				if (values.empty()) return;
+				added.insert(added.end(), values.begin(), values.end());
+				chunks.push_back({ owner, static_cast<uint32_t>(values.size()) });
+			}
+			inline void clear() {
+				added.clear();
+				chunks.clear();
+				removed.clear();
+			}
+		};
+
+		BSPI::IndexedLumps & m_lumps;
+		Pending<Surface> m_surfaces;
+		Pending<Brush> m_brushes;
+		Pending<BrushSide> m_sides;
+		Pending<DrawVert> m_verts;
+		Pending<int32_t> m_indices;
+		Pending<int32_t> m_leaf_surfaces;
+		Pending<int32_t> m_leaf_brushes;
+
+		struct LeafRemoval {
+			int32_t leaf, value; // surface or brush
+			size_t queued;       // entries added to the leaf before
+		};
+		std::vector<LeafRemoval> m_leaf_surface_removals, m_leaf_brush_removals;
+	};
+
+}
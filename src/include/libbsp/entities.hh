@@ -0,0 +1,133 @@
+#pragma once
+
+#include <meadow/istring.hh>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace BSP {
+
+	// columnar table of entities
+	// every key/value pair of every entity lives in one contiguous array, with each entity being a range of it
+	// keys are interned so a pair only stores a key index, and values are views into either the source entity lump or the table's own arena
+	// a table parsed by the Reader borrows the lump and must not outlive it, call own() to copy everything into the arena
+	struct EntityTable {
+
+		using index_t = uint32_t;
+
+		struct Pair {
+			index_t key;                // index into the interned keys
+			meadow::istring_view value;
+		};
+
+		// handle to a single entity, invalidated by any modification of the table
+		struct Entity {
+
+			struct Iterator {
+				EntityTable const * table;
+				Pair const * pair;
+				inline std::pair<meadow::istring_view, meadow::istring_view> operator * () const { return { table->key(pair->key), pair->value }; }
+				inline Iterator & operator ++ () { pair++; return *this; }
+				inline bool operator == (Iterator const & other) const { return pair == other.pair; }
+			};
+
+			inline size_t size() const { return m_end - m_begin; }
+			inline bool empty() const { return m_begin == m_end; }
+			inline Iterator begin() const { return { m_table, m_begin }; }
+			inline Iterator end() const { return { m_table, m_end }; }
+
+			std::optional<meadow::istring_view> get(meadow::istring_view key) const;
+			inline bool contains(meadow::istring_view key) const { return get(key).has_value(); }
+
+		private:
+			friend struct EntityTable;
+			inline Entity(EntityTable const * table, Pair const * begin, Pair const * end) : m_table(table), m_begin(begin), m_end(end) {}
+			EntityTable const * m_table;
+			Pair const * m_begin;
+			Pair const * m_end;
+		};
+
+		struct Iterator {
+			EntityTable const * table;
+			size_t idx;
+			inline Entity operator * () const { return (*table)[idx]; }
+			inline Iterator & operator ++ () { idx++; return *this; }
+			inline bool operator == (Iterator const & other) const { return idx == other.idx; }
+		};
+
+		EntityTable() = default;
+		EntityTable(EntityTable const &);
+		EntityTable(EntityTable &&) noexcept;
+		EntityTable & operator = (EntityTable const &);
+		EntityTable & operator = (EntityTable &&) noexcept;
+		~EntityTable() = default;
+
+		// ================================
+		// ACCESS
+
+		inline size_t size() const { return m_offsets.size() - 1; }
+		inline bool empty() const { return m_offsets.size() == 1; }
+		inline Entity operator [] (size_t idx) const { return Entity { this, m_pairs.data() + m_offsets[idx], m_pairs.data() + m_offsets[idx + 1] }; }
+		inline Iterator begin() const { return { this, 0 }; }
+		inline Iterator end() const { return { this, size() }; }
+
+		inline meadow::istring_view key(index_t idx) const { return m_keys[idx]; }
+		inline std::vector<meadow::istring_view> const & keys() const { return m_keys; }
+		inline std::vector<Pair> const & pairs() const { return m_pairs; }
+
+		// index of an interned key, if any entity uses it
+		std::optional<index_t> find_key(meadow::istring_view) const;
+
+		// ================================
+		// CONSTRUCTION
+
+		// the strings given to these are referenced, not copied, see own()
+
+		void reserve(size_t entities, size_t pairs);
+		// add a key/value pair to the last entity, replacing the value if the key is already present
+		void append(meadow::istring_view key, meadow::istring_view value);
+
+		// ================================
+		// MODIFICATION
+
+		// these copy the strings given into the arena
+
+		size_t add_entity(); // also used during construction
+		void remove_entity(size_t idx);
+		void set(size_t idx, meadow::istring_view key, meadow::istring_view value);
+		bool erase(size_t idx, meadow::istring_view key);
+
+		// copy every referenced string into the arena, so the table no longer depends on the memory it was built from
+		void own();
+
+		// ================================
+
+		std::string stringify() const;
+		size_t stringified_size() const;
+		void stringify_into(char *) const; // writes exactly stringified_size() bytes, without a terminator
+
+	private:
+
+		struct KeyHash {
+			size_t operator () (meadow::istring_view) const;
+		};
+
+		std::vector<meadow::istring_view> m_keys;
+		std::unordered_map<meadow::istring_view, index_t, KeyHash> m_key_lookup;
+		std::vector<Pair> m_pairs;
+		std::vector<index_t> m_offsets { 0 }; // entity i is the pairs [m_offsets[i], m_offsets[i + 1])
+
+		std::vector<std::unique_ptr<char[]>> m_arena;
+		char * m_arena_cur = nullptr;
+		size_t m_arena_left = 0;
+
+		index_t intern(meadow::istring_view key);
+		meadow::istring_view store(meadow::istring_view);
+	};
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "patch.hh"
+#include "reader.hh"
+
+#include <cstdint>
+#include <ostream>
+
+namespace BSP {
+
+	enum struct MeshFormat {
+		OBJ, // Wavefront OBJ, one object per model and a group per shader
+		GLB  // binary glTF 2.0, one mesh per model and a primitive and material per shader
+	};
+
+	struct MeshExportOptions {
+		PatchOptions patches;              // tessellation of PATCH surfaces
+		size_t threads = 1;                // threads encoding chunks, 0 for one per hardware thread
+		size_t max_chunk_verts = 65536;    // surfaces of a model and shader are split into chunks of about this many source vertices
+	};
+
+	struct MeshExportStats {
+		size_t chunks = 0;
+		size_t verts = 0;
+		size_t triangles = 0;
+		size_t bytes = 0;
+	};
+
+	// write the PLANAR, TRISOUP, and tessellated PATCH surfaces of every model, grouped by shader
+	// geometry is built and encoded a window of chunks at a time and written out in order, so memory stays bounded no matter the size of the map
+	// coordinates are converted from Quake's Z-up to Y-up and triangles are rewound counter-clockwise, as both formats expect
+	// throws std::out_of_range if a surface references vertices or indices outside of their lumps
+	MeshExportStats export_mesh(Reader const &, std::ostream &, MeshFormat, MeshExportOptions const & = {});
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "intermediate.hh"
+
+#include <array>
+#include <cstdint>
+
+namespace BSP {
+
+	struct GarbageReport {
+		std::array<size_t, 18> before {}, after {}; // element counts per lump, indexed by LumpIndex
+		size_t bytes = 0;                           // bytes reclaimed across all lumps
+
+		inline size_t removed(LumpIndex idx) const { return before[static_cast<size_t>(idx)] - after[static_cast<size_t>(idx)]; }
+	};
+
+	struct GarbageOptions {
+		bool deluxe = false; // lightmaps are light and deluxe pairs, see Reader::deluxe_mapped
+	};
+
+	// remove the elements nothing refers to any more, as edits leave behind when they append replacements or empty surfaces:
+	//   shaders not used by a surface, brush, or brush side
+	//   planes not used by a node or a live brush side, removed in their front and back pairs so q3map2's pairing holds
+	//   brushes outside every model and not in a leaf or fog, and brush sides outside every live brush unless a fog shows them
+	//   drawverts and drawindexes outside the ranges of surfaces that have any, surfaces without vertices being dead and left with no indices or lightmaps
+	//   lightmaps no surface uses, with deluxe in their light and deluxe pairs, and leafsurfaces and leafbrushes outside every leaf's range
+	// the remaining elements keep their order and every reference to them is renumbered, taking linear time however ranges overlap
+	// throws std::out_of_range if anything refers outside of its lump, and with deluxe std::invalid_argument if the lightmaps don't come in pairs
+	// or std::logic_error if a surface refers to a deluxe map, in every case leaving the lumps untouched
+	GarbageReport collect_garbage(BSPI::IndexedLumps &, GarbageOptions const & = {});
+
+}
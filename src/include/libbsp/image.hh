@@ -0,0 +1,20 @@
+#pragma once
+
+#include "file_fmt.hh"
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace BSP {
+
+	// encoders for the 8-bit RGB images lightmaps are made of, for dumping them without an image library
+	// pixels are row major, top row first, and must hold width * height colors
+
+	// binary PPM (P6), uncompressed and the fastest to write
+	std::vector<uint8_t> encode_ppm(uint32_t width, uint32_t height, std::span<Color const> pixels);
+
+	// QOI, lossless, somewhat larger than PNG but many times faster to encode, see qoiformat.org
+	std::vector<uint8_t> encode_qoi(uint32_t width, uint32_t height, std::span<Color const> pixels);
+
+}
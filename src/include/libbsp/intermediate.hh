@@ -5,7 +5,13 @@
 
 #include <meadow/istring.hh>
 
+#include <algorithm>
+#include <cstring>
 #include <map>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
 
 namespace BSP::Intermediate {
@@ -15,18 +21,14 @@ namespace BSP::Intermediate {
 	// ================================
 	// ENTITIES
 	
-	using Entity = std::map<meadow::istring, meadow::istring, std::less<>>;
+	using Entity = BSP::EntityTable::Entity;
 	
-	struct EntityArray : public std::vector<Entity> {
-		
-		using std::vector<Entity>::vector;
-		using std::vector<Entity>::operator [];
+	// unlike the Reader's, this table owns all of its strings and can outlive the Reader it was created from
+	struct EntityArray : public BSP::EntityTable {
 		
 		EntityArray() = default;
 		explicit EntityArray(BSP::Reader::EntityArray const &);
 		~EntityArray() = default;
-		
-		std::string stringify() const;
 	};
 	
 	// ================================
@@ -47,143 +49,201 @@ namespace BSP::Intermediate {
 		explicit ShaderArray(BSP::Reader::ShaderArray const &);
 		~ShaderArray() = default;
 		
+		size_t serialized_size() const;
+		void serialize_into(std::span<uint8_t>) const; // must be exactly serialized_size() bytes
 		ByteArray serialize() const;
 	};
 	
 	// ================================
-	// LEAFS
+	// PLAIN LUMPS
 	
-	struct LeafArray : public std::vector<BSP::Leaf> {
+	// array of lump elements that are written to the file exactly as they are held in memory
+	// constructing from the Reader and serializing are each a single copy of the whole array, and bytes() exposes it without any copy
+	// IDX ties each array type to its lump, keeping arrays of the same element type (such as leafsurfaces and drawindexes) distinct
+	template <typename T, BSP::LumpIndex IDX>
+	struct LumpArray : public std::vector<T> {
 		
-		using std::vector<BSP::Leaf>::vector;
-		using std::vector<BSP::Leaf>::operator [];
+		static_assert(std::is_trivially_copyable_v<T>);
+		static constexpr BSP::LumpIndex INDEX = IDX;
 		
-		LeafArray() = default;
-		explicit LeafArray(BSP::Reader::LeafArray const &);
-		~LeafArray() = default;
+		using std::vector<T>::vector;
+		using std::vector<T>::operator [];
 		
-		ByteArray serialize() const;
-	};
-	
-	// ================================
-	// LEAFSURFACES
-	
-	struct LeafSurfaceArray : public std::vector<int32_t> {
+		LumpArray() = default;
+		explicit LumpArray(std::span<T const> in) : std::vector<T>(in.begin(), in.end()) {}
+		~LumpArray() = default;
 		
-		using std::vector<int32_t>::vector;
-		using std::vector<int32_t>::operator [];
+		inline std::span<uint8_t const> bytes() const {
+			return { reinterpret_cast<uint8_t const *>(this->data()), this->size() * sizeof(T) };
+		}
 		
-		LeafSurfaceArray() = default;
-		explicit LeafSurfaceArray(BSP::Reader::LeafSurfaceArray const &);
-		~LeafSurfaceArray() = default;
+		inline size_t serialized_size() const { return this->size() * sizeof(T); }
 		
-		ByteArray serialize() const;
-	};
-	
-	// ================================
-	// MODELS
-	
-	struct ModelArray : public std::vector<BSP::Model> {
+		inline void serialize_into(std::span<uint8_t> out) const { // must be exactly serialized_size() bytes
+			if (!this->empty()) std::memcpy(out.data(), this->data(), serialized_size());
+		}
 		
-		using std::vector<BSP::Model>::vector;
-		using std::vector<BSP::Model>::operator [];
-		
-		ModelArray() = default;
-		explicit ModelArray(BSP::Reader::ModelArray const &);
-		~ModelArray() = default;
-		
-		ByteArray serialize() const;
+		inline ByteArray serialize() const {
+			auto in = bytes();
+			return ByteArray { in.begin(), in.end() };
+		}
 	};
 	
-	// ================================
-	// BRUSHES
-	
-	struct BrushArray : public std::vector<BSP::Brush> {
-		
-		using std::vector<BSP::Brush>::vector;
-		using std::vector<BSP::Brush>::operator [];
-		
-		BrushArray() = default;
-		explicit BrushArray(BSP::Reader::BrushArray const &);
-		~BrushArray() = default;
-		
-		ByteArray serialize() const;
+	using PlaneArray = LumpArray<BSP::Plane, BSP::LumpIndex::PLANES>;
+	using NodeArray = LumpArray<BSP::Node, BSP::LumpIndex::NODES>;
+	using LeafArray = LumpArray<BSP::Leaf, BSP::LumpIndex::LEAFS>;
+	using LeafSurfaceArray = LumpArray<int32_t, BSP::LumpIndex::LEAFSURFACES>;
+	using LeafBrushArray = LumpArray<int32_t, BSP::LumpIndex::LEAFBRUSHES>;
+	using ModelArray = LumpArray<BSP::Model, BSP::LumpIndex::MODELS>;
+	using BrushArray = LumpArray<BSP::Brush, BSP::LumpIndex::BRUSHES>;
+	using BrushSideArray = LumpArray<BSP::BrushSide, BSP::LumpIndex::BRUSHSIDES>;
+	using VertexArray = LumpArray<BSP::DrawVert, BSP::LumpIndex::DRAWVERTS>;
+	using IndexArray = LumpArray<int32_t, BSP::LumpIndex::DRAWINDEXES>;
+	using SurfaceArray = LumpArray<BSP::Surface, BSP::LumpIndex::SURFACES>;
+	using FogArray = LumpArray<BSP::Fog, BSP::LumpIndex::FOGS>;
+	using LightmapArray = LumpArray<BSP::Lightmap, BSP::LumpIndex::LIGHTMAPS>;
+	using LightgridArray = LumpArray<BSP::Lightgrid, BSP::LumpIndex::LIGHTGRID>;
+	
+	// every lump that refers to another by index, for passes that renumber elements and must rewrite all references to them together
+	struct IndexedLumps {
+		ShaderArray shaders;
+		PlaneArray planes;
+		NodeArray nodes;
+		LeafArray leafs;
+		LeafSurfaceArray leaf_surfaces;
+		LeafBrushArray leaf_brushes;
+		ModelArray models;
+		BrushArray brushes;
+		BrushSideArray brush_sides;
+		VertexArray verts;
+		IndexArray indices;
+		FogArray fogs;
+		SurfaceArray surfaces;
+		LightmapArray lightmaps;
+		
+		IndexedLumps() = default;
+		explicit IndexedLumps(BSP::Reader const & bspr) :
+			shaders(bspr.shaders()), planes(bspr.planes()), nodes(bspr.nodes()), leafs(bspr.leafs()),
+			leaf_surfaces(bspr.leafsurfaces()), leaf_brushes(bspr.leafbrushes()), models(bspr.models()),
+			brushes(bspr.brushes()), brush_sides(bspr.brushsides()), verts(bspr.drawverts()), indices(bspr.drawindices()),
+			fogs(bspr.fogs()), surfaces(bspr.surfaces()), lightmaps(bspr.lightmaps()) {}
 	};
 	
 	// ================================
-	// BRUSHSIDES
-	
-	struct BrushSideArray : public std::vector<BSP::BrushSide> {
-		
-		using std::vector<BSP::BrushSide>::vector;
-		using std::vector<BSP::BrushSide>::operator [];
-		
-		BrushSideArray() = default;
-		explicit BrushSideArray(BSP::Reader::BrushSideArray const &);
-		~BrushSideArray() = default;
-		
-		ByteArray serialize() const;
+	// COPY-ON-WRITE
+	
+	// array of lump elements that starts out as a view of the Reader's data and only copies the chunks that are edited
+	// reading never copies, edit() copies the chunk containing the element the first time it is called on that chunk
+	// elements can be added at the end, but not inserted or removed in the middle
+	// the source data must outlive the array
+	template <typename T>
+	struct CowArray {
+		
+		static_assert(std::is_trivially_copyable_v<T>);
+		static constexpr size_t CHUNK = std::max<size_t>(1, 65536 / sizeof(T)); // elements per chunk
+		
+		CowArray() = default;
+		explicit CowArray(std::span<T const> source) : m_source(source), m_size(source.size()), m_chunks((source.size() + CHUNK - 1) / CHUNK) {}
+		CowArray(CowArray const &) = delete;
+		CowArray(CowArray &&) = default;
+		~CowArray() = default;
+		
+		inline size_t size() const { return m_size; }
+		inline bool empty() const { return !m_size; }
+		
+		inline T const & operator [] (size_t idx) const {
+			auto const & chunk = m_chunks[idx / CHUNK];
+			return chunk ? chunk[idx % CHUNK] : m_source[idx];
+		}
+		
+		inline T const & at(size_t idx) const {
+			if (idx >= m_size) throw std::out_of_range {"CowArray index out of range"};
+			return (*this)[idx];
+		}
+		
+		inline T & edit(size_t idx) {
+			if (idx >= m_size) throw std::out_of_range {"CowArray index out of range"};
+			return materialize(idx / CHUNK)[idx % CHUNK];
+		}
+		
+		inline T & emplace_back(T const & value = {}) {
+			resize(m_size + 1);
+			T & ret = edit(m_size - 1);
+			ret = value;
+			return ret;
+		}
+		
+		void resize(size_t size) {
+			size_t old_size = m_size;
+			m_chunks.resize((size + CHUNK - 1) / CHUNK);
+			m_size = size;
+			// chunks reaching past the end of the source have nothing to fall back on, so they must be materialized
+			for (size_t c = m_source.size() / CHUNK; c < m_chunks.size(); c++)
+				if (std::min((c + 1) * CHUNK, m_size) > m_source.size()) materialize(c);
+			for (size_t i = old_size; i < size; i++) edit(i) = T {};
+		}
+		
+		// number of chunks that have been copied out of the source
+		inline size_t materialized_chunks() const {
+			return std::count_if(m_chunks.begin(), m_chunks.end(), [](auto const & chunk){ return static_cast<bool>(chunk); });
+		}
+		
+		// the serialized array as runs of memory, untouched stretches of the source are returned as one run without copying
+		std::vector<std::span<uint8_t const>> segments() const {
+			std::vector<std::span<uint8_t const>> ret;
+			for (size_t c = 0; c < m_chunks.size(); c++) {
+				size_t begin = c * CHUNK, count = std::min(CHUNK, m_size - begin);
+				if (m_chunks[c]) {
+					ret.emplace_back(reinterpret_cast<uint8_t const *>(m_chunks[c].get()), count * sizeof(T));
+				} else {
+					size_t end = begin + count;
+					while (c + 1 < m_chunks.size() && !m_chunks[c + 1]) end = std::min((++c + 1) * CHUNK, m_size);
+					ret.emplace_back(reinterpret_cast<uint8_t const *>(m_source.data() + begin), (end - begin) * sizeof(T));
+				}
+			}
+			return ret;
+		}
+		
+		inline size_t serialized_size() const { return m_size * sizeof(T); }
+		
+		void serialize_into(std::span<uint8_t> bytes) const {
+			for (auto const & seg : segments()) {
+				std::memcpy(bytes.data(), seg.data(), seg.size());
+				bytes = bytes.subspan(seg.size());
+			}
+		}
+		
+		ByteArray serialize() const {
+			ByteArray bytes (serialized_size());
+			serialize_into(bytes);
+			return bytes;
+		}
+		
+	private:
+		
+		std::span<T const> m_source;
+		size_t m_size = 0;
+		std::vector<std::unique_ptr<T[]>> m_chunks; // null chunks are read from the source
+		
+		T * materialize(size_t c) {
+			auto & chunk = m_chunks[c];
+			if (!chunk) {
+				chunk.reset(new T[CHUNK]());
+				size_t begin = c * CHUNK;
+				if (begin < m_source.size()) std::memcpy(chunk.get(), m_source.data() + begin, std::min(CHUNK, m_source.size() - begin) * sizeof(T));
+			}
+			return chunk.get();
+		}
 	};
 	
-	// ================================
-	// DRAWVERT
-	
-	struct VertexArray : public std::vector<BSP::DrawVert> {
-		
-		using std::vector<BSP::DrawVert>::vector;
-		using std::vector<BSP::DrawVert>::operator [];
-		
-		VertexArray() = default;
-		explicit VertexArray(BSP::Reader::VertexArray const &);
-		~VertexArray() = default;
-		
-		ByteArray serialize() const;
-	};
-	
-	// ================================
-	// DRAWINDEX
-	
-	struct IndexArray : public std::vector<int32_t> {
-		
-		using std::vector<int32_t>::vector;
-		using std::vector<int32_t>::operator [];
-		
-		IndexArray() = default;
-		explicit IndexArray(BSP::Reader::IndexArray const &);
-		~IndexArray() = default;
-		
-		ByteArray serialize() const;
-	};
-	
-	// ================================
-	// SURFACE
-	
-	struct SurfaceArray : public std::vector<BSP::Surface> {
-		
-		using std::vector<BSP::Surface>::vector;
-		using std::vector<BSP::Surface>::operator [];
-		
-		SurfaceArray() = default;
-		explicit SurfaceArray(BSP::Reader::SurfaceArray const &);
-		~SurfaceArray() = default;
-		
-		ByteArray serialize() const;
-	};
-	
-	// ================================
-	// LIGHTMAP
-	
-	struct LightmapArray : public std::vector<BSP::Lightmap> {
-		
-		using std::vector<BSP::Lightmap>::vector;
-		using std::vector<BSP::Lightmap>::operator [];
-		
-		LightmapArray() = default;
-		explicit LightmapArray(BSP::Reader::LightmapArray const &);
-		~LightmapArray() = default;
-		
-		ByteArray serialize() const;
-	};
+	using CowLeafArray = CowArray<BSP::Leaf>;
+	using CowModelArray = CowArray<BSP::Model>;
+	using CowBrushArray = CowArray<BSP::Brush>;
+	using CowBrushSideArray = CowArray<BSP::BrushSide>;
+	using CowVertexArray = CowArray<BSP::DrawVert>;
+	using CowIndexArray = CowArray<int32_t>;
+	using CowSurfaceArray = CowArray<BSP::Surface>;
+	using CowLightmapArray = CowArray<BSP::Lightmap>;
 }
 
 namespace BSPI = BSP::Intermediate;
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "reader.hh"
+
+#include <string>
+
+namespace BSP {
+
+	// read-only memory mapping of a BSP file, the mapping and file descriptor are released on destruction
+	// the header and every lump are validated against the file length once on open, so readers built from it can skip bounds checks
+	struct MappedFile {
+
+		enum struct Advice {
+			NORMAL,     // no special treatment
+			WILLNEED,   // prefault the lump, used for hot lumps such as nodes, planes, and brushes
+			DONTNEED,   // drop resident pages of the lump, they will be faulted in again on access
+			SEQUENTIAL, // lump will be read front to back, read ahead aggressively
+			RANDOM      // lump will be accessed randomly, disable read ahead
+		};
+
+		MappedFile() = delete;
+		MappedFile(std::string const & path, bool populate = false);
+		MappedFile(MappedFile const &) = delete;
+		MappedFile(MappedFile &&) noexcept;
+		MappedFile & operator = (MappedFile const &) = delete;
+		MappedFile & operator = (MappedFile &&) noexcept;
+		~MappedFile();
+
+		inline uint8_t const * data() const { return m_data; }
+		inline size_t size() const { return m_size; }
+		inline int fd() const { return m_fd; }
+
+		// the returned reader references the mapping and must not outlive this object
+		inline Reader reader() const { return Reader { m_data, m_size }; }
+
+		// apply an access hint to the pages spanned by a lump, nothing if moved from
+		void advise(LumpIndex, Advice) const;
+
+	private:
+
+		uint8_t const * m_data = nullptr;
+		size_t m_size = 0;
+		int m_fd = -1;
+
+		void release() noexcept;
+	};
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "intermediate.hh"
+
+#include <cstdint>
+
+namespace BSP {
+
+	struct SurfaceMergeOptions {
+		// the original renderer refuses surfaces reaching SHADER_MAX_VERTEXES (1000) or SHADER_MAX_INDEXES (6000)
+		size_t max_verts = 999;
+		size_t max_indices = 5997;
+		// merged coplanar faces stay PLANAR (keeping their plane culling) up to MAX_FACE_POINTS, otherwise they become TRISOUP
+		size_t max_planar_verts = 64;
+	};
+
+	struct SurfaceMergeReport {
+		size_t surfaces_before = 0, surfaces_after = 0;
+		size_t groups = 0;                               // merged surfaces made from more than one original
+		size_t leaf_refs_before = 0, leaf_refs_after = 0; // leafsurfaces, the draws made when every leaf is visible
+
+		inline double reduction() const { return surfaces_before ? 1.0 - static_cast<double>(surfaces_after) / surfaces_before : 0; }
+		inline double leaf_reduction() const { return leaf_refs_before ? 1.0 - static_cast<double>(leaf_refs_after) / leaf_refs_before : 0; }
+	};
+
+	// merge PLANAR and TRISOUP surfaces of the same model that share shader, fog, lightmaps and styles, and are drawn from exactly the same leafs
+	// requiring the same leafs means every leaf draws the same triangles as before, just in fewer surfaces
+	// surfaces, drawverts, drawindexes, leafsurfaces, and models are rebuilt, leafs get their new leafsurface ranges, and brush sides their new surfaces
+	// vertex and index ranges shared between surfaces that were not merged stay shared
+	// throws std::out_of_range if a model, leaf, or surface references something outside of its lump
+	SurfaceMergeReport merge_surfaces(
+		BSPI::SurfaceArray &, BSPI::VertexArray &, BSPI::IndexArray &,
+		BSPI::LeafArray &, BSPI::LeafSurfaceArray &, BSPI::ModelArray &,
+		BSPI::BrushSideArray &, SurfaceMergeOptions const & = {}
+	);
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "intermediate.hh"
+
+#include <cstdint>
+#include <span>
+
+namespace BSP {
+
+	// ================================
+	// VERTEX CACHE
+
+	// vertices transformed when drawing a triangle list through a FIFO post-transform cache of the given size, as most hardware behaves
+	// dividing by the triangle count gives the average cache miss ratio (ACMR), 0.5 is the ideal for large regular meshes and 3 the worst case
+	size_t cache_misses(std::span<int32_t const> indices, size_t vertex_count, size_t cache_size = 16);
+
+	// reorder the triangles of a triangle list so vertices are reused while still in the cache, using Tom Forsyth's linear-speed algorithm
+	// the set of triangles and their winding are kept, only their order and which corner comes first change
+	// throws std::out_of_range if an index is outside [0, vertex_count)
+	void optimize_vertex_cache(std::span<int32_t> indices, size_t vertex_count, size_t cache_size = 32);
+
+	// reorder runs of triangles that already use the cache well so outward facing runs are drawn first, letting early depth testing reject more of what is behind them
+	// best applied after optimize_vertex_cache, runs are split wherever the FIFO cache of the given size would restart, so the cache order survives within each
+	void optimize_overdraw(std::span<int32_t> indices, std::span<DrawVert const> verts, size_t cache_size = 16);
+
+	struct IndexOptimizeOptions {
+		size_t cache_size = 32;   // LRU cache size the reordering targets
+		size_t report_cache = 16; // FIFO cache size the ACMR is measured with
+		bool   overdraw = false;  // also apply optimize_overdraw to every surface
+		size_t threads = 1;       // 0 for one per hardware thread
+	};
+
+	struct IndexOptimizeReport {
+		size_t surfaces = 0;  // surfaces reordered, surfaces sharing the same index range are reordered together
+		size_t skipped = 0;   // surfaces left alone because their index range partially overlaps another surface's
+		size_t triangles = 0;
+		size_t misses_before = 0, misses_after = 0;
+
+		inline double acmr_before() const { return triangles ? static_cast<double>(misses_before) / triangles : 0; }
+		inline double acmr_after() const { return triangles ? static_cast<double>(misses_after) / triangles : 0; }
+	};
+
+	// reorder the drawindexes of every surface in place, surfaces keep their index ranges so nothing else needs rewriting
+	// a surface keeps its original order where the reordered one would miss the report_cache more often
+	// throws std::out_of_range if a surface's index or vertex range is outside of its lump or an index is outside of its vertices, before anything is changed
+	IndexOptimizeReport optimize_indices(BSPI::SurfaceArray const &, BSPI::VertexArray const &, BSPI::IndexArray &, IndexOptimizeOptions const & = {});
+
+}
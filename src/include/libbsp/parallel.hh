@@ -0,0 +1,65 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace BSP {
+
+	// number of threads used when 0 is requested
+	inline size_t hardware_threads() {
+		size_t n = std::thread::hardware_concurrency();
+		return n ? n : 1;
+	}
+
+	// calls func(i) for every i in [0, count) spread over up to the given number of threads (0 for one per hardware thread)
+	// the calling thread takes part, so a thread count of 1 runs everything inline
+	// indices are handed out one at a time, so callers with many tiny items should chunk them first
+	// the first exception thrown is rethrown on the calling thread once every thread has stopped
+	template <typename F>
+	void parallel_for(size_t count, size_t threads, F && func) {
+
+		if (!threads) threads = hardware_threads();
+		threads = std::min(threads, count);
+
+		if (threads <= 1) {
+			for (size_t i = 0; i < count; i++) func(i);
+			return;
+		}
+
+		std::atomic_size_t next { 0 };
+		std::atomic_bool failed { false };
+		std::exception_ptr error;
+		std::mutex error_mutex;
+
+		auto work = [&](){
+			size_t i;
+			while (!failed.load(std::memory_order_relaxed) && (i = next.fetch_add(1, std::memory_order_relaxed)) < count) {
+				try {
+					func(i);
+				} catch (...) {
+					std::scoped_lock lock { error_mutex };
+					if (!error) error = std::current_exception();
+					failed = true;
+				}
+			}
+		};
+
+		std::vector<std::thread> pool;
+		pool.reserve(threads - 1);
+		for (size_t t = 1; t < threads; t++) {
+			// if the system refuses more threads, carry on with the ones already running
+			try { pool.emplace_back(work); } catch (std::system_error const &) { break; }
+		}
+		work();
+		for (auto & thread : pool) thread.join();
+
+		if (error) std::rethrow_exception(error);
+	}
+
+}
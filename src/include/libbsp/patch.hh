@@ -0,0 +1,55 @@
+#pragma once
+
+#include "reader.hh"
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace BSP {
+
+	// a patch's control points are a grid of patch_width by patch_height drawverts, row by row, with both dimensions odd
+	// every 3x3 block of control points sharing its edges with its neighbours is a biquadratic Bezier span
+
+	struct PatchOptions {
+		int32_t level = 0;       // segments every span is divided into, 0 to choose per span from max_error
+		float   max_error = 4;   // in units, the bound |p0 - 2 p1 + p2| / (4 * segments^2) on how far each row and column of control points strays from its segments
+		int32_t max_level = 16;  // upper limit of segments per span when choosing from max_error
+	};
+
+	// tessellated patches, indices are triangles relative to the first vertex of the patch they belong to, as drawindexes are to their surface
+	struct PatchMesh {
+
+		struct Patch {
+			int32_t  surface;                 // LumpIndex::SURFACES
+			uint32_t first_vert, num_verts;   // into verts
+			uint32_t first_index, num_indices; // into indices
+			uint32_t width, height;           // of the tessellated vertex grid, verts are row by row
+		};
+
+		std::vector<DrawVert> verts;
+		std::vector<int32_t> indices;
+		std::vector<Patch> patches;
+	};
+
+	// the vertex grid tessellate_patch makes of a patch, found from the levels it would choose without tessellating anything
+	struct PatchExtent {
+		uint32_t width = 0, height = 0; // of the tessellated vertex grid
+		vec3_t mins {}, maxs {};        // of the tessellated positions, only when asked for, which evaluates the positions alone
+
+		inline size_t num_verts() const { return static_cast<size_t>(width) * height; }
+		inline size_t num_indices() const { return static_cast<size_t>(width - 1) * (height - 1) * 6; }
+	};
+
+	// throws std::out_of_range like tessellate_patch
+	PatchExtent measure_patch(int32_t surface_idx, Surface const & surface, std::span<DrawVert const> drawverts, PatchOptions const & = {}, bool bounds = false);
+
+	// tessellate a single patch, appending it to out
+	// throws std::out_of_range if the control grid is malformed or reaches past the drawverts
+	void tessellate_patch(int32_t surface_idx, Surface const & surface, std::span<DrawVert const> drawverts, PatchMesh & out, PatchOptions const & = {});
+
+	// tessellate every patch surface, patches are tessellated in parallel straight into their place in the output, 0 threads for one per hardware thread
+	// throws std::out_of_range like tessellate_patch if any one patch is malformed, and nothing is returned for the others
+	PatchMesh tessellate_patches(Reader const &, PatchOptions const & = {}, size_t threads = 1);
+
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "entities.hh"
 #include "file_fmt.hh"
 
 #include <meadow/istring.hh>
@@ -16,8 +17,11 @@ namespace BSP {
 		
 		inline Reader() = default;
 		inline Reader(uint8_t const * base) { rebase(base); }
+		inline Reader(uint8_t const * base, size_t size) { rebase(base, size); }
 		inline Reader(Reader const &) = default;
 		inline Reader(Reader &&) = default;
+		inline Reader & operator = (Reader const &) = default;
+		inline Reader & operator = (Reader &&) = default;
 		
 		inline ~Reader() = default;
 		
@@ -30,8 +34,15 @@ namespace BSP {
 		
 		inline void rebase(uint8_t const * base) {
 			m_base = reinterpret_cast<Header const *> (base);
+			m_size = 0;
 		}
 		
+		// same as above, but checks the header and every lump against the size of the data, throws ReadException if anything is out of bounds
+		void rebase(uint8_t const * base, size_t size);
+		
+		// size of the underlying data, or 0 if the reader was based without one
+		inline size_t size() const { return m_size; }
+		
 		inline Lump const & get_lump(LumpIndex lump_num) const {
 			return m_base->lumps[static_cast<size_t>(lump_num)];
 		}
@@ -43,6 +54,7 @@ namespace BSP {
 		
 		inline std::string_view get_string_view(LumpIndex lump_num) const {
 			Lump const & lump = get_lump(lump_num);
+			if (lump.size <= 0) return {};
 			return std::string_view {
 				reinterpret_cast<char const *>(reinterpret_cast<uint8_t const *>(m_base) + lump.offs),
 				static_cast<size_t>(lump.size - 1)
@@ -57,7 +69,7 @@ namespace BSP {
 			};
 		}
 		
-		inline BSP::Header const & header() { return *m_base; }
+		inline BSP::Header const & header() const { return *m_base; }
 		
 		// ================================
 		// CHECKS
@@ -69,14 +81,16 @@ namespace BSP {
 		// ================================
 		// ENTITIES
 		
-		using Entity = std::map<meadow::istring_view, meadow::istring_view, std::less<>>;
-		using EntityArray = std::vector<Entity>;
+		// parsed entities reference the entity lump, see EntityTable
+		using Entity = EntityTable::Entity;
+		using EntityArray = EntityTable;
 		
 		inline std::string_view entities() const {
 			return get_string_view(LumpIndex::ENTITIES);
 		}
 		
 		static EntityArray parse_entities(std::string_view const &);
+		static EntityArray parse_entities_scalar(std::string_view const &); // reference parser without SIMD scanning, for validation and benchmarking
 		EntityArray entities_parsed() const;
 		
 		// ================================
@@ -115,6 +129,11 @@ namespace BSP {
 			return get_data_span<Leaf const>(LumpIndex::LEAFS);
 		}
 		
+		// index of the leaf containing the point, found by descending the node tree from the root (the world model)
+		int32_t point_leaf(vec3_t const & point) const;
+		// same as above for many points at once, out must be at least as large as points
+		void point_leafs(std::span<vec3_t const> points, std::span<int32_t> out) const;
+		
 		// ================================
 		// LEAFSURFACES
 		
@@ -203,6 +222,10 @@ namespace BSP {
 			return get_data_span<Lightmap const>(LumpIndex::LIGHTMAPS);
 		}
 		
+		// whether the lightmaps are light and deluxe (light direction) pairs, as q3map2 -deluxe writes them, with surfaces referring to the light map of each
+		// taken from the worldspawn key deluxeMapping, which the renderers check for the same thing
+		bool deluxe_mapped() const;
+		
 		// ================================
 		// LIGHTGRID
 
@@ -259,6 +282,7 @@ namespace BSP {
 	private:
 		
 		Header const * m_base = nullptr;
+		size_t m_size = 0;
 		
 	};
 	
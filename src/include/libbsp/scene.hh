@@ -0,0 +1,85 @@
+#pragma once
+
+#include "reader.hh"
+#include "visibility.hh"
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace BSP {
+
+	// convex volume bounded by planes facing inwards, a point p is inside a plane if normal . p >= dist
+	struct Frustum {
+
+		struct Plane {
+			vec3_t normal;
+			float  dist;
+		};
+
+		std::array<Plane, 6> planes {};
+		size_t num_planes = 0;
+
+		// frustum of a perspective view, fields of view are full angles in degrees
+		// forward and up need not be normalized or exactly perpendicular, up is corrected to be perpendicular to forward
+		// with a far distance of 0 the frustum is unbounded in the view direction
+		static Frustum from_view(vec3_t const & origin, vec3_t const & forward, vec3_t const & up, float fov_x, float fov_y, float far = 0);
+
+		// whether any part of the box may be inside, boxes straddling a plane count as inside
+		inline bool intersects(vec3_t const & mins, vec3_t const & maxs) const {
+			for (size_t i = 0; i < num_planes; i++) {
+				Plane const & p = planes[i];
+				// the box corner furthest along the normal
+				float d = 0;
+				for (size_t a = 0; a < 3; a++) d += p.normal[a] * (p.normal[a] >= 0 ? maxs[a] : mins[a]);
+				if (d < p.dist) return false;
+			}
+			return true;
+		}
+	};
+
+	// visible surface queries against the world
+	// the leafs are regrouped by cluster at construction, so a query only touches the leafs of clusters in the viewer's PVS
+	// a Scene is immutable once constructed and can be queried from any number of threads, each with its own Query
+	// the Reader's data must outlive the Scene
+	struct Scene {
+
+		// per-thread scratch space for queries, reused between them so queries don't allocate once warmed up
+		struct Query {
+			std::vector<int32_t> surfaces; // result of the last query, LumpIndex::SURFACES
+			std::vector<uint32_t> marks;   // generation each surface was last added in, so the marks never need clearing
+			uint32_t generation = 0;
+		};
+
+		Scene() = delete;
+		explicit Scene(Reader const &);
+		~Scene() = default;
+
+		inline VisibilityTable const & visibility() const { return m_vis; }
+
+		// surfaces of every leaf that is in the PVS of the viewer's cluster and intersects the frustum, each surface appears once
+		// a viewer outside of every cluster (in the void or inside a brush) sees every leaf, as in the game
+		// the returned span is query.surfaces, valid until the next query with it
+		std::span<int32_t const> visible_surfaces(vec3_t const & origin, Frustum const &, Query &) const;
+		std::vector<int32_t> visible_surfaces(vec3_t const & origin, Frustum const &) const;
+
+	private:
+
+		struct LeafBounds {
+			vec3_t mins, maxs;
+			int32_t first_surface, num_surfaces; // LumpIndex::LEAFSURFACES, clamped to the lump
+		};
+
+		Reader m_bspr;
+		VisibilityTable m_vis;
+		size_t m_num_surfaces = 0;
+
+		// leafs grouped by cluster, cluster c's leafs are m_leafs[m_cluster_offsets[c], m_cluster_offsets[c + 1])
+		std::vector<uint32_t> m_cluster_offsets;
+		std::vector<LeafBounds> m_leafs;
+
+		void add_leaf(LeafBounds const &, Frustum const &, Query &) const;
+	};
+
+}
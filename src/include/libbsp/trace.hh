@@ -0,0 +1,70 @@
+#pragma once
+
+#include "reader.hh"
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace BSP {
+
+	// result of sweeping a point or a box from start to end through the world
+	struct TraceResult {
+		float   fraction = 1;       // fraction of the sweep completed before hitting something, 1 if nothing was hit
+		vec3_t  end {};             // position reached, start + fraction * (end - start)
+		int32_t plane = -1;         // LumpIndex::PLANES, the plane that was hit, -1 if nothing was hit
+		vec3_t  normal {};          // normal of the plane that was hit
+		int32_t brush = -1;         // LumpIndex::BRUSHES, the brush that was hit, -1 if nothing was hit
+		int32_t contents = 0;       // content flags of the brush that was hit
+		int32_t surface_flags = 0;  // surface flags of the brush side that was hit
+		bool    start_solid = false; // the sweep started inside a brush
+		bool    all_solid = false;   // the sweep never left a brush, fraction is 0
+	};
+
+	struct TraceRay {
+		vec3_t start, end;
+	};
+
+	// collision queries against the brushes of the world model
+	// the brush planes are copied into a layout that can be tested several sides at a time, everything else is read from the Reader, which must outlive the Tracer
+	// a Tracer is immutable once constructed, so any number of threads can trace through the same one
+	struct Tracer {
+
+		Tracer() = delete;
+		explicit Tracer(Reader const &);
+		~Tracer() = default;
+
+		// sweep a point (a line trace), only brushes with contents matching the mask are hit
+		TraceResult trace(vec3_t const & start, vec3_t const & end, int32_t content_mask = -1) const;
+		// sweep an axis-aligned box, mins and maxs are relative to the start and end points
+		TraceResult trace(vec3_t const & start, vec3_t const & end, vec3_t const & mins, vec3_t const & maxs, int32_t content_mask = -1) const;
+
+		// many sweeps of the same box (use zero extents for lines), out must be at least as large as rays
+		// rays are handed out to threads in packets, 0 threads for one per hardware thread
+		void trace(std::span<TraceRay const> rays, std::span<TraceResult> out, vec3_t const & mins, vec3_t const & maxs, int32_t content_mask = -1, size_t threads = 1) const;
+
+	private:
+
+		struct BrushEntry {
+			uint32_t first_side; // index into the side arrays
+			uint32_t num_sides;  // padded up to a multiple of the SIMD width
+			int32_t  contents;
+		};
+
+		struct Work;
+
+		void trace_node(Work &, int32_t num, float p1f, float p2f, vec3_t const & p1, vec3_t const & p2) const;
+		void trace_leaf(Work &, int32_t leaf) const;
+		void clip_brush(Work &, int32_t brush) const;
+		void trace(Work &) const;
+
+		Reader m_bspr;
+		std::vector<BrushEntry> m_brushes;
+
+		// brush sides as separate arrays of normal components and distances, each brush's run padded with sides that can never clip
+		std::vector<float> m_side_x, m_side_y, m_side_z, m_side_dist;
+		std::vector<int32_t> m_side_plane;
+		std::vector<int32_t> m_side_surface_flags;
+	};
+
+}
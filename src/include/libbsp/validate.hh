@@ -0,0 +1,43 @@
+#pragma once
+
+#include "reader.hh"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace BSP {
+
+	struct Diagnostic {
+		LumpIndex   lump;    // lump of the element at fault
+		size_t      element; // its index within the lump, or 0 for problems with the lump as a whole
+		LumpIndex   target;  // lump the bad reference points into, the same as lump for problems within it
+		int64_t     value;   // the reference, count, or size at fault
+		std::string message;
+	};
+
+	struct ValidationOptions {
+		size_t threads = 1;               // threads checking lumps, 0 for one per hardware thread
+		size_t max_diagnostics = 1000;    // diagnostics kept, the rest are only counted
+		bool   check_indices = true;      // check every drawindex against its surface's vertices, most of the time taken on large maps
+	};
+
+	struct ValidationReport {
+		std::vector<Diagnostic> diagnostics; // problems with whole lumps first, then by lump and element
+		size_t count = 0;                    // diagnostics found, including those not kept
+
+		inline bool ok() const { return !count; }
+	};
+
+	// check every reference between lumps against the sizes of the lumps it refers into, so the rest of the library can index without bounds checks:
+	//   lumps whose size is not a whole number of elements
+	//   nodes to planes and to child nodes and leafs, children coming after their node so the tree has no cycles
+	//   leafs to clusters and areas, leafsurfaces, and leafbrushes, and those to surfaces and brushes
+	//   models to surfaces and brushes, brushes to brush sides and shaders, brush sides to planes and shaders, fogs to brushes and brush sides
+	//   surfaces to shaders, fogs, drawverts, drawindexes, and lightmaps, patch sizes, and drawindexes to the vertices of their surface
+	//   the visibility header against the size of its lump, and the lightarray against the lightgrid
+	// lumps are split into chunks checked in parallel, the report comes out the same for any number of threads
+	// the lumps themselves must lie within the file, as Reader::rebase checks when given a size
+	ValidationReport validate(Reader const &, ValidationOptions const & = {});
+
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "reader.hh"
+
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace BSP {
+
+	// read-only set of clusters, one bit per cluster in 64-bit words
+	// the word count is always a multiple of BLOCK_WORDS and every bit past the last cluster is clear, so operations never need to handle a tail
+	struct ClusterSetView {
+
+		static constexpr size_t BLOCK_WORDS = 4; // 256 bits, the widest vector the set operations use
+
+		inline ClusterSetView() = default;
+		inline ClusterSetView(std::span<uint64_t const> words, size_t clusters) : m_words(words), m_clusters(clusters) {}
+
+		inline size_t clusters() const { return m_clusters; }
+		inline std::span<uint64_t const> words() const { return m_words; }
+
+		inline bool test(int32_t cluster) const {
+			return cluster >= 0 && static_cast<size_t>(cluster) < m_clusters && (m_words[cluster >> 6] >> (cluster & 63) & 1);
+		}
+
+		size_t count() const;                            // number of clusters in the set
+		bool any() const;
+		bool intersects(ClusterSetView const &) const;   // whether any cluster is in both sets
+		size_t count_common(ClusterSetView const &) const; // number of clusters in both sets, without building the intersection
+
+		// calls func(cluster) for every cluster in the set, in ascending order
+		template <typename F> void for_each(F && func) const {
+			for (size_t w = 0; w < m_words.size(); w++)
+				for (uint64_t bits = m_words[w]; bits; bits &= bits - 1)
+					func(static_cast<int32_t>(w * 64 + std::countr_zero(bits)));
+		}
+
+		// number of words needed for a set of the given number of clusters
+		static inline size_t words_for(size_t clusters) {
+			return (clusters + BLOCK_WORDS * 64 - 1) / (BLOCK_WORDS * 64) * BLOCK_WORDS;
+		}
+
+	private:
+		std::span<uint64_t const> m_words;
+		size_t m_clusters = 0;
+	};
+
+	// owning, modifiable set of clusters, see ClusterSetView
+	// the set operations require both sets to be sized for the same number of clusters, and throw std::length_error if they aren't
+	struct ClusterSet {
+
+		inline ClusterSet() = default;
+		inline explicit ClusterSet(size_t clusters) : m_words(ClusterSetView::words_for(clusters)), m_clusters(clusters) {}
+		inline explicit ClusterSet(ClusterSetView const & view) : m_words(view.words().begin(), view.words().end()), m_clusters(view.clusters()) {}
+
+		inline operator ClusterSetView() const { return view(); }
+		inline ClusterSetView view() const { return { m_words, m_clusters }; }
+
+		inline size_t clusters() const { return m_clusters; }
+		inline std::span<uint64_t const> words() const { return m_words; }
+
+		inline bool test(int32_t cluster) const { return view().test(cluster); }
+		inline size_t count() const { return view().count(); }
+		inline bool any() const { return view().any(); }
+		inline bool intersects(ClusterSetView const & other) const { return view().intersects(other); }
+		inline size_t count_common(ClusterSetView const & other) const { return view().count_common(other); }
+		template <typename F> void for_each(F && func) const { view().for_each(std::forward<F>(func)); }
+
+		inline void set(int32_t cluster) {
+			if (cluster >= 0 && static_cast<size_t>(cluster) < m_clusters) m_words[cluster >> 6] |= uint64_t { 1 } << (cluster & 63);
+		}
+		inline void reset(int32_t cluster) {
+			if (cluster >= 0 && static_cast<size_t>(cluster) < m_clusters) m_words[cluster >> 6] &= ~(uint64_t { 1 } << (cluster & 63));
+		}
+		void clear();
+		void fill();
+
+		ClusterSet & operator |= (ClusterSetView const &); // union
+		ClusterSet & operator &= (ClusterSetView const &); // intersection
+		ClusterSet & operator -= (ClusterSetView const &); // difference
+
+	private:
+		std::vector<uint64_t> m_words;
+		size_t m_clusters = 0;
+	};
+
+	// the potentially visible set of every cluster, decoded from the visibility lump into rows that can be combined a vector at a time
+	// without visibility data every cluster can see every other, as in the game, with the cluster count taken from the leafs
+	struct VisibilityTable {
+
+		VisibilityTable() = default;
+		explicit VisibilityTable(Reader const &);
+
+		inline size_t clusters() const { return m_clusters; }
+
+		// clusters visible from a cluster, clusters outside the table see nothing
+		inline ClusterSetView pvs(int32_t cluster) const {
+			if (cluster < 0 || static_cast<size_t>(cluster) >= m_clusters) return { m_empty, m_clusters };
+			return { std::span<uint64_t const> { m_rows.data() + m_stride * cluster, m_stride }, m_clusters };
+		}
+
+		inline bool can_see(int32_t from, int32_t to) const { return pvs(from).test(to); }
+
+		// every cluster visible from at least one of the given clusters
+		ClusterSet visible_from_any(std::span<int32_t const> clusters) const;
+		void visible_from_any(std::span<int32_t const> clusters, ClusterSet & out) const; // reuses out's storage
+		// clusters visible from every one of the given clusters
+		ClusterSet visible_from_all(std::span<int32_t const> clusters) const;
+
+		// potentially hearable set, for every cluster the union of the PVS of every cluster it can see, as the game builds for sounds and events
+		// rows are built in parallel, 0 threads for one per hardware thread
+		VisibilityTable phs(size_t threads = 1) const;
+
+		// bytes held by the rows
+		inline size_t memory() const { return (m_rows.size() + m_empty.size()) * sizeof(uint64_t); }
+
+		// ================================
+		// SIDECAR CACHE
+
+		// derived tables such as the PHS can be saved next to the BSP and loaded instead of rebuilt
+		// the key identifies the data the table was derived from and what it holds, a cache with a different key is treated as missing
+
+		enum struct Kind : uint32_t {
+			PVS,
+			PHS,
+		};
+
+		struct CacheKey {
+			uint64_t hash = 0;     // of the visibility lump
+			uint32_t clusters = 0; // of the table the source decodes to, checked before a cache is read
+			Kind kind = Kind::PVS;
+		};
+
+		static CacheKey source_key(Reader const &, Kind);
+		// written to a uniquely named temporary file and renamed over path, false on failure or if the key's cluster count isn't this table's
+		bool save(std::string const & path, CacheKey const &) const;
+		static std::optional<VisibilityTable> load(std::string const & path, CacheKey const &); // nullopt if missing, unreadable, or stale
+
+	private:
+		size_t m_clusters = 0;
+		size_t m_stride = 0; // words per row
+		std::vector<uint64_t> m_rows;
+		std::vector<uint64_t> m_empty;
+	};
+
+}
@@ -1,24 +1,191 @@
 #include "libbsp/assembler.hh"
+#include "libbsp/parallel.hh"
 
-BSPI::ByteArray BSP::Assembler::assemble() {
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+
+static std::string errno_string(char const * what) {
+	return std::string { what } + ": " + std::strerror(errno);
+}
+
+// runs func(l) for every lump in the list, each thread-safe provider as its own task, and every other provider together in one task so they never overlap
+template <typename F>
+void BSP::Assembler::dispatch(std::vector<size_t> const & lumps, F && func) {
+	
+	std::vector<size_t> unsafe;
+	std::vector<std::vector<size_t>> tasks;
+	for (size_t l : lumps) {
+		if (threads != 1 && providers[l]->thread_safe()) tasks.push_back({ l });
+		else unsafe.push_back(l);
+	}
+	if (!unsafe.empty()) tasks.push_back(std::move(unsafe));
+	
+	BSP::parallel_for(tasks.size(), threads, [&](size_t t){
+		for (size_t l : tasks[t]) func(l);
+	});
+}
+
+void BSP::Assembler::collect(Lumps & lumps) {
 	
 	for (auto const & ptr : providers) if (!ptr) throw std::logic_error {"a provider cannot be null"};
 	
-	BSPI::ByteArray bytes;
+	// lumps that can be viewed are taken as they are, lumps with a size hint are left to be generated into their final slot, the rest are generated now
+	std::vector<size_t> generate;
+	for (size_t l = 0; l < 18; l++) {
+		BSP::LumpIndex li = static_cast<BSP::LumpIndex>(l);
+		if (auto view = providers[l]->view_lump_segments(li)) {
+			lumps.data[l] = std::move(*view);
+		} else if (auto hint = providers[l]->size_hint(li)) {
+			lumps.hinted[l] = *hint;
+		} else {
+			generate.push_back(l);
+		}
+	}
+	
+	dispatch(generate, [&](size_t l){
+		lumps.generated[l] = providers[l]->generate_lump(static_cast<BSP::LumpIndex>(l));
+		lumps.data[l] = { lumps.generated[l] };
+	});
+}
+
+void BSP::Assembler::generate_hinted(Lumps const & lumps, std::array<std::span<uint8_t>, 18> const & slots) {
+	
+	std::vector<size_t> hinted;
+	for (size_t l = 0; l < 18; l++) if (lumps.hinted[l]) hinted.push_back(l);
+	
+	dispatch(hinted, [&](size_t l){
+		providers[l]->generate_into(static_cast<BSP::LumpIndex>(l), slots[l]);
+	});
+}
+
+BSP::Header BSP::Assembler::make_header(Lumps const & lumps) {
 	
 	BSP::Header header;
 	header.ident = BSP::IDENT;
 	header.version = BSP::VERSION;
 	
-	bytes.resize(sizeof(BSP::Header));
+	size_t offs = sizeof(BSP::Header);
 	for (size_t l = 0; l < 18; l++) {
-		BSP::LumpIndex li = static_cast<BSP::LumpIndex>(l);
-		auto lump_bytes = providers[l]->generate_lump(li);
-		header.lumps[l].offs = bytes.size();
-		bytes.insert(bytes.end(), lump_bytes.begin(), lump_bytes.end());
-		header.lumps[l].size = lump_bytes.size();
+		size_t size = 0;
+		if (lumps.hinted[l]) size = *lumps.hinted[l];
+		else for (auto const & seg : lumps.data[l]) size += seg.size();
+		if (offs + size > INT32_MAX) throw std::length_error {"BSP too large for 32-bit lump offsets"};
+		header.lumps[l].offs = offs;
+		header.lumps[l].size = size;
+		offs += size;
 	}
+	
+	return header;
+}
+
+BSPI::ByteArray BSP::Assembler::assemble() {
+	
+	Lumps lumps;
+	collect(lumps);
+	BSP::Header header = make_header(lumps);
+	
+	// every lump size is known at this point, so the output is allocated exactly once and hinted lumps are generated straight into it
+	size_t total = header.lumps[17].offs + header.lumps[17].size;
+	BSPI::ByteArray bytes (total);
 	memcpy(bytes.data(), &header, sizeof(BSP::Header));
 	
+	std::array<std::span<uint8_t>, 18> slots;
+	for (size_t l = 0; l < 18; l++) {
+		slots[l] = { bytes.data() + header.lumps[l].offs, static_cast<size_t>(header.lumps[l].size) };
+		if (lumps.hinted[l]) continue;
+		uint8_t * out = slots[l].data();
+		for (auto const & seg : lumps.data[l]) {
+			if (seg.empty()) continue;
+			memcpy(out, seg.data(), seg.size());
+			out += seg.size();
+		}
+	}
+	generate_hinted(lumps, slots);
+	
 	return bytes;
 }
+
+void BSP::Assembler::write_to(int fd) {
+	
+	Lumps lumps;
+	collect(lumps);
+	BSP::Header header = make_header(lumps);
+	
+	// hinted lumps still need somewhere to live before being written, but each gets a single exactly sized allocation
+	std::array<std::span<uint8_t>, 18> slots;
+	for (size_t l = 0; l < 18; l++) {
+		if (!lumps.hinted[l]) continue;
+		lumps.generated[l].resize(*lumps.hinted[l]);
+		slots[l] = lumps.generated[l];
+		lumps.data[l] = { lumps.generated[l] };
+	}
+	generate_hinted(lumps, slots);
+	
+	std::vector<iovec> iov;
+	iov.push_back({ &header, sizeof(BSP::Header) });
+	for (size_t l = 0; l < 18; l++) {
+		for (auto const & seg : lumps.data[l]) {
+			if (!seg.empty()) iov.push_back({ const_cast<uint8_t *>(seg.data()), seg.size() });
+		}
+	}
+	
+	// pwritev may stop short and takes at most IOV_MAX runs per call, so keep going from wherever it left off until everything is out
+	iovec * cur = iov.data();
+	size_t remaining = iov.size();
+	off_t offs = 0;
+	while (remaining) {
+		ssize_t written = pwritev(fd, cur, std::min<size_t>(remaining, IOV_MAX), offs);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			throw WriteException { errno_string("failed to write BSP") };
+		}
+		if (!written) throw WriteException { "failed to write BSP: no progress" };
+		offs += written;
+		while (remaining && static_cast<size_t>(written) >= cur->iov_len) {
+			written -= cur->iov_len;
+			cur++;
+			remaining--;
+		}
+		if (remaining) {
+			cur->iov_base = reinterpret_cast<uint8_t *>(cur->iov_base) + written;
+			cur->iov_len -= written;
+		}
+	}
+	
+	if (ftruncate(fd, offs) == -1) throw WriteException { errno_string("failed to truncate BSP") };
+}
+
+void BSP::Assembler::write_to(std::string const & path) {
+	
+	// keep the permissions of the file being replaced, mkstemp creates files readable only by the owner
+	mode_t mode = 0644;
+	struct stat sb;
+	if (stat(path.c_str(), &sb) == 0) mode = sb.st_mode & 07777;
+	
+	std::string tmp_path = path + ".XXXXXX";
+	int fd = mkstemp(tmp_path.data());
+	if (fd == -1) throw WriteException { errno_string(("failed to create temporary file for \"" + path + "\"").c_str()) };
+	
+	try {
+		write_to(fd);
+		if (fchmod(fd, mode) == -1) throw WriteException { errno_string("failed to set permissions of BSP") };
+		if (fsync(fd) == -1) throw WriteException { errno_string("failed to flush BSP") };
+		if (close(fd) == -1) {
+			fd = -1;
+			throw WriteException { errno_string("failed to close BSP") };
+		}
+		fd = -1;
+		if (rename(tmp_path.c_str(), path.c_str()) == -1) throw WriteException { errno_string(("failed to rename BSP over \"" + path + "\"").c_str()) };
+	} catch (...) {
+		if (fd != -1) close(fd);
+		unlink(tmp_path.c_str());
+		throw;
+	}
+}
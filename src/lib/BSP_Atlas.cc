@@ -0,0 +1,116 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+using namespace BSP;
+
+// slots for lightmaps along one side of a page
+static inline uint32_t page_columns(uint32_t size) { return size / LIGHTMAP_DIM; }
+
+// smallest page that holds the given number of lightmaps, starting from a single lightmap
+static uint32_t page_size_for(size_t count) {
+	uint32_t size = LIGHTMAP_DIM;
+	while (static_cast<size_t>(page_columns(size)) * page_columns(size) < count) size *= 2;
+	return size;
+}
+
+LightmapAtlas BSP::pack_lightmaps(std::span<Lightmap const> lightmaps, LightmapAtlasOptions const & opts) {
+	static constexpr uint32_t MIN_SIZE = 256, MAX_SIZE = 4096;
+
+	uint32_t size = opts.size;
+	if (size && (size < MIN_SIZE || size > MAX_SIZE || (size & (size - 1))))
+		throw std::invalid_argument { "atlas size " + std::to_string(size) + " is not a power of two from " + std::to_string(MIN_SIZE) + " to " + std::to_string(MAX_SIZE) };
+
+	// with deluxe maps every slot is a pair, laid out once and used for both pages of the pair
+	size_t const stride = opts.deluxe ? 2 : 1;
+	if (lightmaps.size() % stride)
+		throw std::invalid_argument { "deluxe mapped lightmaps come in pairs, but there are " + std::to_string(lightmaps.size()) };
+	size_t const slots = lightmaps.size() / stride;
+	if (!size) size = std::clamp(page_size_for(slots), MIN_SIZE, MAX_SIZE);
+
+	size_t const per_page = static_cast<size_t>(page_columns(size)) * page_columns(size);
+	size_t const page_count = (slots + per_page - 1) / per_page * stride;
+
+	LightmapAtlas atlas;
+	atlas.deluxe = opts.deluxe;
+	atlas.pages.resize(page_count);
+	for (size_t p = 0; p < page_count; p++)
+		atlas.pages[p].size = p + stride < page_count ? size : page_size_for(slots - p / stride * per_page);
+
+	atlas.placements.resize(lightmaps.size());
+	for (size_t i = 0; i < lightmaps.size(); i++) {
+		size_t const slot_idx = i / stride;
+		uint32_t page = slot_idx / per_page * stride + i % stride, slot = slot_idx % per_page, columns = page_columns(atlas.pages[page].size);
+		atlas.placements[i] = { page, slot % columns * LIGHTMAP_DIM, slot / columns * LIGHTMAP_DIM };
+	}
+
+	parallel_for(page_count, opts.threads, [&](size_t p){
+		AtlasPage & page = atlas.pages[p];
+		page.pixels.assign(static_cast<size_t>(page.size) * page.size, Color {});
+		size_t const first = p / stride * per_page, last = std::min(slots, first + per_page);
+		for (size_t slot_idx = first; slot_idx < last; slot_idx++) {
+			size_t const i = slot_idx * stride + p % stride;
+			AtlasPlacement const & place = atlas.placements[i];
+			for (uint32_t row = 0; row < LIGHTMAP_DIM; row++)
+				std::memcpy(&page.pixels[static_cast<size_t>(place.y + row) * page.size + place.x], lightmaps[i].pixels[row], sizeof(lightmaps[i].pixels[row]));
+		}
+	});
+
+	return atlas;
+}
+
+void BSP::apply_lightmap_atlas(LightmapAtlas const & atlas, BSPI::SurfaceArray & surfaces, BSPI::VertexArray & verts, size_t threads) {
+
+	// the lightmap each vertex is in per style, so a vertex shared by several surfaces is only moved once
+	std::vector<int32_t> owner (verts.size() * LIGHTSTYLES, -1);
+
+	for (size_t s = 0; s < surfaces.size(); s++) {
+		Surface const & surface = surfaces[s];
+		for (size_t k = 0; k < LIGHTSTYLES; k++) {
+			int32_t lightmap = surface.lightmap[k];
+			if (lightmap < 0) continue;
+			if (static_cast<size_t>(lightmap) >= atlas.placements.size())
+				throw std::out_of_range { "surface " + std::to_string(s) + " refers past the lightmaps" };
+			if (atlas.deluxe && lightmap % 2)
+				throw std::logic_error { "surface " + std::to_string(s) + " refers to deluxe map " + std::to_string(lightmap) + " instead of a light map" };
+			if (!surface.vert_count) continue;
+			if (surface.vert_idx < 0 || surface.vert_count < 0 || static_cast<size_t>(surface.vert_idx + surface.vert_count) > verts.size())
+				throw std::out_of_range { "surface " + std::to_string(s) + " reaches past the drawverts" };
+			for (int32_t v = surface.vert_idx; v < surface.vert_idx + surface.vert_count; v++) {
+				int32_t & own = owner[v * LIGHTSTYLES + k];
+				if (own >= 0 && own != lightmap)
+					throw std::logic_error { "surface " + std::to_string(s) + " shares vertex " + std::to_string(v) + " with a surface in another lightmap" };
+				own = lightmap;
+			}
+		}
+	}
+
+	for (Surface & surface : surfaces) {
+		for (size_t k = 0; k < LIGHTSTYLES; k++) {
+			if (surface.lightmap[k] < 0) continue;
+			AtlasPlacement const & place = atlas.placements[surface.lightmap[k]];
+			surface.lightmap[k] = place.page;
+			surface.lightmap_x[k] += place.x;
+			surface.lightmap_y[k] += place.y;
+		}
+	}
+
+	static constexpr size_t CHUNK = 16384;
+	parallel_for((verts.size() + CHUNK - 1) / CHUNK, threads, [&](size_t c){
+		size_t const last = std::min(verts.size(), (c + 1) * CHUNK);
+		for (size_t v = c * CHUNK; v < last; v++) {
+			for (size_t k = 0; k < LIGHTSTYLES; k++) {
+				int32_t own = owner[v * LIGHTSTYLES + k];
+				if (own < 0) continue;
+				AtlasPlacement const & place = atlas.placements[own];
+				float const scale = 1.0f / atlas.pages[place.page].size;
+				float * uv = verts[v].lightmap[k];
+				uv[0] = (place.x + uv[0] * LIGHTMAP_DIM) * scale;
+				uv[1] = (place.y + uv[1] * LIGHTMAP_DIM) * scale;
+			}
+		}
+	});
+}
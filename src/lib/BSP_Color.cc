@@ -0,0 +1,225 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace BSP;
+
+namespace {
+
+	// ================================
+	// LANES
+
+	// the handful of float operations the kernel needs, over as many lanes as the target has
+	// only exactly rounded operations are used, so the vector kernels and the scalar fallback agree on every color
+
+#if defined(__AVX2__)
+	struct Lanes {
+		using V = __m256;
+		static constexpr size_t WIDTH = 8;
+		static inline V load(float const * p) { return _mm256_load_ps(p); }
+		static inline V set(float v) { return _mm256_set1_ps(v); }
+		static inline V add(V a, V b) { return _mm256_add_ps(a, b); }
+		static inline V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+		static inline V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+		static inline V div(V a, V b) { return _mm256_div_ps(a, b); }
+		static inline V min(V a, V b) { return _mm256_min_ps(a, b); }
+		static inline V max(V a, V b) { return _mm256_max_ps(a, b); }
+		static inline void truncate(V v, int32_t * out) { _mm256_store_si256(reinterpret_cast<__m256i *>(out), _mm256_cvttps_epi32(v)); }
+	};
+#elif defined(__SSE2__)
+	struct Lanes {
+		using V = __m128;
+		static constexpr size_t WIDTH = 4;
+		static inline V load(float const * p) { return _mm_load_ps(p); }
+		static inline V set(float v) { return _mm_set1_ps(v); }
+		static inline V add(V a, V b) { return _mm_add_ps(a, b); }
+		static inline V sub(V a, V b) { return _mm_sub_ps(a, b); }
+		static inline V mul(V a, V b) { return _mm_mul_ps(a, b); }
+		static inline V div(V a, V b) { return _mm_div_ps(a, b); }
+		static inline V min(V a, V b) { return _mm_min_ps(a, b); }
+		static inline V max(V a, V b) { return _mm_max_ps(a, b); }
+		static inline void truncate(V v, int32_t * out) { _mm_store_si128(reinterpret_cast<__m128i *>(out), _mm_cvttps_epi32(v)); }
+	};
+#else
+	struct Lanes {
+		using V = float;
+		static constexpr size_t WIDTH = 1;
+		static inline V load(float const * p) { return *p; }
+		static inline V set(float v) { return v; }
+		static inline V add(V a, V b) { return a + b; }
+		static inline V sub(V a, V b) { return a - b; }
+		static inline V mul(V a, V b) { return a * b; }
+		static inline V div(V a, V b) { return a / b; }
+		static inline V min(V a, V b) { return b < a ? b : a; }
+		static inline V max(V a, V b) { return a < b ? b : a; }
+		static inline void truncate(V v, int32_t * out) { *out = static_cast<int32_t>(v); }
+	};
+#endif
+
+	// ================================
+	// KERNEL
+
+	// Rec. 601 luma, the weights the engine uses for greyscale
+	static constexpr float LUMA_R = 0.299f, LUMA_G = 0.587f, LUMA_B = 0.114f;
+
+	// pixels per batch, a multiple of every lane width, small enough to stay in L1
+	static constexpr size_t BATCH = 64;
+	static_assert(BATCH % Lanes::WIDTH == 0);
+
+	struct ColorKernel {
+		ColorTransform xf;
+		float linear[256];  // gamma and overbright, the part of the transform that is always per channel
+		uint8_t table[256]; // the whole transform, when it is per channel
+
+		explicit ColorKernel(ColorTransform const & xf) : xf { xf } {
+			if (xf.overbright_bits < -8 || xf.overbright_bits > 8)
+				throw std::invalid_argument { "overbright bits " + std::to_string(xf.overbright_bits) + " is not from -8 to 8" };
+			if (!(xf.gamma > 0) || !std::isfinite(xf.gamma))
+				throw std::invalid_argument { "gamma " + std::to_string(xf.gamma) + " is not positive" };
+			if (!(xf.saturation >= 0) || !std::isfinite(xf.saturation))
+				throw std::invalid_argument { "saturation " + std::to_string(xf.saturation) + " is negative" };
+			if (xf.tonemap == Tonemap::REINHARD && (!(xf.white > 0) || !std::isfinite(xf.white)))
+				throw std::invalid_argument { "white point " + std::to_string(xf.white) + " is not positive" };
+
+			float const scale = std::ldexp(1.0f, xf.overbright_bits);
+			for (size_t i = 0; i < 256; i++)
+				linear[i] = std::pow(i / 255.0f, 1.0f / xf.gamma) * scale;
+
+			if (xf.per_channel()) {
+				alignas(32) float c[256];
+				alignas(32) int32_t q[256];
+				std::copy(std::begin(linear), std::end(linear), c);
+				finish(c, c, c, q, q, q, 256);
+				for (size_t i = 0; i < 256; i++) table[i] = q[i];
+			}
+		}
+
+		// saturation, tonemap, and quantization of count channels already through linear, count a multiple of the lane width
+		void finish(float * r, float * g, float * b, int32_t * qr, int32_t * qg, int32_t * qb, size_t count) const {
+			using L = Lanes;
+			bool const same = r == g && g == b;
+			L::V const zero = L::set(0), one = L::set(1), half = L::set(0.5f), full = L::set(255);
+			L::V const sat = L::set(xf.saturation), inv_white2 = L::set(1.0f / (xf.white * xf.white));
+			L::V const wr = L::set(LUMA_R), wg = L::set(LUMA_G), wb = L::set(LUMA_B);
+
+			auto reinhard = [&](L::V c){ return L::div(L::mul(c, L::add(one, L::mul(c, inv_white2))), L::add(one, c)); };
+			auto quantize = [&](L::V c, int32_t * out){ L::truncate(L::add(L::mul(L::min(L::max(c, zero), one), full), half), out); };
+
+			for (size_t i = 0; i < count; i += L::WIDTH) {
+				L::V vr = L::load(r + i), vg = L::load(g + i), vb = L::load(b + i);
+				if (xf.saturation != 1) {
+					L::V const y = L::add(L::add(L::mul(vr, wr), L::mul(vg, wg)), L::mul(vb, wb));
+					vr = L::add(y, L::mul(L::sub(vr, y), sat));
+					vg = L::add(y, L::mul(L::sub(vg, y), sat));
+					vb = L::add(y, L::mul(L::sub(vb, y), sat));
+					// oversaturating can push a channel below black, which no tonemap expects
+					vr = L::max(vr, zero);
+					vg = L::max(vg, zero);
+					vb = L::max(vb, zero);
+				}
+				switch (xf.tonemap) {
+					case Tonemap::CLAMP:
+						break;
+					case Tonemap::NORMALIZE: {
+						L::V const peak = L::max(L::max(L::max(vr, vg), vb), one);
+						vr = L::div(vr, peak);
+						vg = L::div(vg, peak);
+						vb = L::div(vb, peak);
+						break;
+					}
+					case Tonemap::REINHARD:
+						vr = reinhard(vr);
+						vg = reinhard(vg);
+						vb = reinhard(vb);
+						break;
+				}
+				quantize(vr, qr + i);
+				if (same) continue;
+				quantize(vg, qg + i);
+				quantize(vb, qb + i);
+			}
+		}
+
+		void operator()(Color * pixels, size_t count) const {
+			if (xf.per_channel()) {
+				for (size_t i = 0; i < count; i++) {
+					Color & c = pixels[i];
+					c = { table[c.r], table[c.g], table[c.b] };
+				}
+				return;
+			}
+
+			// split into planes a batch at a time, the last batch padded with black so the kernels never need a scalar tail
+			alignas(32) float r[BATCH], g[BATCH], b[BATCH];
+			alignas(32) int32_t qr[BATCH], qg[BATCH], qb[BATCH];
+			for (size_t first = 0; first < count; first += BATCH) {
+				size_t const n = std::min(BATCH, count - first);
+				size_t const padded = (n + Lanes::WIDTH - 1) / Lanes::WIDTH * Lanes::WIDTH;
+				Color * batch = pixels + first;
+				for (size_t i = 0; i < n; i++) {
+					r[i] = linear[batch[i].r];
+					g[i] = linear[batch[i].g];
+					b[i] = linear[batch[i].b];
+				}
+				std::fill(r + n, r + padded, 0.0f);
+				std::fill(g + n, g + padded, 0.0f);
+				std::fill(b + n, b + padded, 0.0f);
+				finish(r, g, b, qr, qg, qb, padded);
+				for (size_t i = 0; i < n; i++)
+					batch[i] = { static_cast<uint8_t>(qr[i]), static_cast<uint8_t>(qg[i]), static_cast<uint8_t>(qb[i]) };
+			}
+		}
+	};
+
+}
+
+// ================================
+// TRANSFORMS
+
+void BSP::transform_colors(std::span<Color> colors, ColorTransform const & xf) {
+	ColorKernel const kernel { xf };
+	kernel(colors.data(), colors.size());
+}
+
+void BSP::transform_lightmaps(BSPI::LightmapArray & lightmaps, ColorTransform const & xf, size_t threads, bool deluxe) {
+	ColorKernel const kernel { xf };
+
+	// deluxe maps hold encoded light directions rather than colors, so only the light map of each pair is touched
+	size_t const stride = deluxe ? 2 : 1;
+	if (lightmaps.size() % stride)
+		throw std::invalid_argument { "deluxe mapped lightmaps come in pairs, but there are " + std::to_string(lightmaps.size()) };
+
+	parallel_for(lightmaps.size() / stride, threads, [&](size_t i){ kernel(&lightmaps[i * stride].pixels[0][0], LIGHTMAP_PIXELS); });
+}
+
+void BSP::transform_lightgrid(BSPI::LightgridArray & cells, ColorTransform const & xf, size_t threads) {
+	ColorKernel const kernel { xf };
+
+	// cells are only 30 bytes, so they're done in runs with their colors gathered together
+	static constexpr size_t CHUNK = 4096;
+	static constexpr size_t COLORS = LIGHTSTYLES * 2;
+	parallel_for((cells.size() + CHUNK - 1) / CHUNK, threads, [&](size_t c){
+		size_t const first = c * CHUNK, last = std::min(cells.size(), first + CHUNK);
+		std::vector<Color> colors ((last - first) * COLORS);
+		for (size_t i = first; i < last; i++) {
+			Color * dst = &colors[(i - first) * COLORS];
+			std::copy(std::begin(cells[i].ambient), std::end(cells[i].ambient), dst);
+			std::copy(std::begin(cells[i].direct), std::end(cells[i].direct), dst + LIGHTSTYLES);
+		}
+		kernel(colors.data(), colors.size());
+		for (size_t i = first; i < last; i++) {
+			Color const * src = &colors[(i - first) * COLORS];
+			std::copy(src, src + LIGHTSTYLES, cells[i].ambient);
+			std::copy(src + LIGHTSTYLES, src + COLORS, cells[i].direct);
+		}
+	});
+}
@@ -0,0 +1,290 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+using namespace BSP;
+
+// ================================
+// ENCODINGS
+
+// after Fabian Giesen's float_to_half_fast3_rtne
+uint16_t BSP::to_half(float value) {
+	static constexpr uint32_t F32_INFINITY = 255 << 23;
+	static constexpr uint32_t F16_MAX = (127 + 16) << 23;
+	static constexpr uint32_t DENORM_MAGIC = ((127 - 15) + (23 - 10) + 1) << 23;
+
+	uint32_t bits = std::bit_cast<uint32_t>(value);
+	uint32_t sign = bits & 0x80000000;
+	bits ^= sign;
+
+	uint16_t ret;
+	if (bits >= F16_MAX) {
+		ret = bits > F32_INFINITY ? 0x7E00 : 0x7C00;
+	} else if (bits < (113 << 23)) {
+		// subnormal or zero, adding the magic number lines the 10 mantissa bits up at the bottom, rounding as it goes
+		float aligned = std::bit_cast<float>(bits) + std::bit_cast<float>(DENORM_MAGIC);
+		ret = std::bit_cast<uint32_t>(aligned) - DENORM_MAGIC;
+	} else {
+		uint32_t mantissa_odd = (bits >> 13) & 1;
+		bits += ((15 - 127) << 23) + 0xFFF;
+		bits += mantissa_odd;
+		ret = bits >> 13;
+	}
+	return ret | (sign >> 16);
+}
+
+float BSP::from_half(uint16_t value) {
+	uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+	uint32_t exponent = (value >> 10) & 0x1F;
+	uint32_t mantissa = value & 0x3FF;
+	if (exponent == 0x1F) return std::bit_cast<float>(sign | 0x7F800000 | (mantissa << 13));
+	if (!exponent) {
+		float subnormal = mantissa * (1.0f / 16777216.0f);
+		return sign ? -subnormal : subnormal;
+	}
+	return std::bit_cast<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+static inline int16_t to_snorm16(float value) {
+	return static_cast<int16_t>(std::round(std::clamp(value, -1.0f, 1.0f) * 32767.0f));
+}
+
+std::array<int16_t, 2> BSP::to_octahedral(float const * normal) {
+	float l1 = std::abs(normal[0]) + std::abs(normal[1]) + std::abs(normal[2]);
+	if (l1 <= 0) return { 0, 0 };
+	float x = normal[0] / l1, y = normal[1] / l1;
+	if (normal[2] < 0) {
+		// fold the lower hemisphere over the diagonals
+		float fx = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+		float fy = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+		x = fx;
+		y = fy;
+	}
+	return { to_snorm16(x), to_snorm16(y) };
+}
+
+vec3_t BSP::from_octahedral(std::array<int16_t, 2> encoded) {
+	float x = encoded[0] / 32767.0f, y = encoded[1] / 32767.0f;
+	float z = 1 - std::abs(x) - std::abs(y);
+	float t = std::max(-z, 0.0f);
+	x += x >= 0 ? -t : t;
+	y += y >= 0 ? -t : t;
+	float len = std::sqrt(x * x + y * y + z * z);
+	return { x / len, y / len, z / len };
+}
+
+// ================================
+// EXPORT
+
+// style 0 is always kept, it carries the vertex color and lightmap coordinates even of surfaces that are not lightmapped
+static size_t active_styles(Surface const & surface) {
+	size_t styles = 1;
+	for (size_t i = 1; i < LIGHTSTYLES; i++)
+		if (surface.lightmap_styles[i] != LIGHTSTYLE_NONE || surface.vertex_styles[i] != LIGHTSTYLE_NONE) styles = i + 1;
+	return styles;
+}
+
+namespace {
+
+	// a vertex range of the BSP as written to one stream
+	struct VertexRange {
+		uint32_t first, count;
+		uint32_t stream, offset;
+		int32_t uv_shift[2];
+	};
+
+	struct EncodeError {
+		float uv = 0, lightmap = 0, normal = 0;
+	};
+
+}
+
+// half floats are most precise near zero, so UVs are stored less the whole number below the smallest of the range
+// the shift is written with each surface for the decoder to add back, clamp mode textures and tcMod rotate depend on the original values
+static void find_uv_shift(VertexRange & range, std::span<DrawVert const> verts) {
+	// past this floats no longer hold every whole number, and the shift could no longer be added back exactly
+	static constexpr float MAX_SHIFT = 1 << 24;
+	for (size_t c = 0; c < 2; c++) {
+		float low = std::numeric_limits<float>::max();
+		for (size_t i = 0; i < range.count; i++) low = std::min(low, verts[range.first + i].uv[c]);
+		low = std::floor(low);
+		range.uv_shift[c] = std::abs(low) <= MAX_SHIFT ? static_cast<int32_t>(low) : 0;
+	}
+}
+
+static EncodeError encode_range(VertexRange const & range, std::span<DrawVert const> verts, uint8_t * out) {
+	EncodeError error;
+	size_t const styles = range.stream, stride = stream_stride(styles);
+
+	for (size_t i = 0; i < range.count; i++, out += stride) {
+		DrawVert const & vert = verts[range.first + i];
+		uint8_t * p = out;
+
+		std::memcpy(p, vert.pos, 12);
+		p += 12;
+
+		for (size_t c = 0; c < 2; c++, p += 2) {
+			uint16_t half = to_half(vert.uv[c] - range.uv_shift[c]);
+			std::memcpy(p, &half, 2);
+			error.uv = std::max(error.uv, std::abs(from_half(half) + range.uv_shift[c] - vert.uv[c]));
+		}
+
+		std::array<int16_t, 2> oct = to_octahedral(vert.normal);
+		std::memcpy(p, oct.data(), 4);
+		p += 4;
+		float len = std::sqrt(vert.normal[0] * vert.normal[0] + vert.normal[1] * vert.normal[1] + vert.normal[2] * vert.normal[2]);
+		if (len > 0) {
+			vec3_t decoded = from_octahedral(oct);
+			float dot = (decoded[0] * vert.normal[0] + decoded[1] * vert.normal[1] + decoded[2] * vert.normal[2]) / len;
+			error.normal = std::max(error.normal, std::acos(std::clamp(dot, -1.0f, 1.0f)));
+		}
+
+		for (size_t s = 0; s < styles; s++) {
+			for (size_t c = 0; c < 2; c++, p += 2) {
+				uint16_t half = to_half(vert.lightmap[s][c]);
+				std::memcpy(p, &half, 2);
+				error.lightmap = std::max(error.lightmap, std::abs(from_half(half) - vert.lightmap[s][c]));
+			}
+		}
+
+		std::memcpy(p, vert.color, styles * 4);
+	}
+	return error;
+}
+
+static void write_bytes(std::ostream & out, void const * data, size_t size, size_t & counter) {
+	static_assert(std::endian::native == std::endian::little);
+	out.write(reinterpret_cast<char const *>(data), size);
+	counter += size;
+}
+
+CompactVertexReport BSP::export_compact_vertices(Reader const & bspr, std::ostream & out, CompactVertexOptions const & opts) {
+	auto surfaces = bspr.surfaces();
+	auto verts = bspr.drawverts();
+	auto indices = bspr.drawindices();
+
+	CompactVertexReport report;
+	report.source_verts = verts.size();
+	report.source_bytes = verts.size_bytes() + indices.size_bytes();
+
+	std::vector<CompactSurface> table (surfaces.size());
+	std::vector<VertexRange> ranges;
+	std::map<std::tuple<int32_t, int32_t, uint32_t>, size_t> vertex_ranges;
+	std::map<std::pair<int32_t, int32_t>, uint32_t> index_ranges;
+	std::vector<std::pair<int32_t, int32_t>> index_order; // index ranges to write, in order
+	uint32_t stream_verts[LIGHTSTYLES] {};
+	uint32_t index_count = 0;
+	bool wide = false;
+
+	for (size_t s = 0; s < surfaces.size(); s++) {
+		Surface const & surface = surfaces[s];
+		if (surface.vert_count < 0 || surface.index_count < 0)
+			throw std::out_of_range { "surface " + std::to_string(s) + " has a negative vertex or index count" };
+		if (surface.vert_count && (surface.vert_idx < 0 || static_cast<size_t>(surface.vert_idx) + surface.vert_count > verts.size()))
+			throw std::out_of_range { "surface " + std::to_string(s) + " vertices reach past the drawverts" };
+		if (surface.index_count && (surface.index_idx < 0 || static_cast<size_t>(surface.index_idx) + surface.index_count > indices.size()))
+			throw std::out_of_range { "surface " + std::to_string(s) + " indices reach past the drawindexes" };
+		for (int32_t i = 0; i < surface.index_count; i++) {
+			int32_t idx = indices[surface.index_idx + i];
+			if (idx < 0 || idx >= surface.vert_count) throw std::out_of_range { "surface " + std::to_string(s) + " has an index outside of its vertices" };
+		}
+
+		CompactSurface & entry = table[s];
+		if (surface.vert_count) {
+			uint32_t stream = active_styles(surface);
+			auto [iter, added] = vertex_ranges.try_emplace({ surface.vert_idx, surface.vert_count, stream }, ranges.size());
+			if (added) {
+				ranges.push_back({ static_cast<uint32_t>(surface.vert_idx), static_cast<uint32_t>(surface.vert_count), stream, stream_verts[stream - 1], {} });
+				find_uv_shift(ranges.back(), verts);
+				stream_verts[stream - 1] += surface.vert_count;
+				if (stream_verts[stream - 1] >= 1u << 30) throw std::length_error { "too many vertices for a compact vertex stream" };
+			}
+			entry.stream = stream;
+			entry.first_vert = ranges[iter->second].offset;
+			entry.vert_count = surface.vert_count;
+			std::copy(std::begin(ranges[iter->second].uv_shift), std::end(ranges[iter->second].uv_shift), entry.uv_shift);
+			if (surface.vert_count > 65536) wide = true;
+		}
+		if (surface.index_count) {
+			auto [iter, added] = index_ranges.try_emplace({ surface.index_idx, surface.index_count }, index_count);
+			if (added) {
+				index_order.emplace_back(surface.index_idx, surface.index_count);
+				index_count += surface.index_count;
+			}
+			entry.first_index = iter->second;
+			entry.index_count = surface.index_count;
+		}
+	}
+
+	// where every BSP vertex went, the first range it appears in wins
+	std::vector<uint32_t> remap (verts.size(), COMPACT_UNUSED);
+	for (VertexRange const & range : ranges)
+		for (uint32_t i = 0; i < range.count; i++)
+			if (remap[range.first + i] == COMPACT_UNUSED) remap[range.first + i] = (range.stream - 1) << 30 | (range.offset + i);
+
+	// ================================
+	// ENCODE
+
+	std::vector<uint8_t> streams[LIGHTSTYLES];
+	for (size_t k = 0; k < LIGHTSTYLES; k++) streams[k].resize(stream_verts[k] * stream_stride(k + 1));
+
+	static constexpr size_t BATCH = 256;
+	size_t batches = (ranges.size() + BATCH - 1) / BATCH;
+	std::vector<EncodeError> errors (batches);
+	parallel_for(batches, opts.threads, [&](size_t b){
+		for (size_t i = b * BATCH; i < std::min(ranges.size(), (b + 1) * BATCH); i++) {
+			VertexRange const & range = ranges[i];
+			EncodeError error = encode_range(range, verts, streams[range.stream - 1].data() + range.offset * stream_stride(range.stream));
+			errors[b].uv = std::max(errors[b].uv, error.uv);
+			errors[b].lightmap = std::max(errors[b].lightmap, error.lightmap);
+			errors[b].normal = std::max(errors[b].normal, error.normal);
+		}
+	});
+	for (EncodeError const & error : errors) {
+		report.max_uv_error = std::max(report.max_uv_error, error.uv);
+		report.max_lightmap_error = std::max(report.max_lightmap_error, error.lightmap);
+		report.max_normal_error = std::max(report.max_normal_error, error.normal * 57.29578f);
+	}
+
+	// ================================
+	// WRITE
+
+	CompactHeader header { COMPACT_IDENT, COMPACT_VERSION, static_cast<uint32_t>(surfaces.size()), static_cast<uint32_t>(verts.size()), {}, index_count, wide ? 4u : 2u };
+	std::copy(std::begin(stream_verts), std::end(stream_verts), header.stream_verts);
+	write_bytes(out, &header, sizeof(header), report.table_bytes);
+	write_bytes(out, table.data(), table.size() * sizeof(CompactSurface), report.table_bytes);
+
+	for (size_t k = 0; k < LIGHTSTYLES; k++) {
+		write_bytes(out, streams[k].data(), streams[k].size(), report.vertex_bytes);
+		report.stream_verts[k] = stream_verts[k];
+		report.verts += stream_verts[k];
+	}
+
+	std::vector<uint8_t> packed;
+	for (auto [first, count] : index_order) {
+		size_t at = packed.size();
+		packed.resize(at + count * header.index_size);
+		for (int32_t i = 0; i < count; i++) {
+			uint32_t idx = indices[first + i];
+			if (wide) std::memcpy(&packed[at + i * 4], &idx, 4);
+			else {
+				uint16_t narrow = idx;
+				std::memcpy(&packed[at + i * 2], &narrow, 2);
+			}
+		}
+	}
+	write_bytes(out, packed.data(), packed.size(), report.index_bytes);
+
+	write_bytes(out, remap.data(), remap.size() * sizeof(uint32_t), report.table_bytes);
+
+	report.bytes = report.vertex_bytes + report.index_bytes + report.table_bytes;
+	return report;
+}
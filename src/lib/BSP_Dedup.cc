@@ -0,0 +1,173 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace BSP;
+
+// ================================
+// HASH
+
+// the accumulation of XXH3, over 32-byte stripes in four 64-bit lanes:
+//   acc[i] += lo32(word[i] ^ key[i]) * hi32(word[i] ^ key[i])
+//   acc[i ^ 1] += word[i]
+// every lane only ever combines with its neighbour, so SSE2 runs it in two halves and AVX2 in one, both matching the scalar loop exactly
+
+static constexpr size_t STRIPE = 32;
+static_assert(LIGHTMAP_BYTES % STRIPE == 0);
+
+alignas(32) static constexpr uint64_t HASH_KEY[4] {
+	0xBE4BA423396CFEB8, 0x1CAD21F72C81017C, 0xDB979083E96DD4DE, 0x1F67B3B7A4A44072
+};
+
+static inline uint64_t read64(uint8_t const * p) {
+	uint64_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t mix64(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCD;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t BSP::hash_lightmap(Lightmap const & lightmap) {
+	uint8_t const * data = reinterpret_cast<uint8_t const *>(&lightmap);
+	alignas(32) uint64_t acc[4] { 0x9E3779B185EBCA87, 0xC2B2AE3D27D4EB4F, 0x165667B19E3779F9, 0x85EBCA77C2B2AE63 };
+
+	#if defined(__AVX2__)
+	__m256i vacc = _mm256_load_si256(reinterpret_cast<__m256i const *>(acc));
+	__m256i const key = _mm256_load_si256(reinterpret_cast<__m256i const *>(HASH_KEY));
+	for (size_t off = 0; off < LIGHTMAP_BYTES; off += STRIPE) {
+		__m256i const word = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + off));
+		__m256i const keyed = _mm256_xor_si256(word, key);
+		__m256i const product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+		__m256i const swapped = _mm256_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2));
+		vacc = _mm256_add_epi64(vacc, _mm256_add_epi64(product, swapped));
+	}
+	_mm256_store_si256(reinterpret_cast<__m256i *>(acc), vacc);
+	#elif defined(__SSE2__)
+	__m128i vacc[2], key[2];
+	for (size_t h = 0; h < 2; h++) {
+		vacc[h] = _mm_load_si128(reinterpret_cast<__m128i const *>(acc + h * 2));
+		key[h] = _mm_load_si128(reinterpret_cast<__m128i const *>(HASH_KEY + h * 2));
+	}
+	for (size_t off = 0; off < LIGHTMAP_BYTES; off += STRIPE) {
+		for (size_t h = 0; h < 2; h++) {
+			__m128i const word = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + off + h * 16));
+			__m128i const keyed = _mm_xor_si128(word, key[h]);
+			__m128i const product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+			__m128i const swapped = _mm_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2));
+			vacc[h] = _mm_add_epi64(vacc[h], _mm_add_epi64(product, swapped));
+		}
+	}
+	for (size_t h = 0; h < 2; h++) _mm_store_si128(reinterpret_cast<__m128i *>(acc + h * 2), vacc[h]);
+	#else
+	for (size_t off = 0; off < LIGHTMAP_BYTES; off += STRIPE) {
+		for (size_t i = 0; i < 4; i++) {
+			uint64_t const word = read64(data + off + i * 8);
+			uint64_t const keyed = word ^ HASH_KEY[i];
+			acc[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+			acc[i ^ 1] += word;
+		}
+	}
+	#endif
+
+	uint64_t hash = LIGHTMAP_BYTES * 0x9E3779B185EBCA87;
+	for (uint64_t lane : acc) hash = mix64(hash ^ lane);
+	return hash;
+}
+
+// ================================
+// DEDUP
+
+static bool is_uniform(Lightmap const & lightmap) {
+	Color const & first = lightmap.pixels[0][0];
+	for (auto const & row : lightmap.pixels)
+		for (Color const & c : row)
+			if (c.r != first.r || c.g != first.g || c.b != first.b) return false;
+	return true;
+}
+
+LightmapDedupReport BSP::dedup_lightmaps(BSPI::LightmapArray & lightmaps, BSPI::SurfaceArray & surfaces, LightmapDedupOptions const & opts) {
+	LightmapDedupReport report;
+	report.before = lightmaps.size();
+
+	// deluxe maps are only ever used through the light map before them, so pairs are compared and kept whole, and never split by an odd shift
+	size_t const stride = opts.deluxe ? 2 : 1;
+	if (lightmaps.size() % stride)
+		throw std::invalid_argument { "deluxe mapped lightmaps come in pairs, but there are " + std::to_string(lightmaps.size()) };
+	size_t const units = lightmaps.size() / stride;
+
+	for (size_t s = 0; s < surfaces.size(); s++) {
+		for (int32_t lightmap : surfaces[s].lightmap) {
+			if (lightmap < 0) continue;
+			if (static_cast<size_t>(lightmap) >= lightmaps.size())
+				throw std::out_of_range { "surface " + std::to_string(s) + " refers past the lightmaps" };
+			if (lightmap % stride)
+				throw std::logic_error { "surface " + std::to_string(s) + " refers to deluxe map " + std::to_string(lightmap) + " instead of a light map" };
+		}
+	}
+
+	std::vector<uint64_t> hashes (lightmaps.size());
+	parallel_for(lightmaps.size(), opts.threads, [&](size_t i){ hashes[i] = hash_lightmap(lightmaps[i]); });
+	if (stride == 2)
+		for (size_t u = 0; u < units; u++) hashes[u] = mix64(hashes[u * 2] ^ (hashes[u * 2 + 1] * 0x9E3779B185EBCA87));
+	hashes.resize(units);
+
+	// sorted by hash then index, so the first of each set of equal units comes first among its hash
+	std::vector<uint32_t> order (units);
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b){ return hashes[a] != hashes[b] ? hashes[a] < hashes[b] : a < b; });
+
+	// the unit each is a copy of, itself if none, distinct units with the same hash each compared against the ones before them
+	std::vector<uint32_t> canonical (units);
+	for (size_t first = 0, last; first < order.size(); first = last) {
+		for (last = first + 1; last < order.size() && hashes[order[last]] == hashes[order[first]]; last++);
+		for (size_t i = first; i < last; i++) {
+			uint32_t idx = order[i];
+			canonical[idx] = idx;
+			for (size_t j = first; j < i; j++) {
+				uint32_t other = order[j];
+				if (canonical[other] != other || std::memcmp(&lightmaps[idx * stride], &lightmaps[other * stride], stride * sizeof(Lightmap))) continue;
+				canonical[idx] = other;
+				break;
+			}
+		}
+	}
+
+	std::vector<int32_t> remap (units);
+	size_t out = 0;
+	for (size_t u = 0; u < units; u++) {
+		if (canonical[u] != u) {
+			remap[u] = remap[canonical[u]];
+			continue;
+		}
+		remap[u] = out;
+		if (out != u) std::copy_n(lightmaps.begin() + u * stride, stride, lightmaps.begin() + out * stride);
+		out++;
+	}
+	lightmaps.resize(out * stride);
+
+	for (Surface & surface : surfaces)
+		for (int32_t & lightmap : surface.lightmap)
+			if (lightmap >= 0) lightmap = remap[lightmap / stride] * stride;
+
+	report.after = lightmaps.size();
+	report.bytes = (report.before - report.after) * sizeof(Lightmap);
+	for (Lightmap const & lightmap : lightmaps) report.uniform += is_uniform(lightmap);
+	return report;
+}
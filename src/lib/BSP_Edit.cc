@@ -0,0 +1,424 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+
+using namespace BSP;
+
+namespace {
+
+	struct Range {
+		int64_t first, count;
+	};
+
+	// where every element of one lump ends up once its removals and insertions are applied
+	struct Layout {
+		std::vector<int32_t> remap;  // transaction index to final index, -1 if removed
+		std::vector<uint32_t> order; // final index to transaction index
+		std::vector<Range> ranges;   // final range of every owner
+		std::vector<int64_t> added;  // elements added to every owner's range
+	};
+
+	// the elements added for each owner go after the last element of its range, or after everything if the range is empty
+	// each position between original elements, or gap, holds first the elements of the non-empty range ending there and then those of empty ranges
+	// a gap that is inside another range would take elements into both, as would one ending two ranges that are both added to, so those throw
+	template <typename C>
+	Layout plan(size_t size, std::vector<bool> const & removed, std::vector<C> const & chunks, std::vector<Range> const & owners, char const * lump) {
+		size_t added = 0;
+		for (C const & chunk : chunks) added += chunk.count;
+
+		auto gap = [&](int32_t owner) -> size_t { Range const & r = owners[owner]; return r.count ? r.first + r.count : size; };
+
+		std::vector<int32_t> inside (size + 1, 0);
+		for (Range const & r : owners) {
+			if (r.count < 2) continue;
+			inside[r.first + 1]++;
+			inside[r.first + r.count]--;
+		}
+		for (size_t g = 1; g <= size; g++) inside[g] += inside[g - 1];
+
+		std::vector<int64_t> first_chunk (owners.size(), -1), primary (size + 1, -1);
+		for (size_t c = 0; c < chunks.size(); c++) {
+			int32_t owner = chunks[c].owner;
+			if (first_chunk[owner] >= 0) continue;
+			first_chunk[owner] = c;
+			if (!owners[owner].count) continue;
+			size_t g = gap(owner);
+			if (inside[g] || (primary[g] >= 0 && primary[g] != owner))
+				throw std::logic_error { std::string { "elements added to " } + lump + " at " + std::to_string(g) + " would land in more than one range" };
+			primary[g] = owner;
+		}
+
+		// each owner's chunks together in the order queued, the owner ending a range at a gap ahead of those with empty ranges
+		std::vector<size_t> offset (chunks.size()), sorted (chunks.size());
+		for (size_t c = 0, o = 0; c < chunks.size(); o += chunks[c++].count) offset[c] = o;
+		std::iota(sorted.begin(), sorted.end(), 0);
+		std::stable_sort(sorted.begin(), sorted.end(), [&](size_t a, size_t b){
+			int32_t oa = chunks[a].owner, ob = chunks[b].owner;
+			return std::make_tuple(gap(oa), !owners[oa].count, first_chunk[oa]) < std::make_tuple(gap(ob), !owners[ob].count, first_chunk[ob]);
+		});
+
+		Layout ret;
+		ret.remap.assign(size + added, -1);
+		ret.order.reserve(size + added);
+		ret.added.assign(owners.size(), 0);
+		std::vector<int64_t> added_first (owners.size(), -1);
+		std::vector<size_t> gap_first (size + 1), gap_end (size + 1);
+
+		size_t next = 0;
+		for (size_t g = 0; g <= size; g++) {
+			gap_first[g] = ret.order.size();
+			for (; next < sorted.size() && gap(chunks[sorted[next]].owner) == g; next++) {
+				C const & chunk = chunks[sorted[next]];
+				if (added_first[chunk.owner] < 0) added_first[chunk.owner] = ret.order.size();
+				ret.added[chunk.owner] += chunk.count;
+				for (size_t i = 0; i < chunk.count; i++) {
+					uint32_t idx = size + offset[sorted[next]] + i;
+					ret.remap[idx] = ret.order.size();
+					ret.order.push_back(idx);
+				}
+			}
+			gap_end[g] = ret.order.size();
+			if (g == size || removed[g]) continue;
+			ret.remap[g] = ret.order.size();
+			ret.order.push_back(g);
+		}
+
+		ret.ranges.resize(owners.size());
+		for (size_t o = 0; o < owners.size(); o++) {
+			Range const & r = owners[o];
+			if (r.count) {
+				int64_t first = gap_end[r.first], end = gap_first[r.first + r.count] + ret.added[o];
+				ret.ranges[o] = { first, end - first };
+			} else if (ret.added[o]) {
+				ret.ranges[o] = { added_first[o], ret.added[o] };
+			} else {
+				ret.ranges[o] = { static_cast<int64_t>(gap_end[std::clamp<int64_t>(r.first, 0, size)]), 0 };
+			}
+		}
+		return ret;
+	}
+
+	// the lump's original elements followed by those added, in their final order
+	template <typename A, typename T>
+	void apply(A & array, std::vector<T> const & added, Layout const & layout) {
+		A out;
+		out.reserve(layout.order.size());
+		for (uint32_t idx : layout.order) out.push_back(idx < array.size() ? array[idx] : added[idx - array.size()]);
+		array = std::move(out);
+	}
+
+	inline size_t lump_slot(LumpIndex idx) { return static_cast<size_t>(idx); }
+
+}
+
+static void check_range(int64_t first, int64_t count, size_t size, char const * what, size_t idx, char const * lump) {
+	if (!count) return; // empty ranges can point anywhere
+	if (first < 0 || count < 0 || static_cast<size_t>(first + count) > size)
+		throw std::out_of_range { std::string { what } + " " + std::to_string(idx) + " reaches past the " + lump };
+}
+
+static void check_index(int64_t i, size_t size, char const * what, size_t idx, char const * lump) {
+	if (i < 0 || static_cast<size_t>(i) >= size)
+		throw std::out_of_range { std::string { what } + " " + std::to_string(idx) + " refers past the " + lump };
+}
+
+// ================================
+// QUEUEING
+
+int32_t EditTransaction::add_surface(int32_t model, Surface const & surface) {
+	check_index(model, m_lumps.models.size(), "added surface for model", model, "models");
+	m_surfaces.add(model, { &surface, 1 });
+	return m_lumps.surfaces.size() + m_surfaces.added.size() - 1;
+}
+
+void EditTransaction::remove_surface(int32_t surface) {
+	check_index(surface, m_lumps.surfaces.size(), "removed surface", surface, "original surfaces");
+	m_surfaces.removed.push_back(surface);
+}
+
+int32_t EditTransaction::add_brush(int32_t model, Brush const & brush) {
+	check_index(model, m_lumps.models.size(), "added brush for model", model, "models");
+	m_brushes.add(model, { &brush, 1 });
+	return m_lumps.brushes.size() + m_brushes.added.size() - 1;
+}
+
+void EditTransaction::remove_brush(int32_t brush) {
+	check_index(brush, m_lumps.brushes.size(), "removed brush", brush, "original brushes");
+	m_brushes.removed.push_back(brush);
+}
+
+void EditTransaction::add_brush_sides(int32_t brush, std::span<BrushSide const> sides) {
+	check_index(brush, m_lumps.brushes.size() + m_brushes.added.size(), "brush sides added to brush", brush, "brushes");
+	m_sides.add(brush, sides);
+}
+
+void EditTransaction::add_verts(int32_t surface, std::span<DrawVert const> verts) {
+	check_index(surface, m_lumps.surfaces.size() + m_surfaces.added.size(), "vertices added to surface", surface, "surfaces");
+	m_verts.add(surface, verts);
+}
+
+void EditTransaction::remove_verts(int32_t first, int32_t count) {
+	check_range(first, count, m_lumps.verts.size(), "removed vertices at", first, "original drawverts");
+	for (int32_t i = 0; i < count; i++) m_verts.removed.push_back(first + i);
+}
+
+void EditTransaction::add_indices(int32_t surface, std::span<int32_t const> indices) {
+	check_index(surface, m_lumps.surfaces.size() + m_surfaces.added.size(), "indices added to surface", surface, "surfaces");
+	m_indices.add(surface, indices);
+}
+
+void EditTransaction::add_leaf_surface(int32_t leaf, int32_t surface) {
+	check_index(leaf, m_lumps.leafs.size(), "surface added to leaf", leaf, "leafs");
+	check_index(surface, m_lumps.surfaces.size() + m_surfaces.added.size(), "leaf surface", surface, "surfaces");
+	m_leaf_surfaces.add(leaf, { &surface, 1 });
+}
+
+void EditTransaction::remove_leaf_surface(int32_t leaf, int32_t surface) {
+	check_index(leaf, m_lumps.leafs.size(), "surface removed from leaf", leaf, "leafs");
+	m_leaf_surface_removals.push_back({ leaf, surface, m_leaf_surfaces.added.size() });
+}
+
+void EditTransaction::add_leaf_brush(int32_t leaf, int32_t brush) {
+	check_index(leaf, m_lumps.leafs.size(), "brush added to leaf", leaf, "leafs");
+	check_index(brush, m_lumps.brushes.size() + m_brushes.added.size(), "leaf brush", brush, "brushes");
+	m_leaf_brushes.add(leaf, { &brush, 1 });
+}
+
+void EditTransaction::remove_leaf_brush(int32_t leaf, int32_t brush) {
+	check_index(leaf, m_lumps.leafs.size(), "brush removed from leaf", leaf, "leafs");
+	m_leaf_brush_removals.push_back({ leaf, brush, m_leaf_brushes.added.size() });
+}
+
+// ================================
+// COMMIT
+
+EditReport EditTransaction::commit() {
+	BSPI::IndexedLumps & lumps = m_lumps;
+	EditReport report;
+
+	auto flags = [](size_t size, std::vector<int32_t> const & removed) {
+		std::vector<bool> ret (size, false);
+		for (int32_t idx : removed) ret[idx] = true;
+		return ret;
+	};
+	std::vector<bool> surfaces_removed = flags(lumps.surfaces.size(), m_surfaces.removed);
+	std::vector<bool> brushes_removed = flags(lumps.brushes.size(), m_brushes.removed);
+	std::vector<bool> verts_removed = flags(lumps.verts.size(), m_verts.removed);
+	std::vector<bool> sides_removed (lumps.brush_sides.size(), false), indices_removed (lumps.indices.size(), false);
+
+	size_t const surface_count = lumps.surfaces.size() + m_surfaces.added.size();
+	size_t const brush_count = lumps.brushes.size() + m_brushes.added.size();
+	auto surface_at = [&](size_t s) -> Surface const & { return s < lumps.surfaces.size() ? lumps.surfaces[s] : m_surfaces.added[s - lumps.surfaces.size()]; };
+	auto brush_at = [&](size_t b) -> Brush const & { return b < lumps.brushes.size() ? lumps.brushes[b] : m_brushes.added[b - lumps.brushes.size()]; };
+	auto surface_gone = [&](size_t s){ return s < surfaces_removed.size() && surfaces_removed[s]; };
+	auto brush_gone = [&](size_t b){ return b < brushes_removed.size() && brushes_removed[b]; };
+
+	// ================================
+	// RANGES
+
+	std::vector<Range> model_surfaces (lumps.models.size()), model_brushes (lumps.models.size());
+	for (size_t m = 0; m < lumps.models.size(); m++) {
+		Model const & model = lumps.models[m];
+		check_range(model.first_surface, model.num_surfaces, lumps.surfaces.size(), "model", m, "surfaces");
+		check_range(model.first_brush, model.num_brushes, lumps.brushes.size(), "model", m, "brushes");
+		model_surfaces[m] = { model.first_surface, model.num_surfaces };
+		model_brushes[m] = { model.first_brush, model.num_brushes };
+	}
+
+	std::vector<Range> leaf_surfaces (lumps.leafs.size()), leaf_brushes (lumps.leafs.size());
+	for (size_t l = 0; l < lumps.leafs.size(); l++) {
+		Leaf const & leaf = lumps.leafs[l];
+		check_range(leaf.first_surface, leaf.num_surfaces, lumps.leaf_surfaces.size(), "leaf", l, "leafsurfaces");
+		check_range(leaf.first_brush, leaf.num_brushes, lumps.leaf_brushes.size(), "leaf", l, "leafbrushes");
+		leaf_surfaces[l] = { leaf.first_surface, leaf.num_surfaces };
+		leaf_brushes[l] = { leaf.first_brush, leaf.num_brushes };
+	}
+
+	std::vector<Range> surface_verts (surface_count), surface_indices (surface_count);
+	for (size_t s = 0; s < surface_count; s++) {
+		Surface const & surface = surface_at(s);
+		check_range(surface.vert_idx, surface.vert_count, lumps.verts.size(), "surface", s, "drawverts");
+		check_range(surface.index_idx, surface.index_count, lumps.indices.size(), "surface", s, "drawindexes");
+		surface_verts[s] = { surface.vert_idx, surface.vert_count };
+		surface_indices[s] = { surface.index_idx, surface.index_count };
+	}
+
+	std::vector<Range> brush_sides (brush_count);
+	for (size_t b = 0; b < brush_count; b++) {
+		Brush const & brush = brush_at(b);
+		check_range(brush.first_side, brush.num_sides, lumps.brush_sides.size(), "brush", b, "brushsides");
+		brush_sides[b] = { brush.first_side, brush.num_sides };
+	}
+
+	// ================================
+	// VALIDATE
+
+	for (Chunk const & chunk : m_verts.chunks)
+		if (surface_gone(chunk.owner)) throw std::logic_error { "vertices added to removed surface " + std::to_string(chunk.owner) };
+	for (Chunk const & chunk : m_indices.chunks)
+		if (surface_gone(chunk.owner)) throw std::logic_error { "indices added to removed surface " + std::to_string(chunk.owner) };
+	for (Chunk const & chunk : m_sides.chunks)
+		if (brush_gone(chunk.owner)) throw std::logic_error { "sides added to removed brush " + std::to_string(chunk.owner) };
+
+	// leaf entries removed after being added are never added, each was queued as its own chunk
+	auto leaf_additions = [](Pending<int32_t> const & pending, std::vector<LeafRemoval> const & removals) {
+		auto key = [](int32_t leaf, int32_t value){ return static_cast<uint64_t>(static_cast<uint32_t>(leaf)) << 32 | static_cast<uint32_t>(value); };
+		std::unordered_map<uint64_t, size_t> last;
+		for (LeafRemoval const & removal : removals) {
+			size_t & queued = last[key(removal.leaf, removal.value)];
+			queued = std::max(queued, removal.queued);
+		}
+		Pending<int32_t> ret;
+		for (size_t i = 0; i < pending.added.size(); i++) {
+			auto it = last.find(key(pending.chunks[i].owner, pending.added[i]));
+			if (it == last.end() || it->second <= i) ret.add(pending.chunks[i].owner, { &pending.added[i], 1 });
+		}
+		return ret;
+	};
+	Pending<int32_t> const added_leaf_surfaces = leaf_additions(m_leaf_surfaces, m_leaf_surface_removals);
+	Pending<int32_t> const added_leaf_brushes = leaf_additions(m_leaf_brushes, m_leaf_brush_removals);
+	for (int32_t surface : added_leaf_surfaces.added)
+		if (surface_gone(surface)) throw std::logic_error { "removed surface " + std::to_string(surface) + " added to a leaf" };
+	for (int32_t brush : added_leaf_brushes.added)
+		if (brush_gone(brush)) throw std::logic_error { "removed brush " + std::to_string(brush) + " added to a leaf" };
+
+	for (size_t f = 0; f < lumps.fogs.size(); f++) {
+		Fog const & fog = lumps.fogs[f];
+		if (fog.brush >= 0) check_index(fog.brush, brush_count, "fog", f, "brushes");
+		if (fog.brush >= 0 && brush_gone(fog.brush)) throw std::logic_error { "fog " + std::to_string(f) + " is on removed brush " + std::to_string(fog.brush) };
+		if (fog.visible_side >= 0) check_index(fog.visible_side, lumps.brush_sides.size() + m_sides.added.size(), "fog", f, "brushsides");
+	}
+
+	// leaf entries go with the surfaces and brushes they name, and on request
+	auto leaf_entries = [&](auto const & entries, std::vector<Range> const & ranges, auto const & removals, size_t count, auto gone, char const * lump, char const * target) {
+		std::vector<bool> ret (entries.size(), false);
+		for (size_t i = 0; i < entries.size(); i++) {
+			check_index(entries[i], count, lump, i, target);
+			ret[i] = gone(entries[i]);
+		}
+		for (LeafRemoval const & removal : removals)
+			for (int64_t i = ranges[removal.leaf].first; i < ranges[removal.leaf].first + ranges[removal.leaf].count; i++)
+				if (entries[i] == removal.value) ret[i] = true;
+		return ret;
+	};
+	std::vector<bool> leaf_surfaces_removed = leaf_entries(lumps.leaf_surfaces, leaf_surfaces, m_leaf_surface_removals, surface_count, surface_gone, "leafsurface", "surfaces");
+	std::vector<bool> leaf_brushes_removed = leaf_entries(lumps.leaf_brushes, leaf_brushes, m_leaf_brush_removals, brush_count, brush_gone, "leafbrush", "brushes");
+
+	// ================================
+	// PLAN
+
+	Layout surfaces = plan(lumps.surfaces.size(), surfaces_removed, m_surfaces.chunks, model_surfaces, "surfaces");
+	Layout brushes = plan(lumps.brushes.size(), brushes_removed, m_brushes.chunks, model_brushes, "brushes");
+	Layout sides = plan(lumps.brush_sides.size(), sides_removed, m_sides.chunks, brush_sides, "brushsides");
+	Layout verts = plan(lumps.verts.size(), verts_removed, m_verts.chunks, surface_verts, "drawverts");
+	Layout indices = plan(lumps.indices.size(), indices_removed, m_indices.chunks, surface_indices, "drawindexes");
+	Layout leaf_surfs = plan(lumps.leaf_surfaces.size(), leaf_surfaces_removed, added_leaf_surfaces.chunks, leaf_surfaces, "leafsurfaces");
+	Layout leaf_brs = plan(lumps.leaf_brushes.size(), leaf_brushes_removed, added_leaf_brushes.chunks, leaf_brushes, "leafbrushes");
+
+	// indices are relative to their surface's first vertex, so those of surfaces that lost vertices are renumbered
+	// their new values are worked out in full first, index ranges shared by surfaces must come out the same for each
+	std::vector<int64_t> removed_before (lumps.verts.size() + 1, 0);
+	for (size_t v = 0; v < lumps.verts.size(); v++) removed_before[v + 1] = removed_before[v] + verts_removed[v];
+
+	std::vector<int64_t> renumbered (indices.order.size(), -1);
+	for (size_t s = 0; s < surface_count; s++) {
+		if (surface_gone(s)) continue;
+		Range const & vr = surface_verts[s];
+		if (!vr.count || removed_before[vr.first + vr.count] == removed_before[vr.first]) continue;
+		Range const & final_verts = verts.ranges[s], & final_indices = indices.ranges[s];
+		int64_t const available = vr.count + verts.added[s], kept = final_verts.count - verts.added[s];
+		for (int64_t i = final_indices.first; i < final_indices.first + final_indices.count; i++) {
+			uint32_t idx = indices.order[i];
+			int64_t rel = idx < lumps.indices.size() ? lumps.indices[idx] : m_indices.added[idx - lumps.indices.size()];
+			if (rel < 0 || rel >= available) throw std::out_of_range { "surface " + std::to_string(s) + " has an index past its vertices" };
+			int64_t value;
+			if (rel < vr.count) {
+				if (verts_removed[vr.first + rel]) throw std::logic_error { "surface " + std::to_string(s) + " uses a removed vertex" };
+				value = verts.remap[vr.first + rel] - final_verts.first;
+			} else value = kept + rel - vr.count;
+			if (renumbered[i] >= 0 && renumbered[i] != value)
+				throw std::logic_error { "surface " + std::to_string(s) + " shares indices with a surface that lost other vertices" };
+			renumbered[i] = value;
+		}
+	}
+
+	// ================================
+	// APPLY
+	// nothing below throws, so a failed commit leaves the lumps as they were
+
+	auto count = [&](LumpIndex idx, size_t before, size_t added, size_t after) {
+		report.inserted[lump_slot(idx)] = added;
+		report.removed[lump_slot(idx)] = before + added - after;
+	};
+	count(LumpIndex::SURFACES, lumps.surfaces.size(), m_surfaces.added.size(), surfaces.order.size());
+	count(LumpIndex::BRUSHES, lumps.brushes.size(), m_brushes.added.size(), brushes.order.size());
+	count(LumpIndex::BRUSHSIDES, lumps.brush_sides.size(), m_sides.added.size(), sides.order.size());
+	count(LumpIndex::DRAWVERTS, lumps.verts.size(), m_verts.added.size(), verts.order.size());
+	count(LumpIndex::DRAWINDEXES, lumps.indices.size(), m_indices.added.size(), indices.order.size());
+	count(LumpIndex::LEAFSURFACES, lumps.leaf_surfaces.size(), added_leaf_surfaces.added.size(), leaf_surfs.order.size());
+	count(LumpIndex::LEAFBRUSHES, lumps.leaf_brushes.size(), added_leaf_brushes.added.size(), leaf_brs.order.size());
+
+	apply(lumps.surfaces, m_surfaces.added, surfaces);
+	apply(lumps.brushes, m_brushes.added, brushes);
+	apply(lumps.brush_sides, m_sides.added, sides);
+	apply(lumps.verts, m_verts.added, verts);
+	apply(lumps.indices, m_indices.added, indices);
+	apply(lumps.leaf_surfaces, added_leaf_surfaces.added, leaf_surfs);
+	apply(lumps.leaf_brushes, added_leaf_brushes.added, leaf_brs);
+
+	for (size_t m = 0; m < lumps.models.size(); m++) {
+		Model & model = lumps.models[m];
+		model.first_surface = surfaces.ranges[m].first;
+		model.num_surfaces = surfaces.ranges[m].count;
+		model.first_brush = brushes.ranges[m].first;
+		model.num_brushes = brushes.ranges[m].count;
+	}
+	for (size_t l = 0; l < lumps.leafs.size(); l++) {
+		Leaf & leaf = lumps.leafs[l];
+		leaf.first_surface = leaf_surfs.ranges[l].first;
+		leaf.num_surfaces = leaf_surfs.ranges[l].count;
+		leaf.first_brush = leaf_brs.ranges[l].first;
+		leaf.num_brushes = leaf_brs.ranges[l].count;
+	}
+	for (size_t s = 0; s < lumps.surfaces.size(); s++) {
+		Surface & surface = lumps.surfaces[s];
+		uint32_t owner = surfaces.order[s];
+		surface.vert_idx = verts.ranges[owner].first;
+		surface.vert_count = verts.ranges[owner].count;
+		surface.index_idx = indices.ranges[owner].first;
+		surface.index_count = indices.ranges[owner].count;
+	}
+	for (size_t b = 0; b < lumps.brushes.size(); b++) {
+		Brush & brush = lumps.brushes[b];
+		uint32_t owner = brushes.order[b];
+		brush.first_side = sides.ranges[owner].first;
+		brush.num_sides = sides.ranges[owner].count;
+	}
+	for (size_t i = 0; i < renumbered.size(); i++)
+		if (renumbered[i] >= 0) lumps.indices[i] = renumbered[i];
+	for (int32_t & surface : lumps.leaf_surfaces) surface = surfaces.remap[surface];
+	for (int32_t & brush : lumps.leaf_brushes) brush = brushes.remap[brush];
+	for (Fog & fog : lumps.fogs) {
+		if (fog.brush >= 0) fog.brush = brushes.remap[fog.brush];
+		if (fog.visible_side >= 0) fog.visible_side = sides.remap[fog.visible_side];
+	}
+	// unused by games, so whatever it holds is only renumbered when it names a surface
+	for (BrushSide & side : lumps.brush_sides)
+		if (side.surface >= 0 && static_cast<size_t>(side.surface) < surface_count) side.surface = surfaces.remap[side.surface];
+
+	m_surfaces.clear();
+	m_brushes.clear();
+	m_sides.clear();
+	m_verts.clear();
+	m_indices.clear();
+	m_leaf_surfaces.clear();
+	m_leaf_brushes.clear();
+	m_leaf_surface_removals.clear();
+	m_leaf_brush_removals.clear();
+	return report;
+}
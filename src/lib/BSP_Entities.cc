@@ -0,0 +1,217 @@
+#include "libbsp/entities.hh"
+
+#include <cctype>
+#include <cstring>
+
+using namespace BSP;
+
+static constexpr size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+// ================================================================
+// ENTITY
+// ================================================================
+
+std::optional<meadow::istring_view> EntityTable::Entity::get(meadow::istring_view key) const {
+	auto kidx = m_table->find_key(key);
+	if (!kidx) return std::nullopt;
+	for (Pair const * p = m_begin; p != m_end; p++)
+		if (p->key == *kidx) return p->value;
+	return std::nullopt;
+}
+
+// ================================================================
+// TABLE
+// ================================================================
+
+EntityTable::EntityTable(EntityTable const & other) :
+	m_keys { other.m_keys },
+	m_pairs { other.m_pairs },
+	m_offsets { other.m_offsets }
+{
+	own();
+}
+
+EntityTable::EntityTable(EntityTable && other) noexcept :
+	m_keys { std::move(other.m_keys) },
+	m_key_lookup { std::move(other.m_key_lookup) },
+	m_pairs { std::move(other.m_pairs) },
+	m_offsets { std::exchange(other.m_offsets, { 0 }) },
+	m_arena { std::move(other.m_arena) },
+	m_arena_cur { std::exchange(other.m_arena_cur, nullptr) },
+	m_arena_left { std::exchange(other.m_arena_left, 0) }
+{}
+
+EntityTable & EntityTable::operator = (EntityTable const & other) {
+	if (this == &other) return *this;
+	EntityTable copy { other };
+	return *this = std::move(copy);
+}
+
+EntityTable & EntityTable::operator = (EntityTable && other) noexcept {
+	if (this == &other) return *this;
+	m_keys = std::move(other.m_keys);
+	m_key_lookup = std::move(other.m_key_lookup);
+	m_pairs = std::move(other.m_pairs);
+	m_offsets = std::exchange(other.m_offsets, { 0 });
+	m_arena = std::move(other.m_arena);
+	m_arena_cur = std::exchange(other.m_arena_cur, nullptr);
+	m_arena_left = std::exchange(other.m_arena_left, 0);
+	return *this;
+}
+
+size_t EntityTable::KeyHash::operator () (meadow::istring_view key) const {
+	// FNV-1a, folded to lowercase to match the case insensitive comparison of istring_view
+	uint64_t h = 14695981039346656037ULL;
+	for (char c : key) {
+		h ^= static_cast<uint8_t>(std::tolower(static_cast<unsigned char>(c)));
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+std::optional<EntityTable::index_t> EntityTable::find_key(meadow::istring_view key) const {
+	auto iter = m_key_lookup.find(key);
+	if (iter == m_key_lookup.end()) return std::nullopt;
+	return iter->second;
+}
+
+EntityTable::index_t EntityTable::intern(meadow::istring_view key) {
+	auto [iter, inserted] = m_key_lookup.try_emplace(key, m_keys.size());
+	if (inserted) m_keys.emplace_back(key);
+	return iter->second;
+}
+
+meadow::istring_view EntityTable::store(meadow::istring_view str) {
+	if (str.size() > m_arena_left) {
+		size_t block_size = std::max(str.size(), ARENA_BLOCK_SIZE);
+		m_arena_cur = m_arena.emplace_back(new char[block_size]).get();
+		m_arena_left = block_size;
+	}
+	std::memcpy(m_arena_cur, str.data(), str.size());
+	meadow::istring_view ret { m_arena_cur, str.size() };
+	m_arena_cur += str.size();
+	m_arena_left -= str.size();
+	return ret;
+}
+
+void EntityTable::reserve(size_t entities, size_t pairs) {
+	m_offsets.reserve(entities + 1);
+	m_pairs.reserve(pairs);
+}
+
+void EntityTable::append(meadow::istring_view key, meadow::istring_view value) {
+	
+	index_t first = m_offsets[m_offsets.size() - 2];
+	
+	// entities of the same kind tend to list the same keys in the same order, so check the key at this position of the previous entity before hashing
+	index_t kidx;
+	size_t ordinal = m_pairs.size() - first;
+	if (m_offsets.size() > 2 && ordinal < first - m_offsets[m_offsets.size() - 3] && m_keys[m_pairs[m_offsets[m_offsets.size() - 3] + ordinal].key] == key)
+		kidx = m_pairs[m_offsets[m_offsets.size() - 3] + ordinal].key;
+	else
+		kidx = intern(key);
+	
+	for (size_t i = first; i < m_pairs.size(); i++) {
+		if (m_pairs[i].key == kidx) {
+			m_pairs[i].value = value;
+			return;
+		}
+	}
+	m_pairs.emplace_back( Pair { kidx, value } );
+	m_offsets.back()++;
+}
+
+size_t EntityTable::add_entity() {
+	m_offsets.emplace_back(m_offsets.back());
+	return m_offsets.size() - 2;
+}
+
+void EntityTable::remove_entity(size_t idx) {
+	index_t count = m_offsets[idx + 1] - m_offsets[idx];
+	m_pairs.erase(m_pairs.begin() + m_offsets[idx], m_pairs.begin() + m_offsets[idx + 1]);
+	m_offsets.erase(m_offsets.begin() + idx + 1);
+	for (size_t i = idx + 1; i < m_offsets.size(); i++) m_offsets[i] -= count;
+}
+
+void EntityTable::set(size_t idx, meadow::istring_view key, meadow::istring_view value) {
+	auto kidx = find_key(key);
+	if (!kidx) kidx = intern(store(key));
+	for (size_t i = m_offsets[idx]; i < m_offsets[idx + 1]; i++) {
+		if (m_pairs[i].key == *kidx) {
+			m_pairs[i].value = store(value);
+			return;
+		}
+	}
+	m_pairs.emplace(m_pairs.begin() + m_offsets[idx + 1], Pair { *kidx, store(value) });
+	for (size_t i = idx + 1; i < m_offsets.size(); i++) m_offsets[i]++;
+}
+
+bool EntityTable::erase(size_t idx, meadow::istring_view key) {
+	auto kidx = find_key(key);
+	if (!kidx) return false;
+	for (size_t i = m_offsets[idx]; i < m_offsets[idx + 1]; i++) {
+		if (m_pairs[i].key == *kidx) {
+			m_pairs.erase(m_pairs.begin() + i);
+			for (size_t j = idx + 1; j < m_offsets.size(); j++) m_offsets[j]--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void EntityTable::own() {
+	
+	// everything goes into one fresh block, which also drops any values orphaned by set()
+	size_t total = 0;
+	for (auto const & key : m_keys) total += key.size();
+	for (auto const & pair : m_pairs) total += pair.value.size();
+	
+	auto old_arena = std::move(m_arena);
+	m_arena.clear();
+	m_arena_cur = nullptr;
+	m_arena_left = 0;
+	if (total) {
+		m_arena_cur = m_arena.emplace_back(new char[total]).get();
+		m_arena_left = total;
+	}
+	
+	m_key_lookup.clear();
+	m_key_lookup.reserve(m_keys.size());
+	for (size_t i = 0; i < m_keys.size(); i++) {
+		m_keys[i] = store(m_keys[i]);
+		m_key_lookup.emplace(m_keys[i], i);
+	}
+	for (auto & pair : m_pairs) pair.value = store(pair.value);
+}
+
+size_t EntityTable::stringified_size() const {
+	size_t total = size() * 4; // "{\n" and "}\n"
+	for (auto const & pair : m_pairs) total += m_keys[pair.key].size() + pair.value.size() + 6; // "" ""\n
+	return total;
+}
+
+void EntityTable::stringify_into(char * out) const {
+	
+	auto put = [&](char const * str, size_t len){ std::memcpy(out, str, len); out += len; };
+	
+	for (size_t e = 0; e < size(); e++) {
+		put("{\n", 2);
+		for (index_t i = m_offsets[e]; i < m_offsets[e + 1]; i++) {
+			meadow::istring_view key = m_keys[m_pairs[i].key];
+			put("\"", 1);
+			put(key.data(), key.size());
+			put("\" \"", 3);
+			put(m_pairs[i].value.data(), m_pairs[i].value.size());
+			put("\"\n", 2);
+		}
+		put("}\n", 2);
+	}
+}
+
+std::string EntityTable::stringify() const {
+	// sized up front so the whole string is written with a single allocation
+	std::string ret;
+	ret.resize(stringified_size());
+	stringify_into(ret.data());
+	return ret;
+}
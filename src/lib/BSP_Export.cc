@@ -0,0 +1,446 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+using namespace BSP;
+
+// ================================
+// CHUNKS
+
+namespace {
+
+	// surfaces of one model sharing a shader, the unit that is built, encoded, and written at once
+	struct Chunk {
+		int32_t model;
+		int32_t shader;
+		std::vector<int32_t> surfaces;
+		// filled in by the sizing pass
+		size_t num_verts = 0, num_indices = 0;
+		vec3_t mins, maxs;
+	};
+
+	struct ChunkMesh {
+		std::vector<DrawVert> verts;
+		std::vector<uint32_t> indices;
+	};
+
+}
+
+static inline vec3_t to_y_up(float const * v) {
+	return { v[0], v[2], -v[1] };
+}
+
+static std::vector<Chunk> make_chunks(Reader const & bspr, size_t max_chunk_verts) {
+	auto models = bspr.models();
+	auto surfaces = bspr.surfaces();
+
+	std::vector<Chunk> ret;
+	for (size_t m = 0; m < models.size(); m++) {
+		Model const & model = models[m];
+		size_t first = std::clamp<int64_t>(model.first_surface, 0, surfaces.size());
+		size_t last = std::clamp<int64_t>(static_cast<int64_t>(model.first_surface) + model.num_surfaces, first, surfaces.size());
+
+		std::map<int32_t, std::vector<int32_t>> by_shader;
+		for (size_t s = first; s < last; s++) {
+			SurfaceType type = surfaces[s].type;
+			if (type == SurfaceType::PLANAR || type == SurfaceType::TRISOUP || type == SurfaceType::PATCH)
+				by_shader[surfaces[s].shader].push_back(s);
+		}
+
+		for (auto const & [shader, group] : by_shader) {
+			size_t verts = 0;
+			for (int32_t s : group) {
+				if (ret.empty() || ret.back().model != static_cast<int32_t>(m) || ret.back().shader != shader || verts >= max_chunk_verts) {
+					Chunk & chunk = ret.emplace_back();
+					chunk.model = m;
+					chunk.shader = shader;
+					verts = 0;
+				}
+				ret.back().surfaces.push_back(s);
+				verts += std::max(surfaces[s].vert_count, 0);
+			}
+		}
+	}
+	return ret;
+}
+
+// the number of vertices and indices build_chunk gives, and with bounds their Y-up bounds, found from the surfaces without building anything
+// checks every surface, so build_chunk never has to
+static void size_chunk(Reader const & bspr, Chunk & chunk, PatchOptions const & opts, bool bounds) {
+	auto surfaces = bspr.surfaces();
+	auto drawverts = bspr.drawverts();
+	auto drawindices = bspr.drawindices();
+
+	chunk.num_verts = chunk.num_indices = 0;
+	vec3_t mins, maxs; // Z-up until the end
+	mins.fill(std::numeric_limits<float>::max());
+	maxs.fill(std::numeric_limits<float>::lowest());
+	auto extend = [&](float const * p){
+		for (size_t a = 0; a < 3; a++) {
+			mins[a] = std::min(mins[a], p[a]);
+			maxs[a] = std::max(maxs[a], p[a]);
+		}
+	};
+
+	for (int32_t s : chunk.surfaces) {
+		Surface const & surface = surfaces[s];
+
+		if (surface.type == SurfaceType::PATCH) {
+			PatchExtent patch = measure_patch(s, surface, drawverts, opts, bounds);
+			chunk.num_verts += patch.num_verts();
+			chunk.num_indices += patch.num_indices();
+			if (bounds) {
+				extend(patch.mins.data());
+				extend(patch.maxs.data());
+			}
+			continue;
+		}
+
+		if (surface.vert_idx < 0 || surface.vert_count < 0 || static_cast<size_t>(surface.vert_idx) + surface.vert_count > drawverts.size())
+			throw std::out_of_range { "surface " + std::to_string(s) + " vertices reach past the drawverts" };
+		if (surface.index_idx < 0 || surface.index_count < 0 || static_cast<size_t>(surface.index_idx) + surface.index_count > drawindices.size())
+			throw std::out_of_range { "surface " + std::to_string(s) + " indices reach past the drawindexes" };
+
+		size_t num_indices = surface.index_count - surface.index_count % 3;
+		for (int32_t i : drawindices.subspan(surface.index_idx, num_indices)) {
+			if (i < 0 || i >= surface.vert_count)
+				throw std::out_of_range { "surface " + std::to_string(s) + " index out of range of its vertices" };
+		}
+		chunk.num_verts += surface.vert_count;
+		chunk.num_indices += num_indices;
+		if (bounds) for (DrawVert const & v : drawverts.subspan(surface.vert_idx, surface.vert_count)) extend(v.pos);
+	}
+
+	// Y-up negates Quake's Y, which swaps its bounds
+	chunk.mins = { mins[0], mins[2], -maxs[1] };
+	chunk.maxs = { maxs[0], maxs[2], -mins[1] };
+}
+
+static void build_chunk(Reader const & bspr, Chunk const & chunk, PatchOptions const & opts, ChunkMesh & out) {
+	auto surfaces = bspr.surfaces();
+	auto drawverts = bspr.drawverts();
+	auto drawindices = bspr.drawindices();
+
+	out.verts.clear();
+	out.indices.clear();
+	PatchMesh patch;
+
+	for (int32_t s : chunk.surfaces) {
+		Surface const & surface = surfaces[s];
+		uint32_t base = out.verts.size();
+
+		if (surface.type == SurfaceType::PATCH) {
+			patch.verts.clear();
+			patch.indices.clear();
+			patch.patches.clear();
+			tessellate_patch(s, surface, drawverts, patch, opts);
+			out.verts.insert(out.verts.end(), patch.verts.begin(), patch.verts.end());
+			for (int32_t i : patch.indices) out.indices.push_back(base + i);
+			continue;
+		}
+
+		// ranges and indices were checked by size_chunk
+		auto verts = drawverts.subspan(surface.vert_idx, surface.vert_count);
+		out.verts.insert(out.verts.end(), verts.begin(), verts.end());
+		for (int32_t i : drawindices.subspan(surface.index_idx, surface.index_count - surface.index_count % 3)) out.indices.push_back(base + i);
+	}
+
+	// the game's triangles face the viewer when clockwise, both formats expect counter-clockwise
+	for (size_t i = 0; i + 2 < out.indices.size(); i += 3) std::swap(out.indices[i + 1], out.indices[i + 2]);
+}
+
+static std::string shader_name(Reader const & bspr, int32_t shader) {
+	auto shaders = bspr.shaders();
+	if (shader < 0 || static_cast<size_t>(shader) >= shaders.size()) return "shader_" + std::to_string(shader);
+	return { shaders[shader].shader, strnlen(shaders[shader].shader, PATH_LENGTH) };
+}
+
+// ================================
+// OBJ
+
+static inline void put(std::string & out, float f) {
+	char buf[32];
+	auto res = std::to_chars(buf, buf + sizeof(buf), f);
+	out.append(buf, res.ptr);
+}
+
+static inline void put(std::string & out, size_t i) {
+	char buf[24];
+	auto res = std::to_chars(buf, buf + sizeof(buf), i);
+	out.append(buf, res.ptr);
+}
+
+static void encode_obj(Reader const & bspr, Chunk const & chunk, ChunkMesh const & mesh, bool new_model, size_t base, std::string & out) {
+	if (new_model) {
+		out += "o model_";
+		put(out, static_cast<size_t>(chunk.model));
+		out += '\n';
+	}
+	// a group rather than a usemtl, there being no material library to name the shader in
+	out += "g ";
+	out += shader_name(bspr, chunk.shader);
+	out += '\n';
+
+	auto vec = [&](char const * tag, vec3_t const & v){
+		out += tag;
+		for (float f : v) {
+			out += ' ';
+			put(out, f);
+		}
+		out += '\n';
+	};
+
+	for (DrawVert const & v : mesh.verts) vec("v", to_y_up(v.pos));
+	for (DrawVert const & v : mesh.verts) {
+		// OBJ texture coordinates start at the bottom of the image
+		out += "vt ";
+		put(out, v.uv[0]);
+		out += ' ';
+		put(out, 1 - v.uv[1]);
+		out += '\n';
+	}
+	for (DrawVert const & v : mesh.verts) vec("vn", to_y_up(v.normal));
+
+	for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+		out += 'f';
+		for (size_t c = 0; c < 3; c++) {
+			size_t idx = base + mesh.indices[i + c] + 1;
+			out += ' ';
+			put(out, idx);
+			out += '/';
+			put(out, idx);
+			out += '/';
+			put(out, idx);
+		}
+		out += '\n';
+	}
+}
+
+// ================================
+// GLB
+
+// per vertex: position, normal, shader UV, lightmap UV, color, all 4-byte aligned
+static constexpr size_t GLB_VERTEX_BYTES = 12 + 12 + 8 + 8 + 4;
+
+static inline size_t glb_chunk_bytes(Chunk const & chunk) {
+	return chunk.num_verts * GLB_VERTEX_BYTES + chunk.num_indices * 4;
+}
+
+static void encode_glb(ChunkMesh const & mesh, std::string & out) {
+	size_t n = mesh.verts.size();
+	out.resize(n * GLB_VERTEX_BYTES + mesh.indices.size() * 4);
+	char * pos = out.data(), * nrm = pos + n * 12, * uv = nrm + n * 12, * lm = uv + n * 8, * col = lm + n * 8, * idx = col + n * 4;
+
+	for (DrawVert const & v : mesh.verts) {
+		vec3_t p = to_y_up(v.pos), nm = to_y_up(v.normal);
+		std::memcpy(pos, p.data(), 12); pos += 12;
+		std::memcpy(nrm, nm.data(), 12); nrm += 12;
+		std::memcpy(uv, v.uv, 8); uv += 8;
+		std::memcpy(lm, v.lightmap[0], 8); lm += 8;
+		std::memcpy(col, v.color[0], 4); col += 4;
+	}
+	std::memcpy(idx, mesh.indices.data(), mesh.indices.size() * 4);
+}
+
+static void json_string(std::string & out, std::string_view str) {
+	out += '"';
+	for (char c : str) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (static_cast<unsigned char>(c) < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		} else out += c;
+	}
+	out += '"';
+}
+
+static std::string glb_json(Reader const & bspr, std::vector<Chunk> const & chunks, size_t bin_bytes) {
+	std::string j;
+	auto num = [&](auto v){ put(j, v); };
+
+	// materials, one per shader in order of first use
+	std::map<int32_t, size_t> materials;
+	std::vector<int32_t> material_shaders;
+	for (Chunk const & chunk : chunks) {
+		if (materials.emplace(chunk.shader, material_shaders.size()).second) material_shaders.push_back(chunk.shader);
+	}
+
+	j += R"({"asset":{"version":"2.0","generator":"libbsp"},"scene":0)";
+
+	// meshes and nodes, one per model
+	std::string nodes, scene_nodes;
+	size_t mesh_count = 0;
+	j += R"(,"meshes":[)";
+	for (size_t c = 0; c < chunks.size(); ) {
+		int32_t model = chunks[c].model;
+		if (mesh_count) j += ',';
+		j += R"({"name":"model_)";
+		num(static_cast<size_t>(model));
+		j += R"(","primitives":[)";
+		for (bool first = true; c < chunks.size() && chunks[c].model == model; c++, first = false) {
+			size_t a = c * 6;
+			if (!first) j += ',';
+			j += R"({"attributes":{"POSITION":)"; num(a);
+			j += R"(,"NORMAL":)"; num(a + 1);
+			j += R"(,"TEXCOORD_0":)"; num(a + 2);
+			j += R"(,"TEXCOORD_1":)"; num(a + 3);
+			j += R"(,"COLOR_0":)"; num(a + 4);
+			j += R"(},"indices":)"; num(a + 5);
+			j += R"(,"material":)"; num(materials[chunks[c].shader]);
+			j += '}';
+		}
+		j += "]}";
+		if (mesh_count) {
+			nodes += ',';
+			scene_nodes += ',';
+		}
+		nodes += R"({"name":"model_)" + std::to_string(model) + R"(","mesh":)" + std::to_string(mesh_count) + '}';
+		scene_nodes += std::to_string(mesh_count);
+		mesh_count++;
+	}
+	j += ']';
+	j += R"(,"nodes":[)" + nodes + ']';
+	j += R"(,"scenes":[{"nodes":[)" + scene_nodes + "]}]";
+
+	j += R"(,"materials":[)";
+	for (size_t m = 0; m < material_shaders.size(); m++) {
+		if (m) j += ',';
+		j += R"({"name":)";
+		json_string(j, shader_name(bspr, material_shaders[m]));
+		j += R"(,"doubleSided":false})";
+	}
+	j += ']';
+
+	j += R"(,"buffers":[{"byteLength":)";
+	num(bin_bytes);
+	j += "}]";
+
+	// buffer views and accessors, six of each per chunk in the order encode_glb lays them out
+	std::string views, accessors;
+	size_t offset = 0;
+	for (size_t c = 0; c < chunks.size(); c++) {
+		Chunk const & chunk = chunks[c];
+		size_t n = chunk.num_verts;
+		struct { size_t bytes; int target; char const * accessor; } parts[6] = {
+			{ n * 12, 34962, R"("componentType":5126,"type":"VEC3")" },
+			{ n * 12, 34962, R"("componentType":5126,"type":"VEC3")" },
+			{ n * 8, 34962, R"("componentType":5126,"type":"VEC2")" },
+			{ n * 8, 34962, R"("componentType":5126,"type":"VEC2")" },
+			{ n * 4, 34962, R"("componentType":5121,"normalized":true,"type":"VEC4")" },
+			{ chunk.num_indices * 4, 34963, R"("componentType":5125,"type":"SCALAR")" },
+		};
+		for (size_t p = 0; p < 6; p++) {
+			size_t view = c * 6 + p;
+			if (view) {
+				views += ',';
+				accessors += ',';
+			}
+			views += R"({"buffer":0,"byteOffset":)" + std::to_string(offset) + R"(,"byteLength":)" + std::to_string(parts[p].bytes) + R"(,"target":)" + std::to_string(parts[p].target) + '}';
+			accessors += R"({"bufferView":)" + std::to_string(view) + ',' + parts[p].accessor + R"(,"count":)" + std::to_string(p == 5 ? chunk.num_indices : n);
+			if (p == 0) {
+				// positions must declare their bounds
+				accessors += R"(,"min":[)";
+				for (size_t a = 0; a < 3; a++) {
+					if (a) accessors += ',';
+					put(accessors, chunk.mins[a]);
+				}
+				accessors += R"(],"max":[)";
+				for (size_t a = 0; a < 3; a++) {
+					if (a) accessors += ',';
+					put(accessors, chunk.maxs[a]);
+				}
+				accessors += ']';
+			}
+			accessors += '}';
+			offset += parts[p].bytes;
+		}
+	}
+	j += R"(,"bufferViews":[)" + views + ']';
+	j += R"(,"accessors":[)" + accessors + ']';
+	j += '}';
+
+	// the JSON chunk is padded with spaces to keep the binary chunk aligned
+	while (j.size() % 4) j += ' ';
+	return j;
+}
+
+static inline void put_u32(std::ostream & out, uint32_t v) {
+	static_assert(std::endian::native == std::endian::little);
+	out.write(reinterpret_cast<char const *>(&v), 4);
+}
+
+// ================================
+
+MeshExportStats BSP::export_mesh(Reader const & bspr, std::ostream & out, MeshFormat format, MeshExportOptions const & opts) {
+
+	std::vector<Chunk> chunks = make_chunks(bspr, std::max<size_t>(opts.max_chunk_verts, 1));
+
+	// sizing pass, so the output's layout is known before anything is written, with only GLB needing the bounds
+	bool const bounds = format == MeshFormat::GLB;
+	parallel_for(chunks.size(), opts.threads, [&](size_t c){ size_chunk(bspr, chunks[c], opts.patches, bounds); });
+	std::erase_if(chunks, [](Chunk const & chunk){ return !chunk.num_verts || !chunk.num_indices; });
+
+	MeshExportStats stats;
+	stats.chunks = chunks.size();
+	for (Chunk const & chunk : chunks) {
+		stats.verts += chunk.num_verts;
+		stats.triangles += chunk.num_indices / 3;
+	}
+
+	std::vector<size_t> vertex_base (chunks.size());
+	for (size_t c = 1; c < chunks.size(); c++) vertex_base[c] = vertex_base[c - 1] + chunks[c - 1].num_verts;
+
+	if (format == MeshFormat::GLB) {
+		size_t bin_bytes = 0;
+		for (Chunk const & chunk : chunks) bin_bytes += glb_chunk_bytes(chunk);
+		std::string json = glb_json(bspr, chunks, bin_bytes);
+		size_t total = 12 + 8 + json.size() + 8 + bin_bytes;
+		if (total > std::numeric_limits<uint32_t>::max()) throw std::length_error {"mesh too large for a binary glTF file"};
+
+		put_u32(out, 0x46546C67); // "glTF"
+		put_u32(out, 2);
+		put_u32(out, total);
+		put_u32(out, json.size());
+		put_u32(out, 0x4E4F534A); // "JSON"
+		out.write(json.data(), json.size());
+		put_u32(out, bin_bytes);
+		put_u32(out, 0x004E4942); // "BIN"
+		stats.bytes = total - bin_bytes;
+	} else {
+		std::string_view header = "# exported by libbsp\n";
+		out.write(header.data(), header.size());
+		stats.bytes = header.size();
+	}
+
+	// encode a window of chunks in parallel, then write them in order, only the window's chunks are ever held in memory
+	size_t window = (opts.threads ? opts.threads : hardware_threads()) * 2;
+	std::vector<std::string> encoded (window);
+	for (size_t first = 0; first < chunks.size(); first += window) {
+		size_t count = std::min(window, chunks.size() - first);
+		parallel_for(count, opts.threads, [&](size_t i){
+			size_t c = first + i;
+			ChunkMesh mesh;
+			build_chunk(bspr, chunks[c], opts.patches, mesh);
+			encoded[i].clear();
+			if (format == MeshFormat::GLB) encode_glb(mesh, encoded[i]);
+			else encode_obj(bspr, chunks[c], mesh, !c || chunks[c - 1].model != chunks[c].model, vertex_base[c], encoded[i]);
+		});
+		for (size_t i = 0; i < count; i++) {
+			out.write(encoded[i].data(), encoded[i].size());
+			stats.bytes += encoded[i].size();
+		}
+	}
+
+	return stats;
+}
@@ -0,0 +1,266 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+using namespace BSP;
+
+namespace {
+
+	// which elements of a lump are referred to, and their new indices once the rest are removed
+	// ranges are marked through a difference array, so marking stays linear however much they overlap
+	struct Liveness {
+
+		explicit Liveness(size_t size) : m_depth(size + 1, 0) {}
+
+		inline size_t size() const { return m_depth.size() - 1; }
+
+		inline void mark(size_t first, size_t count = 1) {
+			if (!count) return;
+			m_depth[first]++;
+			m_depth[first + count]--;
+		}
+
+		// resolve the marks, live() and the renumbering are only valid afterwards
+		void finish() {
+			m_remap.resize(m_depth.size());
+			int64_t depth = 0;
+			int32_t live = 0;
+			for (size_t i = 0; i < size(); i++) {
+				depth += m_depth[i];
+				m_depth[i] = depth > 0;
+				m_remap[i] = live;
+				live += m_depth[i];
+			}
+			m_remap.back() = live;
+		}
+
+		inline bool live(size_t i) const { return m_depth[i]; }
+		inline size_t count() const { return m_remap.back(); }
+
+		// new index of a live element, or of the next live one after a dead element, up to and including size()
+		inline int32_t operator [] (size_t i) const { return m_remap[i]; }
+
+		// new index of the first element of a range, empty ranges are clamped into the lump
+		inline int32_t first(int32_t first, int32_t count) const {
+			return count ? m_remap[first] : m_remap[std::clamp<int64_t>(first, 0, size())];
+		}
+
+		// drop the dead elements, returning how many there were
+		template <typename A> size_t compact(A & array) const {
+			size_t out = 0;
+			for (size_t i = 0; i < array.size(); i++) {
+				if (!live(i)) continue;
+				if (out != i) array[out] = std::move(array[i]);
+				out++;
+			}
+			size_t removed = array.size() - out;
+			array.resize(out);
+			return removed;
+		}
+
+	private:
+		std::vector<int32_t> m_depth, m_remap;
+	};
+
+}
+
+static void check_range(int64_t first, int64_t count, size_t size, char const * what, size_t idx, char const * lump) {
+	if (first < 0 || count < 0 || static_cast<size_t>(first + count) > size)
+		throw std::out_of_range { std::string { what } + " " + std::to_string(idx) + " reaches past the " + lump };
+}
+
+static void check_index(int64_t i, size_t size, char const * what, size_t idx, char const * lump) {
+	if (i < 0 || static_cast<size_t>(i) >= size)
+		throw std::out_of_range { std::string { what } + " " + std::to_string(idx) + " refers past the " + lump };
+}
+
+static void count_lumps(BSPI::IndexedLumps const & lumps, std::array<size_t, 18> & counts) {
+	auto set = [&](LumpIndex idx, size_t count){ counts[static_cast<size_t>(idx)] = count; };
+	set(LumpIndex::SHADERS, lumps.shaders.size());
+	set(LumpIndex::PLANES, lumps.planes.size());
+	set(LumpIndex::NODES, lumps.nodes.size());
+	set(LumpIndex::LEAFS, lumps.leafs.size());
+	set(LumpIndex::LEAFSURFACES, lumps.leaf_surfaces.size());
+	set(LumpIndex::LEAFBRUSHES, lumps.leaf_brushes.size());
+	set(LumpIndex::MODELS, lumps.models.size());
+	set(LumpIndex::BRUSHES, lumps.brushes.size());
+	set(LumpIndex::BRUSHSIDES, lumps.brush_sides.size());
+	set(LumpIndex::DRAWVERTS, lumps.verts.size());
+	set(LumpIndex::DRAWINDEXES, lumps.indices.size());
+	set(LumpIndex::FOGS, lumps.fogs.size());
+	set(LumpIndex::SURFACES, lumps.surfaces.size());
+	set(LumpIndex::LIGHTMAPS, lumps.lightmaps.size());
+}
+
+GarbageReport BSP::collect_garbage(BSPI::IndexedLumps & lumps, GarbageOptions const & opts) {
+	GarbageReport report;
+	count_lumps(lumps, report.before);
+
+	// deluxe maps are only ever used through the light map before them, so pairs live and die together
+	size_t const stride = opts.deluxe ? 2 : 1;
+	if (lumps.lightmaps.size() % stride)
+		throw std::invalid_argument { "deluxe mapped lightmaps come in pairs, but there are " + std::to_string(lumps.lightmaps.size()) };
+
+	Liveness shaders { lumps.shaders.size() };
+	Liveness planes { lumps.planes.size() };
+	Liveness brushes { lumps.brushes.size() };
+	Liveness sides { lumps.brush_sides.size() };
+	Liveness verts { lumps.verts.size() };
+	Liveness indices { lumps.indices.size() };
+	Liveness lightmaps { lumps.lightmaps.size() };
+	Liveness leaf_surfaces { lumps.leaf_surfaces.size() };
+	Liveness leaf_brushes { lumps.leaf_brushes.size() };
+
+	// ================================
+	// MARK
+
+	// negative shaders mean none, as written for some brushes and sides by other tools
+	auto mark_shader = [&](int32_t shader, char const * what, size_t idx) {
+		if (shader < 0) return;
+		check_index(shader, shaders.size(), what, idx, "shaders");
+		shaders.mark(shader);
+	};
+	auto mark_plane = [&](int32_t plane, char const * what, size_t idx) {
+		check_index(plane, planes.size(), what, idx, "planes");
+		size_t pair = plane & ~1;
+		planes.mark(pair, std::min<size_t>(2, planes.size() - pair));
+	};
+
+	for (size_t s = 0; s < lumps.surfaces.size(); s++) {
+		Surface const & surface = lumps.surfaces[s];
+		mark_shader(surface.shader, "surface", s);
+		// a surface without vertices is never drawn, as --rmsurf leaves them, so its indices and lightmaps are garbage too
+		if (!surface.vert_count) continue;
+		check_range(surface.vert_idx, surface.vert_count, verts.size(), "surface", s, "drawverts");
+		verts.mark(surface.vert_idx, surface.vert_count);
+		if (surface.index_count) {
+			check_range(surface.index_idx, surface.index_count, indices.size(), "surface", s, "drawindexes");
+			indices.mark(surface.index_idx, surface.index_count);
+		}
+		for (int32_t lightmap : surface.lightmap) {
+			if (lightmap < 0) continue; // vertex lit, or no lightmap in this style
+			check_index(lightmap, lightmaps.size(), "surface", s, "lightmaps");
+			if (lightmap % stride)
+				throw std::logic_error { "surface " + std::to_string(s) + " refers to deluxe map " + std::to_string(lightmap) + " instead of a light map" };
+			lightmaps.mark(lightmap, stride);
+		}
+	}
+
+	for (size_t m = 0; m < lumps.models.size(); m++) {
+		Model const & model = lumps.models[m];
+		check_range(model.first_brush, model.num_brushes, brushes.size(), "model", m, "brushes");
+		brushes.mark(model.first_brush, model.num_brushes);
+	}
+
+	for (size_t l = 0; l < lumps.leafs.size(); l++) {
+		Leaf const & leaf = lumps.leafs[l];
+		check_range(leaf.first_surface, leaf.num_surfaces, leaf_surfaces.size(), "leaf", l, "leafsurfaces");
+		leaf_surfaces.mark(leaf.first_surface, leaf.num_surfaces);
+		check_range(leaf.first_brush, leaf.num_brushes, leaf_brushes.size(), "leaf", l, "leafbrushes");
+		leaf_brushes.mark(leaf.first_brush, leaf.num_brushes);
+	}
+	leaf_surfaces.finish();
+	leaf_brushes.finish();
+
+	for (size_t i = 0; i < lumps.leaf_brushes.size(); i++) {
+		if (!leaf_brushes.live(i)) continue;
+		check_index(lumps.leaf_brushes[i], brushes.size(), "leafbrush", i, "brushes");
+		brushes.mark(lumps.leaf_brushes[i]);
+	}
+
+	// global fog has no brush
+	for (size_t f = 0; f < lumps.fogs.size(); f++) {
+		Fog const & fog = lumps.fogs[f];
+		if (fog.brush >= 0) {
+			check_index(fog.brush, brushes.size(), "fog", f, "brushes");
+			brushes.mark(fog.brush);
+		}
+		if (fog.visible_side >= 0) {
+			check_index(fog.visible_side, sides.size(), "fog", f, "brushsides");
+			sides.mark(fog.visible_side);
+		}
+	}
+	brushes.finish();
+
+	for (size_t b = 0; b < lumps.brushes.size(); b++) {
+		if (!brushes.live(b)) continue;
+		Brush const & brush = lumps.brushes[b];
+		check_range(brush.first_side, brush.num_sides, sides.size(), "brush", b, "brushsides");
+		sides.mark(brush.first_side, brush.num_sides);
+		mark_shader(brush.shader, "brush", b);
+	}
+	sides.finish();
+
+	for (size_t i = 0; i < lumps.brush_sides.size(); i++) {
+		if (!sides.live(i)) continue;
+		mark_plane(lumps.brush_sides[i].plane, "brushside", i);
+		mark_shader(lumps.brush_sides[i].shader, "brushside", i);
+	}
+
+	for (size_t n = 0; n < lumps.nodes.size(); n++) mark_plane(lumps.nodes[n].plane, "node", n);
+
+	shaders.finish();
+	planes.finish();
+	verts.finish();
+	indices.finish();
+	lightmaps.finish();
+
+	// ================================
+	// RENUMBER
+
+	auto renumber_shader = [&](int32_t & shader){ if (shader >= 0) shader = shaders[shader]; };
+
+	for (Surface & surface : lumps.surfaces) {
+		renumber_shader(surface.shader);
+		surface.vert_idx = verts.first(surface.vert_idx, surface.vert_count);
+		if (!surface.vert_count) {
+			surface.index_idx = surface.index_count = 0;
+			for (int32_t & lightmap : surface.lightmap)
+				if (lightmap >= 0) lightmap = -1; // none, the one it had may be gone
+			continue;
+		}
+		surface.index_idx = indices.first(surface.index_idx, surface.index_count);
+		for (int32_t & lightmap : surface.lightmap)
+			if (lightmap >= 0) lightmap = lightmaps[lightmap];
+	}
+	for (Model & model : lumps.models) model.first_brush = brushes.first(model.first_brush, model.num_brushes);
+	for (Leaf & leaf : lumps.leafs) {
+		leaf.first_surface = leaf_surfaces.first(leaf.first_surface, leaf.num_surfaces);
+		leaf.first_brush = leaf_brushes.first(leaf.first_brush, leaf.num_brushes);
+	}
+	for (size_t i = 0; i < lumps.leaf_brushes.size(); i++)
+		if (leaf_brushes.live(i)) lumps.leaf_brushes[i] = brushes[lumps.leaf_brushes[i]];
+	for (Fog & fog : lumps.fogs) {
+		if (fog.brush >= 0) fog.brush = brushes[fog.brush];
+		if (fog.visible_side >= 0) fog.visible_side = sides[fog.visible_side];
+	}
+	for (size_t b = 0; b < lumps.brushes.size(); b++) {
+		if (!brushes.live(b)) continue;
+		Brush & brush = lumps.brushes[b];
+		brush.first_side = sides.first(brush.first_side, brush.num_sides);
+		renumber_shader(brush.shader);
+	}
+	for (size_t i = 0; i < lumps.brush_sides.size(); i++) {
+		if (!sides.live(i)) continue;
+		BrushSide & side = lumps.brush_sides[i];
+		side.plane = planes[side.plane];
+		renumber_shader(side.shader);
+	}
+	for (Node & node : lumps.nodes) node.plane = planes[node.plane];
+
+	report.bytes += shaders.compact(lumps.shaders) * sizeof(Shader);
+	report.bytes += planes.compact(lumps.planes) * sizeof(Plane);
+	report.bytes += brushes.compact(lumps.brushes) * sizeof(Brush);
+	report.bytes += sides.compact(lumps.brush_sides) * sizeof(BrushSide);
+	report.bytes += verts.compact(lumps.verts) * sizeof(DrawVert);
+	report.bytes += indices.compact(lumps.indices) * sizeof(int32_t);
+	report.bytes += lightmaps.compact(lumps.lightmaps) * sizeof(Lightmap);
+	report.bytes += leaf_surfaces.compact(lumps.leaf_surfaces) * sizeof(int32_t);
+	report.bytes += leaf_brushes.compact(lumps.leaf_brushes) * sizeof(int32_t);
+
+	count_lumps(lumps, report.after);
+	return report;
+}
@@ -0,0 +1,101 @@
+#include "libbsp.hh"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+using namespace BSP;
+
+static void check_pixels(uint32_t width, uint32_t height, std::span<Color const> pixels) {
+	if (static_cast<uint64_t>(width) * height > pixels.size())
+		throw std::out_of_range { std::to_string(width) + "x" + std::to_string(height) + " image needs more than the " + std::to_string(pixels.size()) + " pixels given" };
+}
+
+std::vector<uint8_t> BSP::encode_ppm(uint32_t width, uint32_t height, std::span<Color const> pixels) {
+	check_pixels(width, height, pixels);
+	std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+	size_t const bytes = static_cast<size_t>(width) * height * sizeof(Color);
+	std::vector<uint8_t> out (header.size() + bytes);
+	std::memcpy(out.data(), header.data(), header.size());
+	std::memcpy(out.data() + header.size(), pixels.data(), bytes);
+	return out;
+}
+
+// ================================
+// QOI
+
+static constexpr uint8_t QOI_OP_INDEX = 0x00;
+static constexpr uint8_t QOI_OP_DIFF = 0x40;
+static constexpr uint8_t QOI_OP_LUMA = 0x80;
+static constexpr uint8_t QOI_OP_RUN = 0xC0;
+static constexpr uint8_t QOI_OP_RGB = 0xFE;
+static constexpr uint32_t QOI_MAX_RUN = 62;
+
+// alpha is always opaque, so its term of the hash is the constant 255 * 11
+static inline uint8_t qoi_hash(Color c) {
+	return (c.r * 3 + c.g * 5 + c.b * 7 + 255 * 11) % 64;
+}
+
+static inline bool same(Color a, Color b) {
+	return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+// index entries with the opaque alpha packed in, so the zeroed entries QOI starts with never match a pixel
+static inline uint32_t qoi_pack(Color c) {
+	return c.r | c.g << 8 | c.b << 16 | 0xFFu << 24;
+}
+
+std::vector<uint8_t> BSP::encode_qoi(uint32_t width, uint32_t height, std::span<Color const> pixels) {
+	check_pixels(width, height, pixels);
+	size_t const count = static_cast<size_t>(width) * height;
+
+	std::vector<uint8_t> out;
+	out.reserve(14 + count * 4 + 8); // the worst case, every pixel as QOI_OP_RGB
+	auto put32 = [&](uint32_t v){ for (int s = 24; s >= 0; s -= 8) out.push_back(v >> s); };
+	out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+	put32(width);
+	put32(height);
+	out.push_back(3); // channels
+	out.push_back(0); // sRGB
+
+	uint32_t index[64] {};
+	Color prev { 0, 0, 0 };
+	uint32_t run = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		Color const px = pixels[i];
+		if (same(px, prev)) {
+			if (++run == QOI_MAX_RUN) {
+				out.push_back(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+			continue;
+		}
+		if (run) {
+			out.push_back(QOI_OP_RUN | (run - 1));
+			run = 0;
+		}
+
+		uint8_t const hash = qoi_hash(px);
+		if (index[hash] == qoi_pack(px)) {
+			out.push_back(QOI_OP_INDEX | hash);
+		} else {
+			index[hash] = qoi_pack(px);
+			int8_t const dr = px.r - prev.r, dg = px.g - prev.g, db = px.b - prev.b;
+			int8_t const dr_dg = dr - dg, db_dg = db - dg;
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+				out.push_back(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+			} else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+				out.push_back(QOI_OP_LUMA | (dg + 32));
+				out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+			} else {
+				out.insert(out.end(), { QOI_OP_RGB, px.r, px.g, px.b });
+			}
+		}
+		prev = px;
+	}
+	if (run) out.push_back(QOI_OP_RUN | (run - 1));
+
+	out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+	return out;
+}
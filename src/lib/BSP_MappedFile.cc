@@ -0,0 +1,106 @@
+#include "libbsp/mapped_file.hh"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+using namespace BSP;
+
+MappedFile::MappedFile(std::string const & path, bool populate) {
+
+	m_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (m_fd == -1) throw Reader::ReadException { "failed to open \"" + path + "\": " + std::strerror(errno) };
+
+	struct stat sb;
+	if (fstat(m_fd, &sb) == -1) {
+		int err = errno;
+		release();
+		throw Reader::ReadException { "failed to stat \"" + path + "\": " + std::strerror(err) };
+	}
+
+	if (sb.st_size < static_cast<off_t>(sizeof(Header))) {
+		release();
+		throw Reader::ReadException { "file too small to be a BSP file" };
+	}
+	m_size = sb.st_size;
+
+	int flags = MAP_PRIVATE;
+	#ifdef MAP_POPULATE
+	if (populate) flags |= MAP_POPULATE;
+	#else
+	(void)populate;
+	#endif
+
+	void * ptr = mmap(nullptr, m_size, PROT_READ, flags, m_fd, 0);
+	if (ptr == MAP_FAILED) {
+		int err = errno;
+		m_size = 0;
+		release();
+		throw Reader::ReadException { "failed to map \"" + path + "\": " + std::strerror(err) };
+	}
+	m_data = reinterpret_cast<uint8_t const *>(ptr);
+
+	try {
+		Reader {}.rebase(m_data, m_size);
+	} catch (...) {
+		release();
+		throw;
+	}
+}
+
+MappedFile::MappedFile(MappedFile && other) noexcept :
+	m_data { std::exchange(other.m_data, nullptr) },
+	m_size { std::exchange(other.m_size, 0) },
+	m_fd { std::exchange(other.m_fd, -1) }
+{}
+
+MappedFile & MappedFile::operator = (MappedFile && other) noexcept {
+	if (this == &other) return *this;
+	release();
+	m_data = std::exchange(other.m_data, nullptr);
+	m_size = std::exchange(other.m_size, 0);
+	m_fd = std::exchange(other.m_fd, -1);
+	return *this;
+}
+
+MappedFile::~MappedFile() {
+	release();
+}
+
+void MappedFile::release() noexcept {
+	if (m_data) munmap(const_cast<uint8_t *>(m_data), m_size);
+	if (m_fd != -1) close(m_fd);
+	m_data = nullptr;
+	m_size = 0;
+	m_fd = -1;
+}
+
+void MappedFile::advise(LumpIndex idx, Advice advice) const {
+
+	if (!m_data) return;
+
+	Lump const & lump = reinterpret_cast<Header const *>(m_data)->lumps[static_cast<size_t>(idx)];
+	if (!lump.size) return;
+
+	// madvise wants a page aligned start, so round the lump start down and extend the length to match
+	static size_t const page_size = sysconf(_SC_PAGESIZE);
+	size_t begin = static_cast<size_t>(lump.offs) & ~(page_size - 1);
+	size_t end = static_cast<size_t>(lump.offs) + static_cast<size_t>(lump.size);
+
+	int madv = MADV_NORMAL;
+	switch (advice) {
+		case Advice::NORMAL:     madv = MADV_NORMAL; break;
+		case Advice::WILLNEED:   madv = MADV_WILLNEED; break;
+		case Advice::DONTNEED:   madv = MADV_DONTNEED; break;
+		case Advice::SEQUENTIAL: madv = MADV_SEQUENTIAL; break;
+		case Advice::RANDOM:     madv = MADV_RANDOM; break;
+	}
+
+	// hints are best effort, a failure here doesn't affect correctness
+	madvise(const_cast<uint8_t *>(m_data) + begin, end - begin, madv);
+}
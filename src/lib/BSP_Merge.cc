@@ -0,0 +1,238 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+using namespace BSP;
+
+static inline bool mergeable(Surface const & surface) {
+	return (surface.type == SurfaceType::PLANAR || surface.type == SurfaceType::TRISOUP) && surface.vert_count > 0 && surface.index_count >= 3 && surface.index_count % 3 == 0;
+}
+
+// everything a surface is drawn with apart from its geometry
+static inline auto draw_state(Surface const & surface) {
+	return std::tuple { surface.shader, surface.fog, std::to_array(surface.lightmap), std::to_array(surface.lightmap_styles), std::to_array(surface.vertex_styles) };
+}
+
+// planar surfaces carry their plane normal in the third lightmap vector, as q3map2 writes it
+static bool coplanar(Surface const & a, Surface const & b, BSPI::VertexArray const & verts) {
+	static constexpr float NORMAL_EPSILON = 0.00001f, DIST_EPSILON = 0.01f; // same as q3map2's plane snapping
+	if (a.type != SurfaceType::PLANAR || b.type != SurfaceType::PLANAR) return false;
+	float const * na = a.lightmap_vectors[2], * nb = b.lightmap_vectors[2];
+	for (size_t i = 0; i < 3; i++)
+		if (std::abs(na[i] - nb[i]) > NORMAL_EPSILON) return false;
+	float const * pa = verts[a.vert_idx].pos, * pb = verts[b.vert_idx].pos;
+	float da = na[0] * pa[0] + na[1] * pa[1] + na[2] * pa[2], db = na[0] * pb[0] + na[1] * pb[1] + na[2] * pb[2];
+	return std::abs(da - db) <= DIST_EPSILON;
+}
+
+// ================================
+
+SurfaceMergeReport BSP::merge_surfaces(
+	BSPI::SurfaceArray & surfaces, BSPI::VertexArray & verts, BSPI::IndexArray & indices,
+	BSPI::LeafArray & leafs, BSPI::LeafSurfaceArray & leaf_surfaces, BSPI::ModelArray & models,
+	BSPI::BrushSideArray & brush_sides, SurfaceMergeOptions const & opts
+) {
+	SurfaceMergeReport report;
+	size_t const count = surfaces.size();
+	report.surfaces_before = count;
+
+	for (size_t s = 0; s < count; s++) {
+		Surface const & surface = surfaces[s];
+		if (surface.vert_count < 0 || surface.index_count < 0)
+			throw std::out_of_range { "surface " + std::to_string(s) + " has a negative vertex or index count" };
+		if (surface.vert_count && (surface.vert_idx < 0 || static_cast<size_t>(surface.vert_idx) + surface.vert_count > verts.size()))
+			throw std::out_of_range { "surface " + std::to_string(s) + " vertices reach past the drawverts" };
+		if (surface.index_count && (surface.index_idx < 0 || static_cast<size_t>(surface.index_idx) + surface.index_count > indices.size()))
+			throw std::out_of_range { "surface " + std::to_string(s) + " indices reach past the drawindexes" };
+		if (!mergeable(surface)) continue;
+		// merged indices are rebased onto the other surfaces' vertices, so a bad one would silently pick up a neighbour's
+		for (int32_t i = 0; i < surface.index_count; i++) {
+			int32_t idx = indices[surface.index_idx + i];
+			if (idx < 0 || idx >= surface.vert_count) throw std::out_of_range { "surface " + std::to_string(s) + " has an index outside of its vertices" };
+		}
+	}
+
+	// surfaces can only be merged within the one model that draws them
+	std::vector<int32_t> owner (count, -1);
+	std::vector<uint8_t> owners (count, 0);
+	for (size_t m = 0; m < models.size(); m++) {
+		Model const & model = models[m];
+		if (model.first_surface < 0 || model.num_surfaces < 0 || static_cast<size_t>(model.first_surface) + model.num_surfaces > count)
+			throw std::out_of_range { "model " + std::to_string(m) + " surfaces reach past the surfaces" };
+		for (int32_t s = model.first_surface; s < model.first_surface + model.num_surfaces; s++) {
+			owner[s] = m;
+			if (owners[s] < 2) owners[s]++;
+		}
+	}
+
+	// leafs drawing each surface, in leaf order
+	std::vector<uint32_t> leaf_offsets (count + 1, 0);
+	std::vector<uint32_t> surface_leafs;
+	{
+		std::vector<int64_t> last (count, -1);
+		for (size_t l = 0; l < leafs.size(); l++) {
+			Leaf const & leaf = leafs[l];
+			if (leaf.first_surface < 0 || leaf.num_surfaces < 0 || static_cast<size_t>(leaf.first_surface) + leaf.num_surfaces > leaf_surfaces.size())
+				throw std::out_of_range { "leaf " + std::to_string(l) + " surfaces reach past the leafsurfaces" };
+			report.leaf_refs_before += leaf.num_surfaces;
+			for (int32_t i = leaf.first_surface; i < leaf.first_surface + leaf.num_surfaces; i++) {
+				int32_t s = leaf_surfaces[i];
+				if (s < 0 || static_cast<size_t>(s) >= count) throw std::out_of_range { "leafsurface " + std::to_string(i) + " is not a surface" };
+				if (last[s] == static_cast<int64_t>(l)) continue;
+				last[s] = l;
+				leaf_offsets[s + 1]++;
+			}
+		}
+		for (size_t s = 0; s < count; s++) leaf_offsets[s + 1] += leaf_offsets[s];
+		surface_leafs.resize(leaf_offsets[count]);
+		std::vector<uint32_t> fill { leaf_offsets.begin(), leaf_offsets.end() - 1 };
+		std::fill(last.begin(), last.end(), -1);
+		for (size_t l = 0; l < leafs.size(); l++) {
+			for (int32_t i = leafs[l].first_surface; i < leafs[l].first_surface + leafs[l].num_surfaces; i++) {
+				int32_t s = leaf_surfaces[i];
+				if (last[s] == static_cast<int64_t>(l)) continue;
+				last[s] = l;
+				surface_leafs[fill[s]++] = l;
+			}
+		}
+	}
+	auto leafs_of = [&](uint32_t s){ return std::span<uint32_t const> { surface_leafs.data() + leaf_offsets[s], leaf_offsets[s + 1] - leaf_offsets[s] }; };
+
+	// candidates sorted so that surfaces which can be merged are next to each other, in their original order
+	std::vector<uint32_t> candidates;
+	for (size_t s = 0; s < count; s++)
+		if (owners[s] == 1 && mergeable(surfaces[s])) candidates.push_back(s);
+	std::sort(candidates.begin(), candidates.end(), [&](uint32_t a, uint32_t b){
+		if (owner[a] != owner[b]) return owner[a] < owner[b];
+		auto sa = draw_state(surfaces[a]), sb = draw_state(surfaces[b]);
+		if (sa != sb) return sa < sb;
+		auto la = leafs_of(a), lb = leafs_of(b);
+		if (!std::equal(la.begin(), la.end(), lb.begin(), lb.end())) return std::lexicographical_compare(la.begin(), la.end(), lb.begin(), lb.end());
+		return a < b;
+	});
+
+	// pack runs of compatible surfaces into groups as large as the renderer allows
+	struct Group { size_t first, count; size_t verts, indices; bool planar; };
+	std::vector<Group> groups;
+	std::vector<int32_t> group_of (count, -1);
+	for (size_t i = 0; i < candidates.size(); i++) {
+		uint32_t s = candidates[i];
+		Surface const & surface = surfaces[s];
+		if (groups.size()) {
+			Group & group = groups.back();
+			uint32_t lead = candidates[group.first];
+			auto ll = leafs_of(lead), ls = leafs_of(s);
+			if (owner[lead] == owner[s] && draw_state(surfaces[lead]) == draw_state(surface) && std::equal(ll.begin(), ll.end(), ls.begin(), ls.end())
+				&& group.verts + surface.vert_count <= opts.max_verts && group.indices + surface.index_count <= opts.max_indices) {
+				group.count++;
+				group.verts += surface.vert_count;
+				group.indices += surface.index_count;
+				group.planar = group.planar && coplanar(surfaces[lead], surface, verts);
+				group_of[s] = groups.size() - 1;
+				continue;
+			}
+		}
+		groups.push_back({ i, 1, static_cast<size_t>(surface.vert_count), static_cast<size_t>(surface.index_count), surface.type == SurfaceType::PLANAR });
+		group_of[s] = groups.size() - 1;
+	}
+
+	// ================================
+	// REBUILD
+
+	// every merged surface takes the place of its first original, which keeps it within its model's range
+	// ranges of surfaces that are not merged are copied once and stay shared, partially overlapping ones are copied separately
+	BSPI::SurfaceArray new_surfaces;
+	BSPI::VertexArray new_verts;
+	BSPI::IndexArray new_indices;
+	new_surfaces.reserve(count);
+	new_verts.reserve(verts.size());
+	new_indices.reserve(indices.size());
+
+	std::map<std::pair<int32_t, int32_t>, int32_t> vert_ranges, index_ranges;
+	auto copy_range = [](auto & ranges, auto const & from, auto & to, int32_t idx, int32_t n) -> int32_t {
+		if (!n) return to.size();
+		auto [iter, added] = ranges.try_emplace({ idx, n }, static_cast<int32_t>(to.size()));
+		if (added) to.insert(to.end(), from.begin() + idx, from.begin() + idx + n);
+		return iter->second;
+	};
+
+	std::vector<int32_t> remap (count);
+	std::vector<size_t> new_start (count + 1);
+	for (size_t s = 0; s < count; s++) {
+		new_start[s] = new_surfaces.size();
+		Surface const & surface = surfaces[s];
+		int32_t g = group_of[s];
+
+		if (g < 0 || groups[g].count == 1) {
+			Surface & out = new_surfaces.emplace_back(surface);
+			out.vert_idx = copy_range(vert_ranges, verts, new_verts, surface.vert_idx, surface.vert_count);
+			out.index_idx = copy_range(index_ranges, indices, new_indices, surface.index_idx, surface.index_count);
+			remap[s] = new_surfaces.size() - 1;
+			continue;
+		}
+
+		Group const & group = groups[g];
+		if (candidates[group.first] != s) continue; // already part of the merged surface
+
+		Surface & out = new_surfaces.emplace_back(surface);
+		out.vert_idx = new_verts.size();
+		out.index_idx = new_indices.size();
+		for (size_t i = group.first; i < group.first + group.count; i++) {
+			Surface const & member = surfaces[candidates[i]];
+			int32_t base = new_verts.size() - out.vert_idx;
+			new_verts.insert(new_verts.end(), verts.begin() + member.vert_idx, verts.begin() + member.vert_idx + member.vert_count);
+			for (int32_t j = 0; j < member.index_count; j++) new_indices.push_back(indices[member.index_idx + j] + base);
+			remap[candidates[i]] = new_surfaces.size() - 1;
+		}
+		out.vert_count = group.verts;
+		out.index_count = group.indices;
+		out.type = group.planar && group.verts <= opts.max_planar_verts ? SurfaceType::PLANAR : SurfaceType::TRISOUP;
+		report.groups++;
+	}
+	new_start[count] = new_surfaces.size();
+
+	for (Model & model : models) {
+		int32_t first = new_start[model.first_surface];
+		model.num_surfaces = new_start[model.first_surface + model.num_surfaces] - first;
+		model.first_surface = first;
+	}
+
+	// a leaf lists every original of a merged surface, so it only needs listing once
+	// leafs sharing a leafsurface range keep sharing it
+	BSPI::LeafSurfaceArray new_leaf_surfaces;
+	new_leaf_surfaces.reserve(leaf_surfaces.size());
+	std::map<std::pair<int32_t, int32_t>, std::pair<int32_t, int32_t>> leaf_ranges;
+	std::vector<int64_t> listed (count, -1);
+	for (size_t l = 0; l < leafs.size(); l++) {
+		Leaf & leaf = leafs[l];
+		auto [iter, added] = leaf_ranges.try_emplace({ leaf.first_surface, leaf.num_surfaces });
+		if (added) {
+			int32_t first = new_leaf_surfaces.size();
+			for (int32_t i = leaf.first_surface; i < leaf.first_surface + leaf.num_surfaces; i++) {
+				int32_t s = remap[leaf_surfaces[i]];
+				if (listed[s] == static_cast<int64_t>(l)) continue;
+				listed[s] = l;
+				new_leaf_surfaces.push_back(s);
+			}
+			iter->second = { first, static_cast<int32_t>(new_leaf_surfaces.size()) - first };
+		}
+		std::tie(leaf.first_surface, leaf.num_surfaces) = iter->second;
+		report.leaf_refs_after += leaf.num_surfaces;
+	}
+
+	// sides of a merged away surface point at the merged surface, those already referring to nothing are left alone as the game ignores them
+	for (BrushSide & side : brush_sides)
+		if (side.surface >= 0 && static_cast<size_t>(side.surface) < count) side.surface = remap[side.surface];
+
+	surfaces = std::move(new_surfaces);
+	verts = std::move(new_verts);
+	indices = std::move(new_indices);
+	leaf_surfaces = std::move(new_leaf_surfaces);
+	report.surfaces_after = surfaces.size();
+	return report;
+}
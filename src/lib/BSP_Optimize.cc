@@ -0,0 +1,293 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+using namespace BSP;
+
+// ================================
+// VERTEX CACHE
+
+size_t BSP::cache_misses(std::span<int32_t const> indices, size_t vertex_count, size_t cache_size) {
+	// a vertex is in the cache if fewer than cache_size misses happened since it was last loaded
+	std::vector<size_t> loaded (vertex_count, 0);
+	size_t misses = 0;
+	for (int32_t i : indices) {
+		if (i < 0 || static_cast<size_t>(i) >= vertex_count) throw std::out_of_range {"index out of range of the vertices"};
+		if (loaded[i] && misses - loaded[i] < cache_size) continue;
+		loaded[i] = ++misses;
+	}
+	return misses;
+}
+
+// scoring constants from Forsyth's "Linear-Speed Vertex Cache Optimisation"
+static constexpr float CACHE_DECAY_POWER = 1.5f;
+static constexpr float LAST_TRI_SCORE = 0.75f;
+static constexpr float VALENCE_BOOST_SCALE = 2.0f;
+static constexpr float VALENCE_BOOST_POWER = 0.5f;
+
+static inline float vertex_score(int32_t cache_pos, uint32_t remaining, size_t cache_size) {
+	if (!remaining) return -1; // no triangles left to draw, so this vertex no longer matters
+	float score = 0;
+	if (cache_pos >= 0) {
+		// the three vertices of the last triangle get a fixed score so the next triangle doesn't simply continue a strip
+		if (cache_pos < 3) score = LAST_TRI_SCORE;
+		else score = std::pow(1.0f - static_cast<float>(cache_pos - 3) / (cache_size - 3), CACHE_DECAY_POWER);
+	}
+	// favour vertices with few triangles left, so they get finished and stop taking up the cache
+	return score + VALENCE_BOOST_SCALE * std::pow(static_cast<float>(remaining), -VALENCE_BOOST_POWER);
+}
+
+void BSP::optimize_vertex_cache(std::span<int32_t> indices, size_t vertex_count, size_t cache_size) {
+	size_t tris = indices.size() / 3;
+	cache_size = std::max<size_t>(cache_size, 4);
+
+	for (int32_t i : indices)
+		if (i < 0 || static_cast<size_t>(i) >= vertex_count) throw std::out_of_range {"index out of range of the vertices"};
+	if (tris < 2) return;
+
+	// triangles using each vertex, the first remaining[v] of a vertex's range are the ones not drawn yet
+	std::vector<uint32_t> remaining (vertex_count, 0);
+	for (size_t i = 0; i < tris * 3; i++) remaining[indices[i]]++;
+	std::vector<uint32_t> offsets (vertex_count + 1, 0);
+	for (size_t v = 0; v < vertex_count; v++) offsets[v + 1] = offsets[v] + remaining[v];
+	std::vector<uint32_t> vertex_tris (tris * 3);
+	{
+		std::vector<uint32_t> fill { offsets.begin(), offsets.end() - 1 };
+		for (size_t i = 0; i < tris * 3; i++) vertex_tris[fill[indices[i]]++] = i / 3;
+	}
+
+	std::vector<int32_t> cache_pos (vertex_count, -1);
+	std::vector<float> vscore (vertex_count);
+	for (size_t v = 0; v < vertex_count; v++) vscore[v] = vertex_score(-1, remaining[v], cache_size);
+
+	std::vector<float> tscore (tris);
+	std::vector<bool> emitted (tris, false);
+	for (size_t t = 0; t < tris; t++) tscore[t] = vscore[indices[t * 3]] + vscore[indices[t * 3 + 1]] + vscore[indices[t * 3 + 2]];
+
+	std::vector<int32_t> out;
+	out.reserve(tris * 3);
+	std::vector<int32_t> cache, next_cache;
+	cache.reserve(cache_size + 3);
+	next_cache.reserve(cache_size + 3);
+
+	int64_t best = std::distance(tscore.begin(), std::max_element(tscore.begin(), tscore.end()));
+	size_t cursor = 0;
+
+	while (out.size() < tris * 3) {
+
+		// nothing in the cache has triangles left, start again from the next triangle not yet drawn
+		if (best < 0) {
+			while (emitted[cursor]) cursor++;
+			best = cursor;
+		}
+
+		size_t t = best;
+		emitted[t] = true;
+		int32_t const * tri = indices.data() + t * 3;
+		out.insert(out.end(), tri, tri + 3);
+
+		for (size_t c = 0; c < 3; c++) {
+			int32_t v = tri[c];
+			uint32_t * begin = vertex_tris.data() + offsets[v], * end = begin + remaining[v];
+			std::iter_swap(std::find(begin, end, t), end - 1);
+			remaining[v]--;
+		}
+
+		// the triangle's vertices move to the front of the cache, pushing the rest back
+		next_cache.assign(tri, tri + 3);
+		for (int32_t v : cache)
+			if (v != tri[0] && v != tri[1] && v != tri[2]) next_cache.push_back(v);
+
+		for (size_t i = 0; i < next_cache.size(); i++) {
+			int32_t v = next_cache[i];
+			cache_pos[v] = i < cache_size ? i : -1;
+			vscore[v] = vertex_score(cache_pos[v], remaining[v], cache_size);
+		}
+
+		// rescore every triangle touching the cache, the best of them is drawn next
+		best = -1;
+		float best_score = -1;
+		for (int32_t v : next_cache) {
+			for (uint32_t i = offsets[v]; i < offsets[v] + remaining[v]; i++) {
+				uint32_t ct = vertex_tris[i];
+				float score = vscore[indices[ct * 3]] + vscore[indices[ct * 3 + 1]] + vscore[indices[ct * 3 + 2]];
+				tscore[ct] = score;
+				if (score > best_score) {
+					best_score = score;
+					best = ct;
+				}
+			}
+		}
+
+		if (next_cache.size() > cache_size) next_cache.resize(cache_size);
+		std::swap(cache, next_cache);
+	}
+
+	std::copy(out.begin(), out.end(), indices.begin());
+}
+
+// ================================
+// OVERDRAW
+
+void BSP::optimize_overdraw(std::span<int32_t> indices, std::span<DrawVert const> verts, size_t cache_size) {
+	size_t tris = indices.size() / 3;
+	for (int32_t i : indices)
+		if (i < 0 || static_cast<size_t>(i) >= verts.size()) throw std::out_of_range {"index out of range of the vertices"};
+	if (tris < 2) return;
+
+	// split into runs wherever all three vertices of a triangle miss the cache, which is where the cache order starts over anyway
+	std::vector<size_t> runs;
+	{
+		std::vector<size_t> loaded (verts.size(), 0);
+		size_t misses = 0;
+		for (size_t t = 0; t < tris; t++) {
+			size_t tri_misses = 0;
+			for (size_t c = 0; c < 3; c++) {
+				int32_t v = indices[t * 3 + c];
+				if (loaded[v] && misses - loaded[v] < cache_size) continue;
+				loaded[v] = ++misses;
+				tri_misses++;
+			}
+			if (tri_misses == 3 || !t) runs.push_back(t);
+		}
+		runs.push_back(tris);
+	}
+	if (runs.size() <= 2) return;
+
+	// area weighted centroid and normal of every run
+	struct Run { size_t first, last; float centroid[3], normal[3]; float area; float key; };
+	std::vector<Run> info;
+	float mesh_centroid[3] {};
+	float mesh_area = 0;
+	for (size_t r = 0; r + 1 < runs.size(); r++) {
+		Run run { runs[r], runs[r + 1], {}, {}, 0, 0 };
+		for (size_t t = run.first; t < run.last; t++) {
+			float const * a = verts[indices[t * 3]].pos, * b = verts[indices[t * 3 + 1]].pos, * c = verts[indices[t * 3 + 2]].pos;
+			float u[3] { b[0] - a[0], b[1] - a[1], b[2] - a[2] }, w[3] { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+			float n[3] { u[1] * w[2] - u[2] * w[1], u[2] * w[0] - u[0] * w[2], u[0] * w[1] - u[1] * w[0] };
+			float area = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			for (size_t i = 0; i < 3; i++) {
+				run.normal[i] += n[i];
+				run.centroid[i] += (a[i] + b[i] + c[i]) / 3 * area;
+			}
+			run.area += area;
+		}
+		for (size_t i = 0; i < 3; i++) mesh_centroid[i] += run.centroid[i];
+		mesh_area += run.area;
+		if (run.area > 0) for (float & f : run.centroid) f /= run.area;
+		info.push_back(run);
+	}
+	if (mesh_area > 0) for (float & f : mesh_centroid) f /= mesh_area;
+
+	// runs further out along their own facing are more likely to occlude the rest, so they go first
+	for (Run & run : info) {
+		float len = std::sqrt(run.normal[0] * run.normal[0] + run.normal[1] * run.normal[1] + run.normal[2] * run.normal[2]);
+		if (len <= 0) continue;
+		for (size_t i = 0; i < 3; i++) run.key += (run.centroid[i] - mesh_centroid[i]) * run.normal[i] / len;
+	}
+	std::stable_sort(info.begin(), info.end(), [](Run const & a, Run const & b){ return a.key > b.key; });
+
+	std::vector<int32_t> out;
+	out.reserve(tris * 3);
+	for (Run const & run : info) out.insert(out.end(), indices.begin() + run.first * 3, indices.begin() + run.last * 3);
+	std::copy(out.begin(), out.end(), indices.begin());
+}
+
+// ================================
+
+IndexOptimizeReport BSP::optimize_indices(BSPI::SurfaceArray const & surfaces, BSPI::VertexArray const & verts, BSPI::IndexArray & indices, IndexOptimizeOptions const & opts) {
+
+	IndexOptimizeReport report;
+
+	// surfaces with triangles, in order of their index ranges so overlapping ones can be found
+	std::vector<uint32_t> order;
+	for (size_t s = 0; s < surfaces.size(); s++) {
+		Surface const & surface = surfaces[s];
+		if (surface.index_count < 3) continue;
+		if (surface.index_idx < 0 || static_cast<size_t>(surface.index_idx) + surface.index_count > indices.size())
+			throw std::out_of_range { "surface " + std::to_string(s) + " indices reach past the drawindexes" };
+		if (surface.vert_idx < 0 || surface.vert_count < 0 || static_cast<size_t>(surface.vert_idx) + surface.vert_count > verts.size())
+			throw std::out_of_range { "surface " + std::to_string(s) + " vertices reach past the drawverts" };
+		// checked here rather than by the workers, so a bad surface is named and nothing has been reordered yet
+		for (int32_t idx : std::span { indices.data() + surface.index_idx, static_cast<size_t>(surface.index_count) })
+			if (idx < 0 || idx >= surface.vert_count) throw std::out_of_range { "surface " + std::to_string(s) + " has an index outside of its vertices" };
+		order.push_back(s);
+	}
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b){ return surfaces[a].index_idx < surfaces[b].index_idx; });
+
+	// surfaces drawing exactly the same range are reordered together, which only depends on the indices
+	// reordering a range partially shared with another surface would break that surface, so those are left alone
+	struct Group { size_t first, count; int32_t vert_count; bool skip; };
+	std::vector<Group> groups;
+	int64_t reach = 0;  // furthest end of the ranges so far
+	size_t reach_group = 0;
+	for (size_t i = 0; i < order.size(); i++) {
+		Surface const & cur = surfaces[order[i]];
+		int64_t end = static_cast<int64_t>(cur.index_idx) + cur.index_count;
+		if (groups.size()) {
+			Group & prev = groups.back();
+			Surface const & ps = surfaces[order[prev.first]];
+			if (cur.index_idx == ps.index_idx && cur.index_count == ps.index_count) {
+				prev.count++;
+				prev.vert_count = std::min(prev.vert_count, cur.vert_count);
+				continue;
+			}
+			if (cur.index_idx < reach) {
+				groups[reach_group].skip = true;
+				groups.push_back({ i, 1, cur.vert_count, true });
+				if (end > reach) reach = end, reach_group = groups.size() - 1;
+				continue;
+			}
+		}
+		groups.push_back({ i, 1, cur.vert_count, false });
+		if (end > reach) reach = end, reach_group = groups.size() - 1;
+	}
+
+	std::vector<Group> work;
+	for (Group const & group : groups) {
+		if (group.skip) report.skipped += group.count;
+		else work.push_back(group);
+	}
+
+	// surfaces are small, so hand them to threads in batches
+	static constexpr size_t BATCH = 64;
+	size_t batches = (work.size() + BATCH - 1) / BATCH;
+	std::vector<IndexOptimizeReport> partial (batches);
+	parallel_for(batches, opts.threads, [&](size_t b){
+		IndexOptimizeReport & r = partial[b];
+		std::vector<int32_t> original;
+		for (size_t i = b * BATCH; i < std::min((b + 1) * BATCH, work.size()); i++) {
+			Group const & group = work[i];
+			Surface const & surface = surfaces[order[group.first]];
+			std::span<int32_t> range { indices.data() + surface.index_idx, static_cast<size_t>(surface.index_count - surface.index_count % 3) };
+			std::span<DrawVert const> surface_verts { verts.data() + surface.vert_idx, static_cast<size_t>(group.vert_count) };
+
+			// compilers often emit grids in an order that already suits the cache, keep it if the reordering doesn't beat it
+			size_t before = cache_misses(range, surface_verts.size(), opts.report_cache);
+			original.assign(range.begin(), range.end());
+			optimize_vertex_cache(range, surface_verts.size(), opts.cache_size);
+			if (opts.overdraw) optimize_overdraw(range, surface_verts, opts.report_cache);
+			size_t after = cache_misses(range, surface_verts.size(), opts.report_cache);
+			if (after > before) {
+				std::copy(original.begin(), original.end(), range.begin());
+				after = before;
+			}
+			r.misses_before += before * group.count;
+			r.misses_after += after * group.count;
+			r.triangles += range.size() / 3 * group.count;
+			r.surfaces += group.count;
+		}
+	});
+
+	for (IndexOptimizeReport const & r : partial) {
+		report.surfaces += r.surfaces;
+		report.triangles += r.triangles;
+		report.misses_before += r.misses_before;
+		report.misses_after += r.misses_after;
+	}
+	return report;
+}
@@ -0,0 +1,314 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace BSP;
+
+// ================================
+// ATTRIBUTES
+
+// every attribute of a drawvert as floats, so a vertex can be blended from control points as one vector
+// position, shader UV, lightmap UVs, and normal come first, then the vertex colors
+static constexpr size_t ATTR_FLOATS = 3 + 2 + LIGHTSTYLES * 2 + 3;
+static constexpr size_t ATTR_COLORS = LIGHTSTYLES * 4;
+static constexpr size_t ATTR_SIZE = ATTR_FLOATS + ATTR_COLORS;
+static_assert(ATTR_SIZE == 32);
+
+struct alignas(32) Attr {
+	float v[ATTR_SIZE];
+};
+
+static inline void to_attr(DrawVert const & dv, Attr & a) {
+	float * o = a.v;
+	for (float f : dv.pos) *o++ = f;
+	for (float f : dv.uv) *o++ = f;
+	for (auto const & lm : dv.lightmap) for (float f : lm) *o++ = f;
+	for (float f : dv.normal) *o++ = f;
+	for (auto const & c : dv.color) for (uint8_t b : c) *o++ = b;
+}
+
+static inline void from_attr(Attr const & a, DrawVert & dv) {
+	float const * i = a.v;
+	for (float & f : dv.pos) f = *i++;
+	for (float & f : dv.uv) f = *i++;
+	for (auto & lm : dv.lightmap) for (float & f : lm) f = *i++;
+	for (float & f : dv.normal) f = *i++;
+	for (auto & c : dv.color) for (uint8_t & b : c) b = static_cast<uint8_t>(std::clamp(*i++ + 0.5f, 0.0f, 255.0f));
+
+	float len = std::sqrt(dv.normal[0] * dv.normal[0] + dv.normal[1] * dv.normal[1] + dv.normal[2] * dv.normal[2]);
+	if (len > 0) for (float & f : dv.normal) f /= len;
+}
+
+// out = a * wa + b * wb + c * wc
+static inline void blend(Attr & out, Attr const & a, Attr const & b, Attr const & c, float wa, float wb, float wc) {
+	#if defined(__AVX2__)
+	__m256 va = _mm256_set1_ps(wa), vb = _mm256_set1_ps(wb), vc = _mm256_set1_ps(wc);
+	for (size_t i = 0; i < ATTR_SIZE; i += 8) {
+		__m256 r = _mm256_mul_ps(_mm256_load_ps(a.v + i), va);
+		r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_load_ps(b.v + i), vb));
+		r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_load_ps(c.v + i), vc));
+		_mm256_store_ps(out.v + i, r);
+	}
+	#elif defined(__SSE2__)
+	__m128 va = _mm_set1_ps(wa), vb = _mm_set1_ps(wb), vc = _mm_set1_ps(wc);
+	for (size_t i = 0; i < ATTR_SIZE; i += 4) {
+		__m128 r = _mm_mul_ps(_mm_load_ps(a.v + i), va);
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(b.v + i), vb));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(c.v + i), vc));
+		_mm_store_ps(out.v + i, r);
+	}
+	#else
+	for (size_t i = 0; i < ATTR_SIZE; i++) out.v[i] = a.v[i] * wa + b.v[i] * wb + c.v[i] * wc;
+	#endif
+}
+
+// blend of the position alone, padded to a vector, with the same operations as blend so both give the same position to the bit
+struct alignas(16) Pos {
+	float v[4];
+};
+
+static inline void blend(Pos & out, Pos const & a, Pos const & b, Pos const & c, float wa, float wb, float wc) {
+	#if defined(__SSE2__)
+	__m128 r = _mm_mul_ps(_mm_load_ps(a.v), _mm_set1_ps(wa));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(b.v), _mm_set1_ps(wb)));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(c.v), _mm_set1_ps(wc)));
+	_mm_store_ps(out.v, r);
+	#else
+	for (size_t i = 0; i < 4; i++) out.v[i] = a.v[i] * wa + b.v[i] * wb + c.v[i] * wc;
+	#endif
+}
+
+// ================================
+// LAYOUT
+
+namespace {
+
+	// where each tessellated column or row falls on the control grid
+	struct Sample {
+		uint32_t first; // first of the three control columns or rows of its span
+		float w[3];     // quadratic Bezier weights
+	};
+
+	struct Layout {
+		uint32_t cp_width, cp_height;
+		DrawVert const * cp;
+		std::vector<Sample> cols, rows;
+	};
+
+}
+
+static inline float second_difference(float const * p0, float const * p1, float const * p2) {
+	// |p0 - 2 p1 + p2|, half the magnitude of the curve's constant second derivative, in units
+	// the curve strays at most a quarter of this from its chord, and at most a quarter over n squared from n equal segments
+	float d[3];
+	for (size_t a = 0; a < 3; a++) d[a] = p0[a] - 2 * p1[a] + p2[a];
+	return std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+}
+
+// segments a span must be divided into so worst / (4 * segments^2) is within max_error, worst being the greatest second_difference across it
+static inline int32_t span_level(float worst, PatchOptions const & opts) {
+	if (opts.level > 0) return opts.level;
+	if (worst <= 0 || opts.max_error <= 0) return worst > 0 ? std::max(opts.max_level, 1) : 1;
+	int32_t level = static_cast<int32_t>(std::ceil(std::sqrt(worst / (4 * opts.max_error))));
+	return std::clamp(level, 1, std::max(opts.max_level, 1));
+}
+
+static void add_samples(std::vector<Sample> & out, uint32_t span, int32_t level, bool last) {
+	for (int32_t i = 0; i < level + last; i++) {
+		float t = static_cast<float>(i) / level, s = 1 - t;
+		out.push_back({ span * 2, { s * s, 2 * s * t, t * t } });
+	}
+}
+
+static Layout make_layout(int32_t surface_idx, Surface const & surface, std::span<DrawVert const> drawverts, PatchOptions const & opts) {
+
+	auto fail = [&](char const * what) {
+		return std::out_of_range { "patch surface " + std::to_string(surface_idx) + " " + what };
+	};
+
+	if (surface.patch_width < 3 || surface.patch_height < 3 || !(surface.patch_width & 1) || !(surface.patch_height & 1))
+		throw fail("has an invalid control grid size");
+	if (surface.vert_idx < 0 || static_cast<size_t>(surface.vert_idx) + static_cast<size_t>(surface.patch_width) * surface.patch_height > drawverts.size())
+		throw fail("control points reach past the drawverts");
+
+	Layout ret;
+	ret.cp_width = surface.patch_width;
+	ret.cp_height = surface.patch_height;
+	ret.cp = drawverts.data() + surface.vert_idx;
+
+	auto pos = [&](uint32_t col, uint32_t row){ return ret.cp[row * ret.cp_width + col].pos; };
+
+	// one level per span and direction, taken as the worst curve crossing it, so the grid stays conforming across the patch
+	uint32_t spans_u = (ret.cp_width - 1) / 2, spans_v = (ret.cp_height - 1) / 2;
+	for (uint32_t s = 0; s < spans_u; s++) {
+		float worst = 0;
+		for (uint32_t r = 0; r < ret.cp_height; r++) worst = std::max(worst, second_difference(pos(s * 2, r), pos(s * 2 + 1, r), pos(s * 2 + 2, r)));
+		add_samples(ret.cols, s, span_level(worst, opts), s == spans_u - 1);
+	}
+	for (uint32_t s = 0; s < spans_v; s++) {
+		float worst = 0;
+		for (uint32_t c = 0; c < ret.cp_width; c++) worst = std::max(worst, second_difference(pos(c, s * 2), pos(c, s * 2 + 1), pos(c, s * 2 + 2)));
+		add_samples(ret.rows, s, span_level(worst, opts), s == spans_v - 1);
+	}
+
+	return ret;
+}
+
+static inline size_t index_count(Layout const & l) {
+	return (l.cols.size() - 1) * (l.rows.size() - 1) * 6;
+}
+
+// ================================
+// TESSELLATION
+
+// the same two passes as emit, over the positions alone
+static void bounds(Layout const & l, vec3_t & mins, vec3_t & maxs) {
+
+	uint32_t width = l.cols.size(), height = l.rows.size();
+
+	std::vector<Pos> across (l.cp_height * width);
+	for (uint32_t r = 0; r < l.cp_height; r++) {
+		DrawVert const * row = l.cp + r * l.cp_width;
+		for (uint32_t c = 0; c < width; c++) {
+			Sample const & s = l.cols[c];
+			Pos a { row[s.first].pos[0], row[s.first].pos[1], row[s.first].pos[2], 0 };
+			Pos b { row[s.first + 1].pos[0], row[s.first + 1].pos[1], row[s.first + 1].pos[2], 0 };
+			Pos d { row[s.first + 2].pos[0], row[s.first + 2].pos[1], row[s.first + 2].pos[2], 0 };
+			blend(across[r * width + c], a, b, d, s.w[0], s.w[1], s.w[2]);
+		}
+	}
+
+	mins.fill(std::numeric_limits<float>::max());
+	maxs.fill(std::numeric_limits<float>::lowest());
+	Pos v;
+	for (uint32_t r = 0; r < height; r++) {
+		Sample const & s = l.rows[r];
+		Pos const * a = across.data() + s.first * width;
+		for (uint32_t c = 0; c < width; c++) {
+			blend(v, a[c], a[width + c], a[width * 2 + c], s.w[0], s.w[1], s.w[2]);
+			for (size_t i = 0; i < 3; i++) {
+				mins[i] = std::min(mins[i], v.v[i]);
+				maxs[i] = std::max(maxs[i], v.v[i]);
+			}
+		}
+	}
+}
+
+static void emit(Layout const & l, DrawVert * verts, int32_t * indices) {
+
+	uint32_t width = l.cols.size(), height = l.rows.size();
+
+	// control points as attribute vectors
+	std::vector<Attr> cp (l.cp_width * l.cp_height);
+	for (size_t i = 0; i < cp.size(); i++) to_attr(l.cp[i], cp[i]);
+
+	// blend along the columns first, giving every control row evaluated at every tessellated column
+	std::vector<Attr> across (l.cp_height * width);
+	for (uint32_t r = 0; r < l.cp_height; r++) {
+		Attr const * row = cp.data() + r * l.cp_width;
+		for (uint32_t c = 0; c < width; c++) {
+			Sample const & s = l.cols[c];
+			blend(across[r * width + c], row[s.first], row[s.first + 1], row[s.first + 2], s.w[0], s.w[1], s.w[2]);
+		}
+	}
+
+	// then down the rows
+	Attr v;
+	for (uint32_t r = 0; r < height; r++) {
+		Sample const & s = l.rows[r];
+		Attr const * a = across.data() + s.first * width;
+		for (uint32_t c = 0; c < width; c++) {
+			blend(v, a[c], a[width + c], a[width * 2 + c], s.w[0], s.w[1], s.w[2]);
+			from_attr(v, verts[r * width + c]);
+		}
+	}
+
+	// two triangles per quad, wound the same way as the game's grid surfaces
+	for (uint32_t r = 0; r + 1 < height; r++) {
+		for (uint32_t c = 0; c + 1 < width; c++) {
+			int32_t v2 = r * width + c, v1 = v2 + 1, v3 = v2 + width, v4 = v3 + 1;
+			*indices++ = v2;
+			*indices++ = v3;
+			*indices++ = v1;
+			*indices++ = v1;
+			*indices++ = v3;
+			*indices++ = v4;
+		}
+	}
+}
+
+PatchExtent BSP::measure_patch(int32_t surface_idx, Surface const & surface, std::span<DrawVert const> drawverts, PatchOptions const & opts, bool with_bounds) {
+	Layout l = make_layout(surface_idx, surface, drawverts, opts);
+
+	PatchExtent ret;
+	ret.width = l.cols.size();
+	ret.height = l.rows.size();
+	if (with_bounds) bounds(l, ret.mins, ret.maxs);
+	return ret;
+}
+
+void BSP::tessellate_patch(int32_t surface_idx, Surface const & surface, std::span<DrawVert const> drawverts, PatchMesh & out, PatchOptions const & opts) {
+	Layout l = make_layout(surface_idx, surface, drawverts, opts);
+
+	PatchMesh::Patch & patch = out.patches.emplace_back();
+	patch.surface = surface_idx;
+	patch.first_vert = out.verts.size();
+	patch.num_verts = l.cols.size() * l.rows.size();
+	patch.first_index = out.indices.size();
+	patch.num_indices = index_count(l);
+	patch.width = l.cols.size();
+	patch.height = l.rows.size();
+
+	out.verts.resize(out.verts.size() + patch.num_verts);
+	out.indices.resize(out.indices.size() + patch.num_indices);
+	emit(l, out.verts.data() + patch.first_vert, out.indices.data() + patch.first_index);
+}
+
+PatchMesh BSP::tessellate_patches(Reader const & bspr, PatchOptions const & opts, size_t threads) {
+
+	auto surfaces = bspr.surfaces();
+	auto drawverts = bspr.drawverts();
+
+	PatchMesh ret;
+	for (size_t i = 0; i < surfaces.size(); i++)
+		if (surfaces[i].type == SurfaceType::PATCH) ret.patches.emplace_back().surface = i;
+
+	// size every patch first, so each can then be written straight into its place without any thread touching another's memory
+	std::vector<Layout> layouts (ret.patches.size());
+	parallel_for(layouts.size(), threads, [&](size_t p){
+		int32_t s = ret.patches[p].surface;
+		layouts[p] = make_layout(s, surfaces[s], drawverts, opts);
+	});
+
+	size_t num_verts = 0, num_indices = 0;
+	for (size_t p = 0; p < layouts.size(); p++) {
+		PatchMesh::Patch & patch = ret.patches[p];
+		patch.first_vert = num_verts;
+		patch.num_verts = layouts[p].cols.size() * layouts[p].rows.size();
+		patch.first_index = num_indices;
+		patch.num_indices = index_count(layouts[p]);
+		patch.width = layouts[p].cols.size();
+		patch.height = layouts[p].rows.size();
+		num_verts += patch.num_verts;
+		num_indices += patch.num_indices;
+	}
+
+	ret.verts.resize(num_verts);
+	ret.indices.resize(num_indices);
+	parallel_for(layouts.size(), threads, [&](size_t p){
+		PatchMesh::Patch const & patch = ret.patches[p];
+		emit(layouts[p], ret.verts.data() + patch.first_vert, ret.indices.data() + patch.first_index);
+	});
+
+	return ret;
+}
@@ -2,15 +2,47 @@
 
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace BSP;
 
-static inline bool is_end(char const * & cur, std::string_view const & str) {
-	if (!*cur) return true;
-	if (cur == str.end()) return true;
-	return false;
+void Reader::rebase(uint8_t const * base, size_t size) {
+	if (!base) throw ReadException { "null base" };
+	if (size < sizeof(Header)) throw ReadException { "file too small to be a BSP file" };
+	
+	Header const * header = reinterpret_cast<Header const *> (base);
+	if (header->ident != IDENT) throw ReadException { "file does not appear to be a BSP file" };
+	
+	for (size_t l = 0; l < header->lumps.size(); l++) {
+		Lump const & lump = header->lumps[l];
+		if (lump.offs < 0 || lump.size < 0)
+			throw ReadException { "lump " + std::to_string(l) + " has a negative offset or size" };
+		if (static_cast<size_t>(lump.offs) + static_cast<size_t>(lump.size) > size)
+			throw ReadException { "lump " + std::to_string(l) + " extends past the end of the file" };
+	}
+	
+	if (header->lumps[static_cast<size_t>(LumpIndex::VISIBILITY)].size) {
+		Lump const & lump = header->lumps[static_cast<size_t>(LumpIndex::VISIBILITY)];
+		if (static_cast<size_t>(lump.size) < sizeof(VisibilityHeader))
+			throw ReadException { "visibility lump too small to contain its header" };
+	}
+	
+	m_base = header;
+	m_size = size;
 }
 
+// ================================
+// ENTITIES
+
+// the entity lump is scanned with SIMD where the target allows it: SSE2 is part of the core2 baseline, AVX2 is used when building with -march=native on hardware that has it
+// the scalar scanners are kept as the fallback for the tail of the lump and as the reference implementation for parse_entities_scalar
+
 static inline bool char_is_whitespace(char c) {
 	switch (c) {
 		case ' ':
@@ -21,53 +53,175 @@ static inline bool char_is_whitespace(char c) {
 	}
 }
 
-static bool skip_whitespace(char const * & cur, std::string_view const & str) {
-	while (!is_end(cur, str) && char_is_whitespace(*cur)) cur++;
-	return !is_end(cur, str);
-}
-
-template <typename T = meadow::istring_view>
-static T parse_string(char const * & cur, std::string_view const & str) {
-	if (!skip_whitespace(cur, str) || *cur != '\"') throw Reader::ReadException { "expected '\"'" };
-	cur++;
-	char const * start = cur;
-	while (!is_end(cur, str)) {
-		switch(*cur) {
-			default: 
-				cur++;
-				break;
-			case '\"':
-				return T { start, static_cast<size_t>(cur++ - start) }; // FIXME -- better string_view constructor in C++20
+// returns the first character at or after cur that is not whitespace, or end
+template <bool VEC>
+static inline char const * scan_whitespace(char const * cur, char const * end) {
+	// most runs of whitespace are a single newline or space, so check the first character before setting up any vectors
+	if (cur == end || !char_is_whitespace(*cur)) return cur;
+	if constexpr (VEC) {
+		#if defined(__AVX2__)
+		__m256i const sp32 = _mm256_set1_epi8(' '), nl32 = _mm256_set1_epi8('\n'), cr32 = _mm256_set1_epi8('\r');
+		for (; end - cur >= 32; cur += 32) {
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(cur));
+			__m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, sp32), _mm256_or_si256(_mm256_cmpeq_epi8(v, nl32), _mm256_cmpeq_epi8(v, cr32)));
+			uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(ws));
+			if (mask) return cur + __builtin_ctz(mask);
 		}
+		#endif
+		#if defined(__SSE2__)
+		__m128i const sp = _mm_set1_epi8(' '), nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+		for (; end - cur >= 16; cur += 16) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(cur));
+			__m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+			uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(ws)) & 0xFFFF;
+			if (mask) return cur + __builtin_ctz(mask);
+		}
+		#endif
 	}
-	throw Reader::ReadException { "unexpected end of string" };
+	while (cur != end && char_is_whitespace(*cur)) cur++;
+	return cur;
 }
 
-static Reader::Entity parse_entity(char const * & cur, std::string_view const & str) {
-	if (!skip_whitespace(cur, str) || *cur != '{') throw Reader::ReadException { "expected '{'" };
-	cur++;
-	Reader::Entity ent;
-	while (skip_whitespace(cur, str) && *cur != '}') {
-		// seem to have to separate these out or else they execute in the wrong order????????????
-		meadow::istring_view key = parse_string<meadow::istring_view>(cur, str);
-		ent[key] = parse_string(cur, str);
+// returns the first '"' or NUL at or after cur, or end
+template <bool VEC>
+static inline char const * scan_quote(char const * cur, char const * end) {
+	if constexpr (VEC) {
+		#if defined(__AVX2__)
+		__m256i const qt32 = _mm256_set1_epi8('\"'), nul32 = _mm256_setzero_si256();
+		for (; end - cur >= 32; cur += 32) {
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(cur));
+			uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, qt32), _mm256_cmpeq_epi8(v, nul32)));
+			if (mask) return cur + __builtin_ctz(mask);
+		}
+		#endif
+		#if defined(__SSE2__)
+		__m128i const qt = _mm_set1_epi8('\"'), nul = _mm_setzero_si128();
+		for (; end - cur >= 16; cur += 16) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(cur));
+			uint32_t mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, qt), _mm_cmpeq_epi8(v, nul)));
+			if (mask) return cur + __builtin_ctz(mask);
+		}
+		#endif
 	}
-	cur++;
-	return ent;
+	while (cur != end && *cur != '\"' && *cur) cur++;
+	return cur;
 }
 
-Reader::EntityArray Reader::parse_entities(std::string_view const & ent_str) {
+template <bool VEC>
+struct EntityParser {
+	
+	char const * cur;
+	char const * const end;
+	Reader::EntityArray table {};
 	
-	EntityArray ret;
+	// the lump is NUL terminated, but also treat an embedded NUL as the end
+	inline bool is_end() const {
+		return cur == end || !*cur;
+	}
 	
-	char const * cur = ent_str.begin();
-	while (skip_whitespace(cur, ent_str)) {
-		ret.emplace_back(parse_entity(cur, ent_str));
+	inline bool skip_whitespace() {
+		cur = scan_whitespace<VEC>(cur, end);
+		return !is_end();
+	}
+	
+	inline meadow::istring_view parse_string() {
+		if (!skip_whitespace() || *cur != '\"') throw Reader::ReadException { "expected '\"'" };
+		char const * start = ++cur;
+		cur = scan_quote<VEC>(cur, end);
+		if (is_end()) throw Reader::ReadException { "unexpected end of string" };
+		return meadow::istring_view { start, static_cast<size_t>(cur++ - start) };
+	}
+	
+	inline void parse_entity() {
+		if (!skip_whitespace() || *cur != '{') throw Reader::ReadException { "expected '{'" };
+		cur++;
+		table.add_entity();
+		while (skip_whitespace() && *cur != '}') {
+			meadow::istring_view key = parse_string();
+			table.append(key, parse_string());
+		}
+		if (is_end()) throw Reader::ReadException { "expected '}'" };
+		cur++;
 	}
 	
-	return ret;
+	inline Reader::EntityArray parse_entities() {
+		// rough guesses from typical entity lumps, they only need to be close enough to avoid most regrowth
+		table.reserve((end - cur) / 128, (end - cur) / 32);
+		while (skip_whitespace()) parse_entity();
+		return std::move(table);
+	}
+};
+
+Reader::EntityArray Reader::parse_entities(std::string_view const & ent_str) {
+	return EntityParser<true> { ent_str.data(), ent_str.data() + ent_str.size() }.parse_entities();
+}
+
+Reader::EntityArray Reader::parse_entities_scalar(std::string_view const & ent_str) {
+	return EntityParser<false> { ent_str.data(), ent_str.data() + ent_str.size() }.parse_entities();
 }
 
 Reader::EntityArray Reader::entities_parsed() const {
 	return parse_entities(entities());
 }
+
+// ================================
+// LIGHTMAPS
+
+bool Reader::deluxe_mapped() const {
+	EntityArray ents = entities_parsed();
+	if (ents.empty()) return false;
+	auto value = ents[0].get("deluxeMapping");
+	return value && *value == "1";
+}
+
+// ================================
+// LEAFS
+
+// returns the child of the node on the side of the plane the point lies on
+static inline int32_t node_child(Node const & node, Plane const & plane, vec3_t const & point) {
+	float d = plane.normal[0] * point[0] + plane.normal[1] * point[1] + plane.normal[2] * point[2] - plane.dist;
+	return node.children[d < 0];
+}
+
+int32_t Reader::point_leaf(vec3_t const & point) const {
+	NodeArray nodes = this->nodes();
+	PlaneArray planes = this->planes();
+	if (nodes.empty()) return 0;
+	
+	int32_t idx = 0;
+	while (idx >= 0) {
+		Node const & node = nodes[idx];
+		idx = node_child(node, planes[node.plane], point);
+	}
+	return -idx - 1;
+}
+
+void Reader::point_leafs(std::span<vec3_t const> points, std::span<int32_t> out) const {
+	if (out.size() < points.size()) throw std::logic_error {"output span smaller than input span"};
+	
+	NodeArray nodes = this->nodes();
+	PlaneArray planes = this->planes();
+	if (nodes.empty()) {
+		std::fill(out.begin(), out.begin() + points.size(), 0);
+		return;
+	}
+	
+	// descend several points in lock-step so their node and plane fetches overlap instead of serializing on cache misses
+	static constexpr size_t LANES = 8;
+	size_t i = 0;
+	for (; i + LANES <= points.size(); i += LANES) {
+		int32_t idx[LANES] = {};
+		bool active = true;
+		while (active) {
+			active = false;
+			for (size_t l = 0; l < LANES; l++) {
+				if (idx[l] < 0) continue;
+				Node const & node = nodes[idx[l]];
+				idx[l] = node_child(node, planes[node.plane], points[i + l]);
+				active |= idx[l] >= 0;
+			}
+		}
+		for (size_t l = 0; l < LANES; l++) out[i + l] = -idx[l] - 1;
+	}
+	for (; i < points.size(); i++) out[i] = point_leaf(points[i]);
+}
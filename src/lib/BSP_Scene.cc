@@ -0,0 +1,133 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+
+using namespace BSP;
+
+// ================================
+// FRUSTUM
+
+static inline float dot(vec3_t const & a, vec3_t const & b) {
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static inline vec3_t normalize(vec3_t v) {
+	float len = std::sqrt(dot(v, v));
+	if (len > 0) for (float & f : v) f /= len;
+	return v;
+}
+
+Frustum Frustum::from_view(vec3_t const & origin, vec3_t const & forward, vec3_t const & up, float fov_x, float fov_y, float far) {
+
+	vec3_t f = normalize(forward);
+	float fu = dot(up, f);
+	vec3_t u = normalize({ up[0] - f[0] * fu, up[1] - f[1] * fu, up[2] - f[2] * fu });
+	vec3_t l { u[1] * f[2] - u[2] * f[1], u[2] * f[0] - u[0] * f[2], u[0] * f[1] - u[1] * f[0] }; // up x forward
+
+	Frustum ret;
+	auto add = [&](vec3_t const & n){
+		ret.planes[ret.num_planes++] = { n, dot(n, origin) };
+	};
+	auto side = [&](vec3_t const & axis, float half_fov, float sign){
+		float s = std::sin(half_fov), c = std::cos(half_fov);
+		add({ f[0] * s + sign * axis[0] * c, f[1] * s + sign * axis[1] * c, f[2] * s + sign * axis[2] * c });
+	};
+
+	float half_x = fov_x * 0.5f * std::numbers::pi_v<float> / 180.0f;
+	float half_y = fov_y * 0.5f * std::numbers::pi_v<float> / 180.0f;
+	side(l, half_x, -1); // left
+	side(l, half_x, 1);  // right
+	side(u, half_y, -1); // top
+	side(u, half_y, 1);  // bottom
+	add(f);              // near, through the origin
+
+	if (far > 0) {
+		vec3_t n { -f[0], -f[1], -f[2] };
+		ret.planes[ret.num_planes++] = { n, dot(n, origin) - far };
+	}
+
+	return ret;
+}
+
+// ================================
+// SCENE
+
+Scene::Scene(Reader const & bspr) : m_bspr(bspr), m_vis(bspr), m_num_surfaces(bspr.surfaces().size()) {
+
+	auto leafs = bspr.leafs();
+	size_t num_leafsurfaces = bspr.leafsurfaces().size();
+
+	auto bounds = [&](Leaf const & leaf){
+		LeafBounds ret;
+		for (size_t a = 0; a < 3; a++) {
+			ret.mins[a] = leaf.mins[a];
+			ret.maxs[a] = leaf.maxs[a];
+		}
+		int64_t first = std::clamp<int64_t>(leaf.first_surface, 0, num_leafsurfaces);
+		int64_t last = std::clamp<int64_t>(static_cast<int64_t>(leaf.first_surface) + leaf.num_surfaces, first, num_leafsurfaces);
+		ret.first_surface = first;
+		ret.num_surfaces = last - first;
+		return ret;
+	};
+
+	// counting sort of the leafs by cluster, leafs outside of every cluster are left out
+	size_t clusters = m_vis.clusters();
+	m_cluster_offsets.assign(clusters + 1, 0);
+	for (Leaf const & leaf : leafs)
+		if (leaf.cluster >= 0 && static_cast<size_t>(leaf.cluster) < clusters) m_cluster_offsets[leaf.cluster + 1]++;
+	for (size_t c = 0; c < clusters; c++) m_cluster_offsets[c + 1] += m_cluster_offsets[c];
+
+	m_leafs.resize(m_cluster_offsets.back());
+	std::vector<uint32_t> fill { m_cluster_offsets.begin(), m_cluster_offsets.end() - 1 };
+	for (Leaf const & leaf : leafs)
+		if (leaf.cluster >= 0 && static_cast<size_t>(leaf.cluster) < clusters) m_leafs[fill[leaf.cluster]++] = bounds(leaf);
+}
+
+void Scene::add_leaf(LeafBounds const & leaf, Frustum const & frustum, Query & query) const {
+	if (!leaf.num_surfaces || !frustum.intersects(leaf.mins, leaf.maxs)) return;
+
+	auto leafsurfaces = m_bspr.leafsurfaces().subspan(leaf.first_surface, leaf.num_surfaces);
+	for (int32_t surface : leafsurfaces) {
+		if (surface < 0 || static_cast<size_t>(surface) >= m_num_surfaces) continue;
+		uint32_t & mark = query.marks[surface];
+		if (mark == query.generation) continue;
+		mark = query.generation;
+		query.surfaces.push_back(surface);
+	}
+}
+
+std::span<int32_t const> Scene::visible_surfaces(vec3_t const & origin, Frustum const & frustum, Query & query) const {
+
+	query.surfaces.clear();
+	if (query.marks.size() != m_num_surfaces) {
+		query.marks.assign(m_num_surfaces, 0);
+		query.generation = 0;
+	}
+	// generation 0 is what the marks start as, so skip it when wrapping around
+	if (++query.generation == 0) {
+		std::fill(query.marks.begin(), query.marks.end(), 0);
+		query.generation = 1;
+	}
+
+	int32_t leaf = m_bspr.point_leaf(origin);
+	auto leafs = m_bspr.leafs();
+	int32_t cluster = leaf >= 0 && static_cast<size_t>(leaf) < leafs.size() ? leafs[leaf].cluster : -1;
+
+	if (cluster < 0 || static_cast<size_t>(cluster) >= m_vis.clusters()) {
+		for (LeafBounds const & l : m_leafs) add_leaf(l, frustum, query);
+		return query.surfaces;
+	}
+
+	m_vis.pvs(cluster).for_each([&](int32_t c){
+		for (uint32_t i = m_cluster_offsets[c]; i < m_cluster_offsets[c + 1]; i++) add_leaf(m_leafs[i], frustum, query);
+	});
+	return query.surfaces;
+}
+
+std::vector<int32_t> Scene::visible_surfaces(vec3_t const & origin, Frustum const & frustum) const {
+	Query query;
+	visible_surfaces(origin, frustum, query);
+	return std::move(query.surfaces);
+}
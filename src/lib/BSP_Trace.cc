@@ -0,0 +1,352 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <stdexcept>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace BSP;
+
+// ================================
+
+// same as the game, sweeps stop this far in front of the planes they hit so the end position is never inside a brush
+static constexpr float SURFACE_CLIP_EPSILON = 0.125f;
+
+// brush sides are tested this many at a time, and each brush's sides are padded up to a multiple of it
+#if defined(__AVX2__)
+static constexpr uint32_t SIDE_LANES = 8;
+#elif defined(__SSE2__)
+static constexpr uint32_t SIDE_LANES = 4;
+#else
+static constexpr uint32_t SIDE_LANES = 1;
+#endif
+
+// distance of the padding sides, far enough that every point is behind them
+static constexpr float PAD_DIST = 1e30f;
+
+// a brush is usually touched by several leafs, remember this many per trace to avoid clipping against it again
+static constexpr size_t CHECKED_BRUSHES = 32;
+
+struct Tracer::Work {
+	vec3_t start, end;   // sweep of the box's centre
+	vec3_t extents;      // half the size of the box, zero for lines
+	vec3_t centre;       // offset from the traced points to the box's centre
+	int32_t mask;
+	TraceResult result;
+	std::array<int32_t, CHECKED_BRUSHES> checked;
+	size_t num_checked = 0;
+};
+
+Tracer::Tracer(Reader const & bspr) : m_bspr(bspr) {
+
+	auto shaders = bspr.shaders();
+	auto planes = bspr.planes();
+	auto brushes = bspr.brushes();
+	auto brushsides = bspr.brushsides();
+
+	size_t total = 0;
+	for (Brush const & brush : brushes) total += (std::max(brush.num_sides, 0) + SIDE_LANES - 1) / SIDE_LANES * SIDE_LANES;
+
+	m_brushes.reserve(brushes.size());
+	m_side_x.reserve(total);
+	m_side_y.reserve(total);
+	m_side_z.reserve(total);
+	m_side_dist.reserve(total);
+	m_side_plane.reserve(total);
+	m_side_surface_flags.reserve(total);
+
+	for (Brush const & brush : brushes) {
+		if (brush.num_sides < 0 || brush.first_side < 0 || static_cast<size_t>(brush.first_side) + brush.num_sides > brushsides.size())
+			throw std::out_of_range {"brush sides out of range"};
+
+		BrushEntry & entry = m_brushes.emplace_back();
+		entry.first_side = m_side_x.size();
+		entry.contents = brush.shader >= 0 && static_cast<size_t>(brush.shader) < shaders.size() ? shaders[brush.shader].content_flags : 0;
+
+		for (BrushSide const & side : brushsides.subspan(brush.first_side, brush.num_sides)) {
+			if (side.plane < 0 || static_cast<size_t>(side.plane) >= planes.size())
+				throw std::out_of_range {"brush side plane out of range"};
+			Plane const & plane = planes[side.plane];
+			m_side_x.push_back(plane.normal[0]);
+			m_side_y.push_back(plane.normal[1]);
+			m_side_z.push_back(plane.normal[2]);
+			m_side_dist.push_back(plane.dist);
+			m_side_plane.push_back(side.plane);
+			m_side_surface_flags.push_back(side.shader >= 0 && static_cast<size_t>(side.shader) < shaders.size() ? shaders[side.shader].surface_flags : 0);
+		}
+		while ((m_side_x.size() - entry.first_side) % SIDE_LANES) {
+			m_side_x.push_back(0);
+			m_side_y.push_back(0);
+			m_side_z.push_back(0);
+			m_side_dist.push_back(PAD_DIST);
+			m_side_plane.push_back(-1);
+			m_side_surface_flags.push_back(0);
+		}
+		entry.num_sides = m_side_x.size() - entry.first_side;
+	}
+}
+
+// ================================
+
+void Tracer::clip_brush(Work & w, int32_t brush) const {
+
+	BrushEntry const & entry = m_brushes[brush];
+	if (!(entry.contents & w.mask) || !entry.num_sides) return;
+
+	float enter_frac = -1, leave_frac = 1;
+	int32_t lead_side = -1;
+	bool start_out = false, get_out = false;
+
+	float const * xs = m_side_x.data() + entry.first_side;
+	float const * ys = m_side_y.data() + entry.first_side;
+	float const * zs = m_side_z.data() + entry.first_side;
+	float const * ds = m_side_dist.data() + entry.first_side;
+
+	for (uint32_t s = 0; s < entry.num_sides; s += SIDE_LANES) {
+
+		// distances of the start and end from each side, pushed out by the box's extents along the side's normal
+		float d1[SIDE_LANES], d2[SIDE_LANES];
+		uint32_t front1, front2;
+
+		#if defined(__AVX2__)
+		{
+			__m256 const abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+			__m256 nx = _mm256_loadu_ps(xs + s), ny = _mm256_loadu_ps(ys + s), nz = _mm256_loadu_ps(zs + s);
+			__m256 dist = _mm256_loadu_ps(ds + s);
+			dist = _mm256_add_ps(dist, _mm256_mul_ps(_mm256_and_ps(nx, abs_mask), _mm256_set1_ps(w.extents[0])));
+			dist = _mm256_add_ps(dist, _mm256_mul_ps(_mm256_and_ps(ny, abs_mask), _mm256_set1_ps(w.extents[1])));
+			dist = _mm256_add_ps(dist, _mm256_mul_ps(_mm256_and_ps(nz, abs_mask), _mm256_set1_ps(w.extents[2])));
+			__m256 v1 = _mm256_mul_ps(nx, _mm256_set1_ps(w.start[0]));
+			v1 = _mm256_add_ps(v1, _mm256_mul_ps(ny, _mm256_set1_ps(w.start[1])));
+			v1 = _mm256_add_ps(v1, _mm256_mul_ps(nz, _mm256_set1_ps(w.start[2])));
+			v1 = _mm256_sub_ps(v1, dist);
+			__m256 v2 = _mm256_mul_ps(nx, _mm256_set1_ps(w.end[0]));
+			v2 = _mm256_add_ps(v2, _mm256_mul_ps(ny, _mm256_set1_ps(w.end[1])));
+			v2 = _mm256_add_ps(v2, _mm256_mul_ps(nz, _mm256_set1_ps(w.end[2])));
+			v2 = _mm256_sub_ps(v2, dist);
+			__m256 zero = _mm256_setzero_ps();
+			__m256 f1 = _mm256_cmp_ps(v1, zero, _CMP_GT_OQ);
+			__m256 f2 = _mm256_cmp_ps(v2, zero, _CMP_GT_OQ);
+			// the sweep is entirely in front of a side, so it can't touch the brush
+			__m256 miss = _mm256_and_ps(f1, _mm256_or_ps(_mm256_cmp_ps(v2, _mm256_set1_ps(SURFACE_CLIP_EPSILON), _CMP_GE_OQ), _mm256_cmp_ps(v2, v1, _CMP_GE_OQ)));
+			if (_mm256_movemask_ps(miss)) return;
+			front1 = _mm256_movemask_ps(f1);
+			front2 = _mm256_movemask_ps(f2);
+			_mm256_storeu_ps(d1, v1);
+			_mm256_storeu_ps(d2, v2);
+		}
+		#elif defined(__SSE2__)
+		{
+			__m128 const abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+			__m128 nx = _mm_loadu_ps(xs + s), ny = _mm_loadu_ps(ys + s), nz = _mm_loadu_ps(zs + s);
+			__m128 dist = _mm_loadu_ps(ds + s);
+			dist = _mm_add_ps(dist, _mm_mul_ps(_mm_and_ps(nx, abs_mask), _mm_set1_ps(w.extents[0])));
+			dist = _mm_add_ps(dist, _mm_mul_ps(_mm_and_ps(ny, abs_mask), _mm_set1_ps(w.extents[1])));
+			dist = _mm_add_ps(dist, _mm_mul_ps(_mm_and_ps(nz, abs_mask), _mm_set1_ps(w.extents[2])));
+			__m128 v1 = _mm_mul_ps(nx, _mm_set1_ps(w.start[0]));
+			v1 = _mm_add_ps(v1, _mm_mul_ps(ny, _mm_set1_ps(w.start[1])));
+			v1 = _mm_add_ps(v1, _mm_mul_ps(nz, _mm_set1_ps(w.start[2])));
+			v1 = _mm_sub_ps(v1, dist);
+			__m128 v2 = _mm_mul_ps(nx, _mm_set1_ps(w.end[0]));
+			v2 = _mm_add_ps(v2, _mm_mul_ps(ny, _mm_set1_ps(w.end[1])));
+			v2 = _mm_add_ps(v2, _mm_mul_ps(nz, _mm_set1_ps(w.end[2])));
+			v2 = _mm_sub_ps(v2, dist);
+			__m128 zero = _mm_setzero_ps();
+			__m128 f1 = _mm_cmpgt_ps(v1, zero);
+			__m128 f2 = _mm_cmpgt_ps(v2, zero);
+			// the sweep is entirely in front of a side, so it can't touch the brush
+			__m128 miss = _mm_and_ps(f1, _mm_or_ps(_mm_cmpge_ps(v2, _mm_set1_ps(SURFACE_CLIP_EPSILON)), _mm_cmpge_ps(v2, v1)));
+			if (_mm_movemask_ps(miss)) return;
+			front1 = _mm_movemask_ps(f1);
+			front2 = _mm_movemask_ps(f2);
+			_mm_storeu_ps(d1, v1);
+			_mm_storeu_ps(d2, v2);
+		}
+		#else
+		{
+			float dist = ds[s] + std::abs(xs[s]) * w.extents[0] + std::abs(ys[s]) * w.extents[1] + std::abs(zs[s]) * w.extents[2];
+			d1[0] = xs[s] * w.start[0] + ys[s] * w.start[1] + zs[s] * w.start[2] - dist;
+			d2[0] = xs[s] * w.end[0] + ys[s] * w.end[1] + zs[s] * w.end[2] - dist;
+			// the sweep is entirely in front of a side, so it can't touch the brush
+			if (d1[0] > 0 && (d2[0] >= SURFACE_CLIP_EPSILON || d2[0] >= d1[0])) return;
+			front1 = d1[0] > 0;
+			front2 = d2[0] > 0;
+		}
+		#endif
+
+		start_out |= front1 != 0;
+		get_out |= front2 != 0;
+
+		// sides the sweep stays behind don't limit it, only visit the ones it crosses
+		for (uint32_t crossing = front1 | front2; crossing; crossing &= crossing - 1) {
+			uint32_t l = std::countr_zero(crossing);
+			if (d1[l] > d2[l]) { // entering
+				float f = std::max((d1[l] - SURFACE_CLIP_EPSILON) / (d1[l] - d2[l]), 0.0f);
+				if (f > enter_frac) {
+					enter_frac = f;
+					lead_side = entry.first_side + s + l;
+				}
+			} else { // leaving
+				float f = std::min((d1[l] + SURFACE_CLIP_EPSILON) / (d1[l] - d2[l]), 1.0f);
+				leave_frac = std::min(leave_frac, f);
+			}
+		}
+	}
+
+	TraceResult & r = w.result;
+
+	if (!start_out) {
+		r.start_solid = true;
+		if (!get_out) {
+			r.all_solid = true;
+			r.fraction = 0;
+			r.brush = brush;
+			r.contents = entry.contents;
+		}
+		return;
+	}
+
+	if (enter_frac < leave_frac && enter_frac > -1 && enter_frac < r.fraction) {
+		r.fraction = std::max(enter_frac, 0.0f);
+		r.plane = m_side_plane[lead_side];
+		r.normal = { m_side_x[lead_side], m_side_y[lead_side], m_side_z[lead_side] };
+		r.brush = brush;
+		r.contents = entry.contents;
+		r.surface_flags = m_side_surface_flags[lead_side];
+	}
+}
+
+void Tracer::trace_leaf(Work & w, int32_t leaf) const {
+	auto leafs = m_bspr.leafs();
+	auto leafbrushes = m_bspr.leafbrushes();
+	if (leaf < 0 || static_cast<size_t>(leaf) >= leafs.size()) return;
+
+	Leaf const & l = leafs[leaf];
+	for (int32_t i = 0; i < l.num_brushes; i++) {
+		size_t lb = static_cast<size_t>(l.first_brush) + i;
+		if (lb >= leafbrushes.size()) break;
+		int32_t brush = leafbrushes[lb];
+		if (brush < 0 || static_cast<size_t>(brush) >= m_brushes.size()) continue;
+
+		auto checked_end = w.checked.begin() + w.num_checked;
+		if (std::find(w.checked.begin(), checked_end, brush) != checked_end) continue;
+		if (w.num_checked < w.checked.size()) w.checked[w.num_checked++] = brush;
+
+		clip_brush(w, brush);
+		if (w.result.all_solid) return;
+	}
+}
+
+void Tracer::trace_node(Work & w, int32_t num, float p1f, float p2f, vec3_t const & p1, vec3_t const & p2) const {
+
+	// already hit something closer than this part of the sweep
+	if (w.result.fraction <= p1f) return;
+
+	if (num < 0) {
+		trace_leaf(w, -num - 1);
+		return;
+	}
+
+	Node const & node = m_bspr.nodes()[num];
+	Plane const & plane = m_bspr.planes()[node.plane];
+
+	float t1 = plane.normal[0] * p1[0] + plane.normal[1] * p1[1] + plane.normal[2] * p1[2] - plane.dist;
+	float t2 = plane.normal[0] * p2[0] + plane.normal[1] * p2[1] + plane.normal[2] * p2[2] - plane.dist;
+	float offset = std::abs(plane.normal[0]) * w.extents[0] + std::abs(plane.normal[1]) * w.extents[1] + std::abs(plane.normal[2]) * w.extents[2];
+
+	// entirely on one side of the plane
+	if (t1 >= offset + 1 && t2 >= offset + 1) {
+		trace_node(w, node.children[0], p1f, p2f, p1, p2);
+		return;
+	}
+	if (t1 < -offset - 1 && t2 < -offset - 1) {
+		trace_node(w, node.children[1], p1f, p2f, p1, p2);
+		return;
+	}
+
+	// crosses the plane, split the sweep into the part on the start's side and the part on the other, overlapping them by the offset
+	int side;
+	float frac, frac2;
+	if (t1 < t2) {
+		float idist = 1.0f / (t1 - t2);
+		side = 1;
+		frac2 = (t1 + offset + SURFACE_CLIP_EPSILON) * idist;
+		frac = (t1 - offset + SURFACE_CLIP_EPSILON) * idist;
+	} else if (t1 > t2) {
+		float idist = 1.0f / (t1 - t2);
+		side = 0;
+		frac2 = (t1 - offset - SURFACE_CLIP_EPSILON) * idist;
+		frac = (t1 + offset + SURFACE_CLIP_EPSILON) * idist;
+	} else {
+		side = 0;
+		frac = 1;
+		frac2 = 0;
+	}
+	frac = std::clamp(frac, 0.0f, 1.0f);
+	frac2 = std::clamp(frac2, 0.0f, 1.0f);
+
+	float midf = p1f + (p2f - p1f) * frac;
+	vec3_t mid { p1[0] + frac * (p2[0] - p1[0]), p1[1] + frac * (p2[1] - p1[1]), p1[2] + frac * (p2[2] - p1[2]) };
+	trace_node(w, node.children[side], p1f, midf, p1, mid);
+
+	midf = p1f + (p2f - p1f) * frac2;
+	mid = { p1[0] + frac2 * (p2[0] - p1[0]), p1[1] + frac2 * (p2[1] - p1[1]), p1[2] + frac2 * (p2[2] - p1[2]) };
+	trace_node(w, node.children[side ^ 1], midf, p2f, mid, p2);
+}
+
+void Tracer::trace(Work & w) const {
+	if (!m_bspr.nodes().empty()) trace_node(w, 0, 0, 1, w.start, w.end);
+
+	float f = w.result.fraction;
+	for (size_t i = 0; i < 3; i++) {
+		float start = w.start[i] - w.centre[i], end = w.end[i] - w.centre[i];
+		w.result.end[i] = start + f * (end - start);
+	}
+}
+
+// ================================
+
+static inline void setup_work(auto & w, vec3_t const & start, vec3_t const & end, vec3_t const & mins, vec3_t const & maxs, int32_t content_mask) {
+	for (size_t i = 0; i < 3; i++) {
+		w.centre[i] = (mins[i] + maxs[i]) * 0.5f;
+		w.extents[i] = (maxs[i] - mins[i]) * 0.5f;
+		w.start[i] = start[i] + w.centre[i];
+		w.end[i] = end[i] + w.centre[i];
+	}
+	w.mask = content_mask;
+	w.result = {};
+	w.num_checked = 0;
+}
+
+TraceResult Tracer::trace(vec3_t const & start, vec3_t const & end, int32_t content_mask) const {
+	return trace(start, end, {}, {}, content_mask);
+}
+
+TraceResult Tracer::trace(vec3_t const & start, vec3_t const & end, vec3_t const & mins, vec3_t const & maxs, int32_t content_mask) const {
+	Work w;
+	setup_work(w, start, end, mins, maxs, content_mask);
+	trace(w);
+	return w.result;
+}
+
+void Tracer::trace(std::span<TraceRay const> rays, std::span<TraceResult> out, vec3_t const & mins, vec3_t const & maxs, int32_t content_mask, size_t threads) const {
+	if (out.size() < rays.size()) throw std::logic_error {"output span smaller than input span"};
+
+	static constexpr size_t PACKET = 256;
+	parallel_for((rays.size() + PACKET - 1) / PACKET, threads, [&](size_t p){
+		Work w;
+		size_t end = std::min((p + 1) * PACKET, rays.size());
+		for (size_t i = p * PACKET; i < end; i++) {
+			setup_work(w, rays[i].start, rays[i].end, mins, maxs, content_mask);
+			trace(w);
+			out[i] = w.result;
+		}
+	});
+}
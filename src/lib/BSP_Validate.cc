@@ -0,0 +1,223 @@
+#include "libbsp.hh"
+
+#include <algorithm>
+#include <functional>
+#include <string>
+
+using namespace BSP;
+
+namespace {
+
+	static constexpr size_t CHUNK = 16384; // elements per parallel task
+
+	// diagnostics of one task, kept up to the limit and counted past it
+	struct Sink {
+		std::vector<Diagnostic> diagnostics;
+		size_t count = 0;
+		size_t limit = 0;
+
+		inline void add(LumpIndex lump, size_t element, LumpIndex target, int64_t value, std::string && message) {
+			if (count++ < limit) diagnostics.push_back({ lump, element, target, value, std::move(message) });
+		}
+
+		// a reference that must name an element of the target lump, or be negative where allow_negative says so
+		inline bool index(LumpIndex lump, size_t element, LumpIndex target, int64_t value, size_t size, char const * what, bool allow_negative = false) {
+			if (value < 0 ? allow_negative : static_cast<size_t>(value) < size) return true;
+			add(lump, element, target, value, std::string { what } + " " + std::to_string(value) + " is outside of " + std::to_string(size));
+			return false;
+		}
+
+		// a range that must lie within the target lump, empty ranges can point anywhere
+		inline bool range(LumpIndex lump, size_t element, LumpIndex target, int64_t first, int64_t count, size_t size, char const * what) {
+			if (count == 0) return true;
+			if (first >= 0 && count > 0 && static_cast<size_t>(first + count) <= size) return true;
+			add(lump, element, target, count < 0 ? count : first, std::string { what } + " " + std::to_string(first) + "+" + std::to_string(count) + " is outside of " + std::to_string(size));
+			return false;
+		}
+	};
+
+	struct Task {
+		LumpIndex lump;
+		std::function<void(Sink &)> check;
+	};
+
+	// queue a check of every element of a lump, a task per chunk
+	template <typename T, typename F>
+	void each(std::vector<Task> & tasks, LumpIndex lump, std::span<T const> elements, F check) {
+		for (size_t first = 0; first < elements.size(); first += CHUNK) {
+			size_t last = std::min(elements.size(), first + CHUNK);
+			tasks.push_back({ lump, [=](Sink & sink){ for (size_t i = first; i < last; i++) check(sink, i, elements[i]); } });
+		}
+	}
+
+	inline bool surface_type_valid(SurfaceType type) {
+		// 5 is foliage, written by q3map2 but not among the types this library handles
+		return type >= SurfaceType::PLANAR && static_cast<int32_t>(type) <= 5;
+	}
+
+}
+
+ValidationReport BSP::validate(Reader const & bspr, ValidationOptions const & opts) {
+
+	auto const shaders = bspr.shaders().size();
+	auto const planes = bspr.planes().size();
+	auto const nodes = bspr.nodes().size();
+	auto const leafs = bspr.leafs().size();
+	auto const leaf_surfaces = bspr.leafsurfaces().size();
+	auto const leaf_brushes = bspr.leafbrushes().size();
+	auto const brushes = bspr.brushes().size();
+	auto const brush_sides = bspr.brushsides().size();
+	auto const verts = bspr.drawverts().size();
+	auto const indices = bspr.drawindices().size();
+	auto const fogs = bspr.fogs().size();
+	auto const surfaces = bspr.surfaces().size();
+	auto const lightmaps = bspr.lightmaps().size();
+	auto const lightgrids = bspr.lightgrids().size();
+
+	Sink header;
+	header.limit = opts.max_diagnostics;
+
+	// ================================
+	// LUMP SIZES
+
+	static constexpr size_t element_size[18] {
+		1, sizeof(Shader), sizeof(Plane), sizeof(Node), sizeof(Leaf), sizeof(int32_t), sizeof(int32_t), sizeof(Model), sizeof(Brush),
+		sizeof(BrushSide), sizeof(DrawVert), sizeof(int32_t), sizeof(Fog), sizeof(Surface), sizeof(Lightmap), sizeof(Lightgrid), 1, sizeof(uint16_t)
+	};
+	for (size_t l = 0; l < 18; l++) {
+		LumpIndex lump = static_cast<LumpIndex>(l);
+		int32_t size = bspr.get_lump(lump).size;
+		if (size % element_size[l])
+			header.add(lump, 0, lump, size, "lump size " + std::to_string(size) + " is not a multiple of " + std::to_string(element_size[l]));
+	}
+
+	// clusters are only bounded by the visibility data, when there is any
+	int64_t clusters = -1;
+	if (bspr.has_visibility()) {
+		size_t const size = bspr.get_lump(LumpIndex::VISIBILITY).size;
+		VisibilityHeader const & vis = *bspr.get_data<VisibilityHeader const>(LumpIndex::VISIBILITY);
+		size_t const data = size - std::min(size, sizeof(VisibilityHeader));
+		if (size < sizeof(VisibilityHeader)) {
+			header.add(LumpIndex::VISIBILITY, 0, LumpIndex::VISIBILITY, size, "visibility lump is too small for its header");
+		} else if (vis.clusters < 0 || vis.cluster_bytes < 0) {
+			header.add(LumpIndex::VISIBILITY, 0, LumpIndex::VISIBILITY, std::min(vis.clusters, vis.cluster_bytes), "visibility header has a negative size");
+		} else if (static_cast<int64_t>(vis.cluster_bytes) * 8 < vis.clusters) {
+			header.add(LumpIndex::VISIBILITY, 0, LumpIndex::VISIBILITY, vis.cluster_bytes, std::to_string(vis.cluster_bytes) + " bytes per cluster are too few for " + std::to_string(vis.clusters) + " clusters");
+		} else if (static_cast<uint64_t>(vis.clusters) * vis.cluster_bytes > data) {
+			header.add(LumpIndex::VISIBILITY, 0, LumpIndex::VISIBILITY, vis.clusters, std::to_string(vis.clusters) + " clusters need more than the " + std::to_string(data) + " bytes of visibility data");
+		} else {
+			clusters = vis.clusters;
+		}
+	}
+
+	// ================================
+	// ELEMENTS
+
+	std::vector<Task> tasks;
+
+	each(tasks, LumpIndex::NODES, bspr.nodes(), [=](Sink & sink, size_t n, Node const & node){
+		sink.index(LumpIndex::NODES, n, LumpIndex::PLANES, node.plane, planes, "plane");
+		for (int32_t child : node.children) {
+			if (child < 0) {
+				sink.index(LumpIndex::NODES, n, LumpIndex::LEAFS, -(child + 1), leafs, "child leaf");
+			} else if (sink.index(LumpIndex::NODES, n, LumpIndex::NODES, child, nodes, "child node") && static_cast<size_t>(child) <= n) {
+				sink.add(LumpIndex::NODES, n, LumpIndex::NODES, child, "child node " + std::to_string(child) + " does not come after its parent");
+			}
+		}
+	});
+
+	each(tasks, LumpIndex::LEAFS, bspr.leafs(), [=](Sink & sink, size_t l, Leaf const & leaf){
+		if (leaf.cluster < -1 || (clusters >= 0 && leaf.cluster >= clusters))
+			sink.add(LumpIndex::LEAFS, l, LumpIndex::VISIBILITY, leaf.cluster, "cluster " + std::to_string(leaf.cluster) + " is outside of " + std::to_string(std::max<int64_t>(clusters, 0)));
+		if (leaf.area < -1)
+			sink.add(LumpIndex::LEAFS, l, LumpIndex::LEAFS, leaf.area, "area " + std::to_string(leaf.area) + " is negative");
+		sink.range(LumpIndex::LEAFS, l, LumpIndex::LEAFSURFACES, leaf.first_surface, leaf.num_surfaces, leaf_surfaces, "leafsurfaces");
+		sink.range(LumpIndex::LEAFS, l, LumpIndex::LEAFBRUSHES, leaf.first_brush, leaf.num_brushes, leaf_brushes, "leafbrushes");
+	});
+
+	each(tasks, LumpIndex::LEAFSURFACES, bspr.leafsurfaces(), [=](Sink & sink, size_t i, int32_t surface){
+		sink.index(LumpIndex::LEAFSURFACES, i, LumpIndex::SURFACES, surface, surfaces, "surface");
+	});
+
+	each(tasks, LumpIndex::LEAFBRUSHES, bspr.leafbrushes(), [=](Sink & sink, size_t i, int32_t brush){
+		sink.index(LumpIndex::LEAFBRUSHES, i, LumpIndex::BRUSHES, brush, brushes, "brush");
+	});
+
+	each(tasks, LumpIndex::MODELS, bspr.models(), [=](Sink & sink, size_t m, Model const & model){
+		sink.range(LumpIndex::MODELS, m, LumpIndex::SURFACES, model.first_surface, model.num_surfaces, surfaces, "surfaces");
+		sink.range(LumpIndex::MODELS, m, LumpIndex::BRUSHES, model.first_brush, model.num_brushes, brushes, "brushes");
+	});
+
+	// negative shaders are written by some tools for brushes and sides without one
+	each(tasks, LumpIndex::BRUSHES, bspr.brushes(), [=](Sink & sink, size_t b, Brush const & brush){
+		sink.range(LumpIndex::BRUSHES, b, LumpIndex::BRUSHSIDES, brush.first_side, brush.num_sides, brush_sides, "brush sides");
+		sink.index(LumpIndex::BRUSHES, b, LumpIndex::SHADERS, brush.shader, shaders, "shader", true);
+	});
+
+	each(tasks, LumpIndex::BRUSHSIDES, bspr.brushsides(), [=](Sink & sink, size_t i, BrushSide const & side){
+		sink.index(LumpIndex::BRUSHSIDES, i, LumpIndex::PLANES, side.plane, planes, "plane");
+		sink.index(LumpIndex::BRUSHSIDES, i, LumpIndex::SHADERS, side.shader, shaders, "shader", true);
+	});
+
+	// the global fog has no brush
+	each(tasks, LumpIndex::FOGS, bspr.fogs(), [=](Sink & sink, size_t f, Fog const & fog){
+		sink.index(LumpIndex::FOGS, f, LumpIndex::BRUSHES, fog.brush, brushes, "brush", true);
+		sink.index(LumpIndex::FOGS, f, LumpIndex::BRUSHSIDES, fog.visible_side, brush_sides, "visible side", true);
+	});
+
+	auto const index_data = bspr.drawindices();
+	bool const check_indices = opts.check_indices;
+	each(tasks, LumpIndex::SURFACES, bspr.surfaces(), [=](Sink & sink, size_t s, Surface const & surface){
+		if (!surface_type_valid(surface.type))
+			sink.add(LumpIndex::SURFACES, s, LumpIndex::SURFACES, static_cast<int32_t>(surface.type), "unknown surface type " + std::to_string(static_cast<int32_t>(surface.type)));
+		sink.index(LumpIndex::SURFACES, s, LumpIndex::SHADERS, surface.shader, shaders, "shader");
+		sink.index(LumpIndex::SURFACES, s, LumpIndex::FOGS, surface.fog, fogs, "fog", true);
+		sink.range(LumpIndex::SURFACES, s, LumpIndex::DRAWVERTS, surface.vert_idx, surface.vert_count, verts, "drawverts");
+		bool indices_in = sink.range(LumpIndex::SURFACES, s, LumpIndex::DRAWINDEXES, surface.index_idx, surface.index_count, indices, "drawindexes");
+		// negative lightmaps mean vertex lighting or none in that style
+		for (int32_t lightmap : surface.lightmap)
+			sink.index(LumpIndex::SURFACES, s, LumpIndex::LIGHTMAPS, lightmap, lightmaps, "lightmap", true);
+
+		if (surface.type == SurfaceType::PATCH && static_cast<int64_t>(surface.patch_width) * surface.patch_height != surface.vert_count)
+			sink.add(LumpIndex::SURFACES, s, LumpIndex::DRAWVERTS, surface.vert_count, "patch of " + std::to_string(surface.patch_width) + "x" + std::to_string(surface.patch_height) + " has " + std::to_string(surface.vert_count) + " vertices");
+
+		if (!check_indices || !indices_in) return;
+		uint32_t const count = std::max(surface.vert_count, 0);
+		int32_t const * idx = index_data.data() + surface.index_idx;
+		uint32_t bad = 0;
+		for (int32_t i = 0; i < surface.index_count; i++) bad |= static_cast<uint32_t>(idx[i]) >= count;
+		if (!bad) return;
+		// only the first bad index is reported, the branchless loop above only finds out whether there is one
+		for (int32_t i = 0; i < surface.index_count; i++) {
+			if (static_cast<uint32_t>(idx[i]) < count) continue;
+			sink.add(LumpIndex::SURFACES, s, LumpIndex::DRAWINDEXES, idx[i], "drawindex " + std::to_string(surface.index_idx + i) + " of " + std::to_string(idx[i]) + " is outside of the surface's " + std::to_string(count) + " vertices");
+			break;
+		}
+	});
+
+	each(tasks, LumpIndex::LIGHTARRAY, bspr.lightarray(), [=](Sink & sink, size_t i, uint16_t cell){
+		sink.index(LumpIndex::LIGHTARRAY, i, LumpIndex::LIGHTGRID, cell, lightgrids, "lightgrid cell");
+	});
+
+	// ================================
+
+	std::vector<Sink> sinks (tasks.size());
+	for (Sink & sink : sinks) sink.limit = opts.max_diagnostics;
+	parallel_for(tasks.size(), opts.threads, [&](size_t t){ tasks[t].check(sinks[t]); });
+
+	// tasks were queued in lump order and each sorted within, merging them in order keeps the report deterministic
+	ValidationReport report;
+	report.diagnostics = std::move(header.diagnostics);
+	report.count = header.count;
+	std::vector<size_t> order (tasks.size());
+	for (size_t t = 0; t < order.size(); t++) order[t] = t;
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){ return tasks[a].lump < tasks[b].lump; });
+	for (size_t t : order) {
+		report.count += sinks[t].count;
+		for (Diagnostic & d : sinks[t].diagnostics) {
+			if (report.diagnostics.size() >= opts.max_diagnostics) break;
+			report.diagnostics.push_back(std::move(d));
+		}
+	}
+	return report;
+}
@@ -0,0 +1,358 @@
+#include "libbsp.hh"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace BSP;
+
+// ================================
+// KERNELS
+
+// every kernel walks whole blocks of ClusterSetView::BLOCK_WORDS words, which the sets are always padded to
+
+static constexpr size_t BLOCK = ClusterSetView::BLOCK_WORDS;
+
+#if defined(__AVX2__)
+
+static inline __m256i load(uint64_t const * p) { return _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p)); }
+static inline void store(uint64_t * p, __m256i v) { _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v); }
+
+// nibble lookup popcount, summed into 64-bit lanes
+static inline __m256i popcount_block(__m256i v) {
+	__m256i const lookup = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+	);
+	__m256i const low = _mm256_set1_epi8(0x0F);
+	__m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+	__m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+static inline size_t sum_lanes(__m256i v) {
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	return _mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1);
+}
+
+template <typename OP> static inline void combine(uint64_t * dst, uint64_t const * src, size_t words, OP op) {
+	for (size_t w = 0; w < words; w += BLOCK) store(dst + w, op(load(dst + w), load(src + w)));
+}
+
+static size_t popcount(uint64_t const * a, size_t words) {
+	__m256i acc = _mm256_setzero_si256();
+	for (size_t w = 0; w < words; w += BLOCK) acc = _mm256_add_epi64(acc, popcount_block(load(a + w)));
+	return sum_lanes(acc);
+}
+
+static size_t popcount_and(uint64_t const * a, uint64_t const * b, size_t words) {
+	__m256i acc = _mm256_setzero_si256();
+	for (size_t w = 0; w < words; w += BLOCK) acc = _mm256_add_epi64(acc, popcount_block(_mm256_and_si256(load(a + w), load(b + w))));
+	return sum_lanes(acc);
+}
+
+static bool any_and(uint64_t const * a, uint64_t const * b, size_t words) {
+	for (size_t w = 0; w < words; w += BLOCK)
+		if (!_mm256_testz_si256(load(a + w), load(b + w))) return true;
+	return false;
+}
+
+static void or_into(uint64_t * dst, uint64_t const * src, size_t words) { combine(dst, src, words, [](__m256i d, __m256i s){ return _mm256_or_si256(d, s); }); }
+static void and_into(uint64_t * dst, uint64_t const * src, size_t words) { combine(dst, src, words, [](__m256i d, __m256i s){ return _mm256_and_si256(d, s); }); }
+static void andnot_into(uint64_t * dst, uint64_t const * src, size_t words) { combine(dst, src, words, [](__m256i d, __m256i s){ return _mm256_andnot_si256(s, d); }); }
+
+#elif defined(__SSE2__)
+
+static inline __m128i load(uint64_t const * p) { return _mm_loadu_si128(reinterpret_cast<__m128i const *>(p)); }
+static inline void store(uint64_t * p, __m128i v) { _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v); }
+
+// bit-slicing popcount, summed into 64-bit lanes
+static inline __m128i popcount_half(__m128i v) {
+	v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(0x55)));
+	v = _mm_add_epi8(_mm_and_si128(v, _mm_set1_epi8(0x33)), _mm_and_si128(_mm_srli_epi16(v, 2), _mm_set1_epi8(0x33)));
+	v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi16(v, 4)), _mm_set1_epi8(0x0F));
+	return _mm_sad_epu8(v, _mm_setzero_si128());
+}
+
+static inline size_t sum_lanes(__m128i v) {
+	return static_cast<size_t>(_mm_cvtsi128_si64(v)) + static_cast<size_t>(_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+}
+
+static inline bool is_zero(__m128i v) {
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xFFFF;
+}
+
+template <typename OP> static inline void combine(uint64_t * dst, uint64_t const * src, size_t words, OP op) {
+	for (size_t w = 0; w < words; w += 2) store(dst + w, op(load(dst + w), load(src + w)));
+}
+
+static size_t popcount(uint64_t const * a, size_t words) {
+	__m128i acc = _mm_setzero_si128();
+	for (size_t w = 0; w < words; w += 2) acc = _mm_add_epi64(acc, popcount_half(load(a + w)));
+	return sum_lanes(acc);
+}
+
+static size_t popcount_and(uint64_t const * a, uint64_t const * b, size_t words) {
+	__m128i acc = _mm_setzero_si128();
+	for (size_t w = 0; w < words; w += 2) acc = _mm_add_epi64(acc, popcount_half(_mm_and_si128(load(a + w), load(b + w))));
+	return sum_lanes(acc);
+}
+
+static bool any_and(uint64_t const * a, uint64_t const * b, size_t words) {
+	for (size_t w = 0; w < words; w += BLOCK) {
+		__m128i v = _mm_or_si128(_mm_and_si128(load(a + w), load(b + w)), _mm_and_si128(load(a + w + 2), load(b + w + 2)));
+		if (!is_zero(v)) return true;
+	}
+	return false;
+}
+
+static void or_into(uint64_t * dst, uint64_t const * src, size_t words) { combine(dst, src, words, [](__m128i d, __m128i s){ return _mm_or_si128(d, s); }); }
+static void and_into(uint64_t * dst, uint64_t const * src, size_t words) { combine(dst, src, words, [](__m128i d, __m128i s){ return _mm_and_si128(d, s); }); }
+static void andnot_into(uint64_t * dst, uint64_t const * src, size_t words) { combine(dst, src, words, [](__m128i d, __m128i s){ return _mm_andnot_si128(s, d); }); }
+
+#else
+
+static size_t popcount(uint64_t const * a, size_t words) {
+	size_t n = 0;
+	for (size_t w = 0; w < words; w++) n += std::popcount(a[w]);
+	return n;
+}
+
+static size_t popcount_and(uint64_t const * a, uint64_t const * b, size_t words) {
+	size_t n = 0;
+	for (size_t w = 0; w < words; w++) n += std::popcount(a[w] & b[w]);
+	return n;
+}
+
+static bool any_and(uint64_t const * a, uint64_t const * b, size_t words) {
+	for (size_t w = 0; w < words; w++) if (a[w] & b[w]) return true;
+	return false;
+}
+
+static void or_into(uint64_t * dst, uint64_t const * src, size_t words) { for (size_t w = 0; w < words; w++) dst[w] |= src[w]; }
+static void and_into(uint64_t * dst, uint64_t const * src, size_t words) { for (size_t w = 0; w < words; w++) dst[w] &= src[w]; }
+static void andnot_into(uint64_t * dst, uint64_t const * src, size_t words) { for (size_t w = 0; w < words; w++) dst[w] &= ~src[w]; }
+
+#endif
+
+// ================================
+// CLUSTER SETS
+
+size_t ClusterSetView::count() const {
+	return popcount(m_words.data(), m_words.size());
+}
+
+bool ClusterSetView::any() const {
+	return std::any_of(m_words.begin(), m_words.end(), [](uint64_t w){ return w != 0; });
+}
+
+bool ClusterSetView::intersects(ClusterSetView const & other) const {
+	if (other.m_words.size() != m_words.size()) throw std::length_error {"cluster sets are different sizes"};
+	return any_and(m_words.data(), other.m_words.data(), m_words.size());
+}
+
+size_t ClusterSetView::count_common(ClusterSetView const & other) const {
+	if (other.m_words.size() != m_words.size()) throw std::length_error {"cluster sets are different sizes"};
+	return popcount_and(m_words.data(), other.m_words.data(), m_words.size());
+}
+
+void ClusterSet::clear() {
+	std::fill(m_words.begin(), m_words.end(), 0);
+}
+
+void ClusterSet::fill() {
+	std::fill(m_words.begin(), m_words.end(), 0);
+	std::fill(m_words.begin(), m_words.begin() + m_clusters / 64, ~uint64_t { 0 });
+	if (m_clusters % 64) m_words[m_clusters / 64] = (uint64_t { 1 } << (m_clusters % 64)) - 1;
+}
+
+ClusterSet & ClusterSet::operator |= (ClusterSetView const & other) {
+	if (other.words().size() != m_words.size()) throw std::length_error {"cluster sets are different sizes"};
+	or_into(m_words.data(), other.words().data(), m_words.size());
+	return *this;
+}
+
+ClusterSet & ClusterSet::operator &= (ClusterSetView const & other) {
+	if (other.words().size() != m_words.size()) throw std::length_error {"cluster sets are different sizes"};
+	and_into(m_words.data(), other.words().data(), m_words.size());
+	return *this;
+}
+
+ClusterSet & ClusterSet::operator -= (ClusterSetView const & other) {
+	if (other.words().size() != m_words.size()) throw std::length_error {"cluster sets are different sizes"};
+	andnot_into(m_words.data(), other.words().data(), m_words.size());
+	return *this;
+}
+
+// ================================
+// VISIBILITY TABLE
+
+VisibilityTable::VisibilityTable(Reader const & bspr) {
+
+	if (!bspr.has_visibility()) {
+		int32_t max_cluster = -1;
+		for (Leaf const & leaf : bspr.leafs()) max_cluster = std::max(max_cluster, leaf.cluster);
+		m_clusters = max_cluster + 1;
+		m_stride = ClusterSetView::words_for(m_clusters);
+		m_empty.resize(m_stride);
+		ClusterSet all { m_clusters };
+		all.fill();
+		m_rows.reserve(m_stride * m_clusters);
+		for (size_t c = 0; c < m_clusters; c++) m_rows.insert(m_rows.end(), all.words().begin(), all.words().end());
+		return;
+	}
+
+	auto vis = bspr.visibility();
+	if (vis.header.clusters < 0 || vis.header.cluster_bytes < 0)
+		throw std::out_of_range {"visibility header is negative"};
+	if (static_cast<size_t>(vis.header.cluster_bytes) * 8 < static_cast<size_t>(vis.header.clusters))
+		throw std::out_of_range {"visibility clusters are too small to hold every cluster"};
+	if (static_cast<size_t>(vis.header.clusters) * vis.header.cluster_bytes > vis.data.size())
+		throw std::out_of_range {"visibility data is smaller than its header claims"};
+
+	m_clusters = vis.header.clusters;
+	m_stride = ClusterSetView::words_for(m_clusters);
+	m_empty.resize(m_stride);
+	m_rows.resize(m_stride * m_clusters);
+
+	// the file's rows are little endian bytes, so on little endian machines they can be copied straight into the words
+	static_assert(std::endian::native == std::endian::little);
+	size_t row_bytes = (m_clusters + 7) / 8;
+	for (size_t c = 0; c < m_clusters; c++) {
+		uint64_t * row = m_rows.data() + m_stride * c;
+		std::memcpy(row, vis.data.data() + vis.header.cluster_bytes * c, row_bytes);
+		// bits past the last cluster may be set in the file
+		if (m_clusters % 64) row[m_clusters / 64] &= (uint64_t { 1 } << (m_clusters % 64)) - 1;
+	}
+}
+
+void VisibilityTable::visible_from_any(std::span<int32_t const> clusters, ClusterSet & out) const {
+	if (out.clusters() != m_clusters) out = ClusterSet { m_clusters };
+	else out.clear();
+	for (int32_t c : clusters) out |= pvs(c);
+}
+
+ClusterSet VisibilityTable::visible_from_any(std::span<int32_t const> clusters) const {
+	ClusterSet ret { m_clusters };
+	visible_from_any(clusters, ret);
+	return ret;
+}
+
+ClusterSet VisibilityTable::visible_from_all(std::span<int32_t const> clusters) const {
+	ClusterSet ret { m_clusters };
+	if (clusters.empty()) return ret;
+	ret |= pvs(clusters[0]);
+	for (int32_t c : clusters.subspan(1)) {
+		ret &= pvs(c);
+		if (!ret.any()) break;
+	}
+	return ret;
+}
+
+VisibilityTable VisibilityTable::phs(size_t threads) const {
+	VisibilityTable ret;
+	ret.m_clusters = m_clusters;
+	ret.m_stride = m_stride;
+	ret.m_empty.resize(m_stride);
+	ret.m_rows.resize(m_rows.size());
+
+	// rows are independent, hand them out in runs so threads don't share cache lines of the output
+	static constexpr size_t RUN = 16;
+	parallel_for((m_clusters + RUN - 1) / RUN, threads, [&](size_t r){
+		for (size_t a = r * RUN; a < std::min((r + 1) * RUN, m_clusters); a++) {
+			uint64_t * dst = ret.m_rows.data() + m_stride * a;
+			ClusterSetView row = pvs(a);
+			std::copy(row.words().begin(), row.words().end(), dst);
+			row.for_each([&](int32_t c){ or_into(dst, m_rows.data() + m_stride * c, m_stride); });
+		}
+	});
+
+	return ret;
+}
+
+// ================================
+// SIDECAR CACHE
+
+struct CacheHeader {
+	std::array<char, 4> ident;
+	uint32_t clusters;
+	uint64_t key;
+	VisibilityTable::Kind kind;
+	uint32_t reserved;
+};
+
+static constexpr std::array<char, 4> CACHE_IDENT = { 'V', 'I', 'S', 'C' };
+
+// clusters the constructor decodes the source to, without decoding it
+static size_t source_clusters(Reader const & bspr) {
+	if (!bspr.has_visibility()) {
+		int32_t max_cluster = -1;
+		for (Leaf const & leaf : bspr.leafs()) max_cluster = std::max(max_cluster, leaf.cluster);
+		return max_cluster + 1;
+	}
+	return std::max(bspr.visibility().header.clusters, 0);
+}
+
+VisibilityTable::CacheKey VisibilityTable::source_key(Reader const & bspr, Kind kind) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (uint8_t b : bspr.get_data_span<uint8_t const>(LumpIndex::VISIBILITY)) hash = (hash ^ b) * 0x100000001b3;
+	return { hash, static_cast<uint32_t>(source_clusters(bspr)), kind };
+}
+
+bool VisibilityTable::save(std::string const & path, CacheKey const & key) const {
+	if (key.clusters != m_clusters) return false;
+
+	// a unique name, so processes warming the same cache at once don't write into each other's file
+	std::string tmp_path = path + ".XXXXXX";
+	int fd = mkstemp(tmp_path.data());
+	if (fd == -1) return false;
+	bool ok = fchmod(fd, 0644) == 0;
+	ok = close(fd) == 0 && ok;
+	if (ok) {
+		std::ofstream out { tmp_path, std::ios::binary | std::ios::trunc };
+		CacheHeader header { CACHE_IDENT, static_cast<uint32_t>(m_clusters), key.hash, key.kind, 0 };
+		out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+		out.write(reinterpret_cast<char const *>(m_rows.data()), m_rows.size() * sizeof(uint64_t));
+		out.close();
+		ok = static_cast<bool>(out);
+	}
+	if (!ok || std::rename(tmp_path.c_str(), path.c_str())) {
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+std::optional<VisibilityTable> VisibilityTable::load(std::string const & path, CacheKey const & key) {
+	std::ifstream in { path, std::ios::binary };
+	if (!in) return std::nullopt;
+
+	CacheHeader header;
+	if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))) return std::nullopt;
+	if (header.ident != CACHE_IDENT || header.key != key.hash || header.kind != key.kind) return std::nullopt;
+	// checked against the source before anything is allocated, so a damaged cache can't ask for more than the source holds
+	if (header.clusters != key.clusters) return std::nullopt;
+
+	VisibilityTable ret;
+	ret.m_clusters = header.clusters;
+	ret.m_stride = ClusterSetView::words_for(ret.m_clusters);
+	ret.m_empty.resize(ret.m_stride);
+	ret.m_rows.resize(ret.m_stride * ret.m_clusters);
+	if (!in.read(reinterpret_cast<char *>(ret.m_rows.data()), ret.m_rows.size() * sizeof(uint64_t))) return std::nullopt;
+	if (in.peek() != std::ifstream::traits_type::eof()) return std::nullopt;
+
+	return ret;
+}
@@ -6,20 +6,24 @@
 #include "stb_image.h"
 #include "stb_image_write.h"
 
-#include <sys/mman.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
-
 #include <bitset>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <optional>
+#include <random>
 #include <string>
 #include <unordered_map>
-#include <filesystem>
+
+static constexpr char const * lump_names[18] {
+	"entities", "shaders", "planes", "nodes", "leafs", "leafsurfaces", "leafbrushes", "models", "brushes",
+	"brushsides", "drawverts", "drawindexes", "fogs", "surfaces", "lightmaps", "lightgrid", "visibility", "lightarray"
+};
 
 static int32_t add_shader(BSPI::ShaderArray & shaders, meadow::istring_view name) {
 		
@@ -38,6 +42,18 @@ static int32_t add_shader(BSPI::ShaderArray & shaders, meadow::istring_view name
 		return shdst;
 }
 
+static bool write_bsp(BSP::Assembler & bspa, std::string const & path, size_t threads) {
+	try {
+		bspa.set_threads(threads);
+		bspa.write_to(path);
+	} catch (std::exception const & e) {
+		// not only WriteException, lumps too large for the header and providers failing to generate their lump throw their own
+		std::cerr << e.what() << std::endl;
+		return false;
+	}
+	return true;
+}
+
 int main(int argc, char * * argv) {
 	
 	argagg::parser argp {{
@@ -48,8 +64,34 @@ int main(int argc, char * * argv) {
 		{ "ents",      { "-E", "--ents" }, "Print information about the entities", 0 },
 		{ "shaders",   { "-s", "--shaders" }, "Print the shaders used", 0 },
 		{ "shaders+",  { "-S", "--shaders-extra" }, "Print the shaders used plus extra information", 0 },
-		{ "reprocess", { "-r", "--reprocess" }, "Load the BSP and resave it", 0 },
-		{ "lmdump",    { "-L", "--lmdump" }, "Dump all lightmaps", 0 },	
+		{ "reprocess", { "-r", "--reprocess" }, "Load the BSP and resave it, to -o if specified", 0 },
+		{ "lmdump",    { "-L", "--lmdump" }, "Dump all lightmaps as lm_N files, one per thread at a time", 0 },	
+		{ "lmformat",  { "--lmformat" }, "With --lmdump, png (default), ppm, qoi, or atlas for a single lm_atlas.png with every lightmap in a grid", 1 },
+		{ "lmdir",     { "--lmdir" }, "With --lmdump, directory to write lightmaps into, created if missing (default is the current directory)", 1 },
+		{ "pnglevel",  { "--png-level" }, "With --lmdump, zlib compression level of PNG output from 0 to 9 (default 8), lower is faster", 1 },
+		{ "lmdedup",   { "--lmdedup" }, "Remove lightmaps identical to an earlier one and report the bytes saved, saved to -o if specified", 0 },
+		{ "lmcolor",   { "--lmcolor" }, "Rebalance the lightmaps and lightgrid with --overbright, --gamma, --saturation, and --tonemap and report the time taken, saved to -o if specified", 0 },
+		{ "overbright", { "--overbright" }, "With --lmcolor, bits to brighten by from -8 to 8, negative darkens (default 0)", 1 },
+		{ "gamma",     { "--gamma" }, "With --lmcolor, gamma to apply, above 1 brightens the shadows (default 1)", 1 },
+		{ "saturation", { "--saturation" }, "With --lmcolor, saturation multiplier, 0 for greyscale (default 1)", 1 },
+		{ "tonemap",   { "--tonemap" }, "With --lmcolor, clamp (default), normalize to scale down by the brightest channel, or reinhard", 1 },
+		{ "white",     { "--white" }, "With --lmcolor and --tonemap reinhard, the brightness that maps to full (default 2)", 1 },
+		{ "lmatlas",   { "--lmatlas" }, "Pack the lightmaps into atlas pages written as lm_NNNN.png with a lightmaps.txt remap table, page size from --size, and point surfaces at the pages, saved to -o which is required, parameter is the output directory; only renderers that load the pages from lightmaps.txt draw the result lightmapped", 1 },
+		{ "export",    { "--export" }, "Export the surfaces of every model as a mesh, parameter is the output path ending in .obj or .glb", 1 },
+		{ "compact",   { "--compact-verts" }, "Write the drawverts and drawindexes in the compact streaming vertex format and report the size saved, parameter is the output path", 1 },
+		{ "entbench",  { "--entbench" }, "Time the SIMD and scalar entity parsers against each other, parameter is the number of iterations", 1 },
+		{ "lumpbench", { "--lumpbench" }, "Time copying the larger lumps in and out of intermediate arrays, parameter is the number of iterations", 1 },
+		{ "tracebench", { "--tracebench" }, "Time line traces between random points within the world, parameter is the number of traces", 1 },
+		{ "visbench",  { "--visbench" }, "Time merging the PVS of 64 random clusters, parameter is the number of iterations", 1 },
+		{ "scenebench", { "--scenebench" }, "Time visible surface queries from random views within the world, parameter is the number of queries", 1 },
+		{ "tessellate", { "--tessellate" }, "Tessellate every patch and report the resulting mesh size and time, parameter is the maximum error in units", 1 },
+		{ "phs",       { "--phs" }, "Build the potentially hearable set and report its build time and memory, cached in --phs-cache if specified", 0 },
+		{ "phscache",  { "--phs-cache" }, "<path of PHS cache file>", 1 },
+		{ "optindices", { "--optimize-indices" }, "Reorder the drawindexes of every surface for the vertex cache and report the ACMR before and after, saved to -o if specified", 0 },
+		{ "overdraw",  { "--overdraw" }, "With --optimize-indices, also order triangles to reduce overdraw", 0 },
+		{ "gc",        { "--gc" }, "Remove shaders, planes, brushes, vertices, indices, and lightmaps nothing refers to any more and report the bytes reclaimed, saved to -o if specified", 0 },
+		{ "validate",  { "--validate" }, "Check every reference between lumps and list those out of bounds, exits with 1 if there are any", 0 },
+		{ "merge",     { "--merge-surfaces" }, "Merge surfaces drawn with the same shader, fog, and lightmaps from the same leafs and report the draw call reduction, saved to -o if specified", 0 },
 		
 		{ "shsurfs",   { "--shader-surfaces" }, "<shader>", 0 },
 		{ "remap",     { "--remap" }, "requires (--src or --idx), --dst, and -o to be specified", 0 },
@@ -61,6 +103,7 @@ int main(int argc, char * * argv) {
 		{ "rmsurf",    { "--rmsurf" }, "removes a surface (sets the vertex count to zero, does not permanently remove data), requires --idx and -o to be specified", 0 }, // TODO
 		
 		{ "output",    { "-o", "--output" }, "Output path for saving operations", 1 },
+		{ "threads",   { "-j", "--threads" }, "Number of threads to use, 0 for one per hardware thread (default)", 1 },
 		{ "src",       { "--src" }, "<source shader name>", 1 },
 		{ "dst",       { "--dst" }, "<dest shader name>", 1 },
 		{ "idx",       { "--idx" }, "<index>", 1 },
@@ -101,35 +144,19 @@ int main(int argc, char * * argv) {
 	else
 		output_path = bsp_path;
 	
-	auto fdr = open( bsp_path.c_str(), O_RDONLY );
-	
-	if (fdr == -1) {
-		std::cerr << "File not found!" << std::endl;
-		return 1;
-	}
-	
-	struct stat sb;
-	fstat(fdr, &sb);
+	size_t threads = 0;
+	if (args["threads"])
+		threads = args["threads"].as<size_t>();
 	
-	if (sb.st_size < (ssize_t)sizeof(BSP::Header)) {
-		std::cerr << "File too small to be a BSP file!" << std::endl;
-		return 1;
-	}
-
+	// output is written to a temporary file and renamed into place, so the mapping stays valid even when saving over the input
 	BSP::Reader bspr;
-	std::vector<uint8_t> rdat;
-	
-	if (!std::filesystem::equivalent(bsp_path, output_path))
-		bspr.rebase(reinterpret_cast<uint8_t const *> (mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fdr, 0)));
-	else {
-		rdat.resize(sb.st_size);
-		read(fdr, rdat.data(), sb.st_size);
-		close(fdr);
-		bspr.rebase(rdat.data());
-	}
+	std::optional<BSP::MappedFile> bspf;
 	
-	if (bspr.header().ident != BSP::IDENT) {
-		std::cerr << "File does not appear to be a BSP file!" << std::endl;
+	try {
+		bspf.emplace(bsp_path);
+		bspr = bspf->reader();
+	} catch (BSP::Reader::ReadException const & e) {
+		std::cerr << e.what() << std::endl;
 		return 1;
 	}
 	
@@ -143,7 +170,7 @@ int main(int argc, char * * argv) {
 		for (auto const & surf : bspr.surfaces()) surface_type_uage[surf.type]++;
 		
 		std::cout
-			<< sb.st_size << " byte BSP file" << std::endl
+			<< bspr.size() << " byte BSP file" << std::endl
 			<< bspr.entities().size() << " entity string bytes" << std::endl
 			
 			<< bspr.shaders().size() << " shaders"
@@ -260,7 +287,7 @@ int main(int argc, char * * argv) {
 		for (auto const & surf : bspr.surfaces()) surface_type_uage[surf.type]++;
 		
 		std::cout
-			<< sb.st_size << " byte BSP file" << std::endl
+			<< bspr.size() << " byte BSP file" << std::endl
 			<< bspr.entities().size() << " entity string bytes" << std::endl
 			
 			<< bspr.shaders().size() << " shaders"
@@ -409,24 +436,294 @@ int main(int argc, char * * argv) {
 		std::cout << ents.size() << " entities" << std::endl;
 		
 		size_t classless = 0;
-		std::map<meadow::istring_view, std::vector<BSP::Reader::Entity const *>> classnames;
+		std::map<meadow::istring_view, size_t> classnames;
 		for (auto const & ent : ents) {
-			auto iter = ent.find(meadow::istring_view("classname"));
-			if (iter == ent.end()) {
+			auto classname = ent.get("classname");
+			if (!classname) {
 				classless++;
 				continue;
 			} else {
-				classnames[iter->second].emplace_back(&ent);
+				classnames[*classname]++;
 			}
 		}
 		
 		std::cout << "classes:" << std::endl;
-		for (auto const & cl : classnames) std::cout << "    " << cl.first << ": " << cl.second.size() << std::endl;
+		for (auto const & cl : classnames) std::cout << "    " << cl.first << ": " << cl.second << std::endl;
 		if (classless) {
 			std::cout << "    " << classless << " classless entities" << std::endl;
 		}
 	}
 	
+	// ================================
+	// ENTBENCH
+	// ================================
+	
+	if (args["entbench"]) {
+		int iterations = args["entbench"].as<int>();
+		if (iterations < 1) iterations = 1;
+		
+		auto ent_str = bspr.entities();
+		
+		auto bench = [&](char const * name, auto parse){
+			size_t count = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < iterations; i++) count = parse(ent_str).size();
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+			double ms = elapsed.count() / iterations;
+			std::cout
+				<< name << ": " << count << " entities, "
+				<< std::fixed << std::setprecision(3) << ms << " ms per parse, "
+				<< std::setprecision(1) << (ent_str.size() / 1048576.0) / (ms / 1000.0) << " MiB/s"
+				<< std::defaultfloat << std::endl;
+		};
+		
+		std::cout << ent_str.size() << " entity string bytes, " << iterations << " iterations" << std::endl;
+		bench("simd  ", BSP::Reader::parse_entities);
+		bench("scalar", BSP::Reader::parse_entities_scalar);
+	}
+	
+	// ================================
+	// LUMPBENCH
+	// ================================
+	
+	if (args["lumpbench"]) {
+		int iterations = args["lumpbench"].as<int>();
+		if (iterations < 1) iterations = 1;
+		
+		auto bench = [&]<typename A>(char const * name, std::span<typename A::value_type const> in){
+			double mib = in.size_bytes() / 1048576.0;
+			
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < iterations; i++) A { in };
+			std::chrono::duration<double> construct = std::chrono::steady_clock::now() - start;
+			
+			A arr { in };
+			start = std::chrono::steady_clock::now();
+			for (int i = 0; i < iterations; i++) arr.serialize();
+			std::chrono::duration<double> serialize = std::chrono::steady_clock::now() - start;
+			
+			std::cout
+				<< name << ": " << in.size() << " elements (" << in.size_bytes() << " bytes), "
+				<< std::fixed << std::setprecision(1)
+				<< "construct " << mib * iterations / construct.count() << " MiB/s, "
+				<< "serialize " << mib * iterations / serialize.count() << " MiB/s"
+				<< std::defaultfloat << std::endl;
+		};
+		
+		bench.operator()<BSPI::VertexArray>("drawverts  ", bspr.drawverts());
+		bench.operator()<BSPI::IndexArray>("drawindexes", bspr.drawindices());
+		bench.operator()<BSPI::SurfaceArray>("surfaces   ", bspr.surfaces());
+		bench.operator()<BSPI::LightmapArray>("lightmaps  ", bspr.lightmaps());
+	}
+	
+	// ================================
+	// TRACEBENCH
+	// ================================
+	
+	if (args["tracebench"]) {
+		size_t count = args["tracebench"].as<size_t>();
+		
+		auto models = bspr.models();
+		if (models.empty()) {
+			std::cerr << "BSP has no world model to trace against" << std::endl;
+			return 1;
+		}
+		BSP::Model const & world = models[0];
+		
+		std::mt19937 rng { 0 };
+		std::uniform_real_distribution<float> dist[3] {
+			std::uniform_real_distribution<float> { world.mins[0], world.maxs[0] },
+			std::uniform_real_distribution<float> { world.mins[1], world.maxs[1] },
+			std::uniform_real_distribution<float> { world.mins[2], world.maxs[2] },
+		};
+		std::vector<BSP::TraceRay> rays (count);
+		for (auto & ray : rays) {
+			for (size_t i = 0; i < 3; i++) ray.start[i] = dist[i](rng);
+			for (size_t i = 0; i < 3; i++) ray.end[i] = dist[i](rng);
+		}
+		
+		auto start = std::chrono::steady_clock::now();
+		BSP::Tracer tracer { bspr };
+		std::chrono::duration<double, std::milli> setup = std::chrono::steady_clock::now() - start;
+		
+		std::vector<BSP::TraceResult> results (count);
+		start = std::chrono::steady_clock::now();
+		tracer.trace(rays, results, {}, {}, -1, threads);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		
+		size_t hits = std::count_if(results.begin(), results.end(), [](BSP::TraceResult const & r){ return r.fraction < 1; });
+		std::cout
+			<< count << " traces, " << hits << " hit, "
+			<< std::fixed << std::setprecision(3) << setup.count() << " ms setup, "
+			<< std::setprecision(0) << count / elapsed.count() << " traces/s"
+			<< std::defaultfloat << std::endl;
+	}
+	
+	// ================================
+	// VISBENCH
+	// ================================
+	
+	if (args["visbench"]) {
+		int iterations = args["visbench"].as<int>();
+		if (iterations < 1) iterations = 1;
+		
+		BSP::VisibilityTable vis { bspr };
+		if (!vis.clusters()) {
+			std::cerr << "BSP has no clusters" << std::endl;
+			return 1;
+		}
+		
+		std::mt19937 rng { 0 };
+		std::uniform_int_distribution<int32_t> dist { 0, static_cast<int32_t>(vis.clusters()) - 1 };
+		std::vector<int32_t> viewers (64 * iterations);
+		for (auto & viewer : viewers) viewer = dist(rng);
+		
+		BSP::ClusterSet merged;
+		size_t visible = 0, bits = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			vis.visible_from_any(std::span<int32_t const> { viewers }.subspan(64 * i, 64), merged);
+			merged.for_each([&](int32_t){ bits++; });
+			visible += merged.count();
+		}
+		std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+		
+		if (bits != visible) {
+			std::cerr << "cluster iteration and count disagree" << std::endl;
+			return 1;
+		}
+		std::cout
+			<< vis.clusters() << " clusters, " << iterations << " merges of 64 viewers, "
+			<< std::fixed << std::setprecision(1) << static_cast<double>(visible) / iterations << " visible on average, "
+			<< std::setprecision(3) << elapsed.count() / iterations << " us per merge and iteration"
+			<< std::defaultfloat << std::endl;
+	}
+	
+	// ================================
+	// SCENEBENCH
+	// ================================
+	
+	if (args["scenebench"]) {
+		size_t count = args["scenebench"].as<size_t>();
+		
+		auto models = bspr.models();
+		if (models.empty()) {
+			std::cerr << "BSP has no world model to query" << std::endl;
+			return 1;
+		}
+		BSP::Model const & world = models[0];
+		
+		auto start = std::chrono::steady_clock::now();
+		BSP::Scene scene { bspr };
+		std::chrono::duration<double, std::milli> setup = std::chrono::steady_clock::now() - start;
+		
+		std::mt19937 rng { 0 };
+		std::uniform_real_distribution<float> dist[3] {
+			std::uniform_real_distribution<float> { world.mins[0], world.maxs[0] },
+			std::uniform_real_distribution<float> { world.mins[1], world.maxs[1] },
+			std::uniform_real_distribution<float> { world.mins[2], world.maxs[2] },
+		};
+		std::uniform_real_distribution<float> yaw { 0, 6.2831853f };
+		
+		struct View { BSP::vec3_t origin; BSP::Frustum frustum; };
+		std::vector<View> views (count);
+		for (auto & view : views) {
+			view.origin = { dist[0](rng), dist[1](rng), dist[2](rng) };
+			float y = yaw(rng);
+			view.frustum = BSP::Frustum::from_view(view.origin, { std::cos(y), std::sin(y), 0 }, { 0, 0, 1 }, 90, 73.74f);
+		}
+		
+		BSP::Scene::Query query;
+		size_t surfaces = 0;
+		start = std::chrono::steady_clock::now();
+		for (auto const & view : views) surfaces += scene.visible_surfaces(view.origin, view.frustum, query).size();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		
+		std::cout
+			<< count << " queries, "
+			<< std::fixed << std::setprecision(1) << static_cast<double>(surfaces) / std::max<size_t>(count, 1) << " surfaces visible on average, "
+			<< std::setprecision(3) << setup.count() << " ms setup, "
+			<< std::setprecision(0) << count / elapsed.count() << " queries/s"
+			<< std::defaultfloat << std::endl;
+	}
+	
+	// ================================
+	// TESSELLATE
+	// ================================
+	
+	if (args["tessellate"]) {
+		BSP::PatchOptions opts;
+		opts.max_error = args["tessellate"].as<float>();
+		
+		BSP::PatchMesh mesh;
+		auto start = std::chrono::steady_clock::now();
+		try {
+			mesh = BSP::tessellate_patches(bspr, opts, threads);
+		} catch (std::out_of_range const & e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		
+		size_t control_points = 0;
+		for (auto const & patch : mesh.patches) {
+			BSP::Surface const & surface = bspr.surfaces()[patch.surface];
+			control_points += surface.patch_width * surface.patch_height;
+		}
+		
+		std::cout
+			<< mesh.patches.size() << " patches, "
+			<< control_points << " control points, "
+			<< mesh.verts.size() << " vertices, "
+			<< mesh.indices.size() / 3 << " triangles, "
+			<< std::fixed << std::setprecision(3) << elapsed.count() << " ms"
+			<< std::defaultfloat << std::endl;
+	}
+	
+	// ================================
+	// PHS
+	// ================================
+	
+	if (args["phs"]) {
+		auto start = std::chrono::steady_clock::now();
+		BSP::VisibilityTable pvs { bspr };
+		std::chrono::duration<double, std::milli> decode = std::chrono::steady_clock::now() - start;
+		
+		std::string cache_path;
+		BSP::VisibilityTable::CacheKey cache_key;
+		if (args["phscache"]) {
+			cache_path = args["phscache"].as<std::string>();
+			cache_key = BSP::VisibilityTable::source_key(bspr, BSP::VisibilityTable::Kind::PHS);
+		}
+		
+		start = std::chrono::steady_clock::now();
+		std::optional<BSP::VisibilityTable> phs;
+		if (!cache_path.empty()) phs = BSP::VisibilityTable::load(cache_path, cache_key);
+		bool cached = phs.has_value();
+		if (!cached) phs = pvs.phs(threads);
+		std::chrono::duration<double, std::milli> build = std::chrono::steady_clock::now() - start;
+		
+		if (!cached && !cache_path.empty() && !phs->save(cache_path, cache_key))
+			std::cerr << "failed to write PHS cache \"" << cache_path << "\"" << std::endl;
+		
+		size_t pvs_total = 0, phs_total = 0;
+		for (size_t c = 0; c < pvs.clusters(); c++) {
+			pvs_total += pvs.pvs(c).count();
+			phs_total += phs->pvs(c).count();
+		}
+		double clusters = std::max<size_t>(pvs.clusters(), 1);
+		
+		std::cout
+			<< pvs.clusters() << " clusters" << std::endl
+			<< std::fixed << std::setprecision(3)
+			<< "PVS: decoded in " << decode.count() << " ms, " << pvs.memory() << " bytes, "
+			<< std::setprecision(1) << pvs_total / clusters << " visible per cluster on average" << std::endl
+			<< std::setprecision(3)
+			<< "PHS: " << (cached ? "loaded from cache" : "built") << " in " << build.count() << " ms, " << phs->memory() << " bytes, "
+			<< std::setprecision(1) << phs_total / clusters << " hearable per cluster on average"
+			<< std::defaultfloat << std::endl;
+	}
+	
 	// ================================
 	// SHADERS
 	// ================================
@@ -482,15 +779,234 @@ int main(int argc, char * * argv) {
 	if (args["reprocess"]) {
 		BSP::LumpProviderPtr pprov = std::make_shared<BSP::BSPReaderLumpProvider>(bspr);
 		BSP::Assembler bspa { pprov };
-		auto bytes = bspa.assemble();
+		if (!write_bsp(bspa, output_path, threads)) return 1;
+	}
+	
+	// ================================
+	// EXPORT
+	// ================================
+	
+	if (args["export"]) {
+		std::string export_path = args["export"].as<std::string>();
+		
+		BSP::MeshFormat format;
+		if (export_path.ends_with(".obj"))
+			format = BSP::MeshFormat::OBJ;
+		else if (export_path.ends_with(".glb"))
+			format = BSP::MeshFormat::GLB;
+		else {
+			std::cerr << "unknown export format for \"" << export_path << "\", expected .obj or .glb" << std::endl;
+			return 1;
+		}
+		
+		std::ofstream out { export_path, std::ios::binary };
+		if (!out) {
+			std::cerr << "could not open \"" << export_path << "\" for writing" << std::endl;
+			return 1;
+		}
+		
+		BSP::MeshExportOptions opts;
+		opts.threads = threads;
+		BSP::MeshExportStats stats;
+		auto start = std::chrono::steady_clock::now();
+		try {
+			stats = BSP::export_mesh(bspr, out, format, opts);
+		} catch (std::exception const & e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		out.close();
+		if (!out) {
+			std::cerr << "failed to write \"" << export_path << "\"" << std::endl;
+			return 1;
+		}
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		
+		std::cout
+			<< stats.chunks << " chunks, "
+			<< stats.verts << " vertices, "
+			<< stats.triangles << " triangles, "
+			<< stats.bytes << " bytes, "
+			<< std::fixed << std::setprecision(3) << elapsed.count() << " ms"
+			<< std::defaultfloat << std::endl;
+	}
+	
+	// ================================
+	// OPTIMIZE INDICES
+	// ================================
+	
+	if (args["optindices"]) {
+		BSPI::SurfaceArray surfaces { bspr.surfaces() };
+		BSPI::VertexArray vertices { bspr.drawverts() };
+		auto indices = std::make_shared<BSPI::IndexArray>(bspr.drawindices());
+		
+		BSP::IndexOptimizeOptions opts;
+		opts.overdraw = args["overdraw"];
+		opts.threads = threads;
+		BSP::IndexOptimizeReport report;
+		auto start = std::chrono::steady_clock::now();
+		try {
+			report = BSP::optimize_indices(surfaces, vertices, *indices, opts);
+		} catch (std::out_of_range const & e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		
+		std::cout
+			<< report.surfaces << " surfaces, "
+			<< report.skipped << " skipped, "
+			<< report.triangles << " triangles, "
+			<< std::fixed << std::setprecision(3) << "ACMR " << report.acmr_before() << " -> " << report.acmr_after() << ", "
+			<< elapsed.count() << " ms"
+			<< std::defaultfloat << std::endl;
+		
+		BSP::LumpProviderPtr pprov = std::make_shared<BSP::BSPReaderLumpProvider>(bspr);
+		BSP::Assembler bspa { pprov };
+		bspa[BSP::LumpIndex::DRAWINDEXES] = std::make_shared<BSP::BSPIIndexArrayLumpProvider>(indices);
+		if (!write_bsp(bspa, output_path, threads)) return 1;
+	}
+	
+	// ================================
+	// MERGE SURFACES
+	// ================================
+	
+	if (args["merge"]) {
+		auto surfaces = std::make_shared<BSPI::SurfaceArray>(bspr.surfaces());
+		auto vertices = std::make_shared<BSPI::VertexArray>(bspr.drawverts());
+		auto indices = std::make_shared<BSPI::IndexArray>(bspr.drawindices());
+		auto leafs = std::make_shared<BSPI::LeafArray>(bspr.leafs());
+		auto leaf_surfaces = std::make_shared<BSPI::LeafSurfaceArray>(bspr.leafsurfaces());
+		auto models = std::make_shared<BSPI::ModelArray>(bspr.models());
+		auto brush_sides = std::make_shared<BSPI::BrushSideArray>(bspr.brushsides());
+		
+		BSP::SurfaceMergeReport report;
+		auto start = std::chrono::steady_clock::now();
+		try {
+			report = BSP::merge_surfaces(*surfaces, *vertices, *indices, *leafs, *leaf_surfaces, *models, *brush_sides);
+		} catch (std::out_of_range const & e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		
+		std::cout
+			<< report.surfaces_before << " -> " << report.surfaces_after << " surfaces ("
+			<< std::fixed << std::setprecision(1) << report.reduction() * 100 << "% fewer), "
+			<< report.groups << " merged, "
+			<< report.leaf_refs_before << " -> " << report.leaf_refs_after << " leaf draws ("
+			<< report.leaf_reduction() * 100 << "% fewer), "
+			<< std::setprecision(3) << elapsed.count() << " ms"
+			<< std::defaultfloat << std::endl;
+		
+		BSP::LumpProviderPtr pprov = std::make_shared<BSP::BSPReaderLumpProvider>(bspr);
+		BSP::Assembler bspa { pprov };
+		bspa[BSP::LumpIndex::SURFACES] = std::make_shared<BSP::BSPISurfaceArrayLumpProvider>(surfaces);
+		bspa[BSP::LumpIndex::DRAWVERTS] = std::make_shared<BSP::BSPIVertexArrayLumpProvider>(vertices);
+		bspa[BSP::LumpIndex::DRAWINDEXES] = std::make_shared<BSP::BSPIIndexArrayLumpProvider>(indices);
+		bspa[BSP::LumpIndex::LEAFS] = std::make_shared<BSP::BSPILeafArrayLumpProvider>(leafs);
+		bspa[BSP::LumpIndex::LEAFSURFACES] = std::make_shared<BSP::BSPILeafSurfacesArrayLumpProvider>(leaf_surfaces);
+		bspa[BSP::LumpIndex::MODELS] = std::make_shared<BSP::BSPIModelArrayLumpProvider>(models);
+		bspa[BSP::LumpIndex::BRUSHSIDES] = std::make_shared<BSP::BSPIBrushSidesArrayLumpProvider>(brush_sides);
+		if (!write_bsp(bspa, output_path, threads)) return 1;
+	}
+	
+	// ================================
+	// COMPACT VERTICES
+	// ================================
+	
+	if (args["compact"]) {
+		std::string compact_path = args["compact"].as<std::string>();
+		std::ofstream out { compact_path, std::ios::binary };
+		if (!out) {
+			std::cerr << "could not open \"" << compact_path << "\" for writing" << std::endl;
+			return 1;
+		}
 		
-		std::ofstream f { (std::string) args["reprocess"][0], std::ios_base::binary | std::ios_base::out };
-		if (!f.good()) {
-			// TODO error
+		BSP::CompactVertexOptions opts;
+		opts.threads = threads;
+		BSP::CompactVertexReport report;
+		auto start = std::chrono::steady_clock::now();
+		try {
+			report = BSP::export_compact_vertices(bspr, out, opts);
+		} catch (std::exception const & e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		out.close();
+		if (!out) {
+			std::cerr << "failed to write \"" << compact_path << "\"" << std::endl;
 			return 1;
 		}
-		f.write( reinterpret_cast<char const *>(bytes.data()), bytes.size());
-		f.close();
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		
+		std::cout << report.source_verts << " source vertices, " << report.verts << " written (";
+		for (size_t k = 0; k < BSP::LIGHTSTYLES; k++)
+			std::cout << (k ? ", " : "") << report.stream_verts[k] << " with " << k + 1 << (k ? " styles" : " style");
+		std::cout << ")" << std::endl;
+		std::cout
+			<< report.source_bytes << " -> " << report.bytes << " bytes ("
+			<< std::fixed << std::setprecision(1) << report.ratio() * 100 << "%): "
+			<< report.vertex_bytes << " vertex, "
+			<< report.index_bytes << " index, "
+			<< report.table_bytes << " table" << std::endl
+			<< std::defaultfloat << std::setprecision(3)
+			<< "max error: " << report.max_uv_error << " uv, "
+			<< report.max_lightmap_error << " lightmap uv, "
+			<< report.max_normal_error << " degrees normal, "
+			<< std::fixed << elapsed.count() << " ms"
+			<< std::defaultfloat << std::setprecision(6) << std::endl;
+	}
+	
+	// ================================
+	// VALIDATE
+	// ================================
+	
+	if (args["validate"]) {
+		BSP::ValidationOptions opts;
+		opts.threads = threads;
+		
+		auto start = std::chrono::steady_clock::now();
+		BSP::ValidationReport report = BSP::validate(bspr, opts);
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		
+		for (BSP::Diagnostic const & d : report.diagnostics)
+			std::cout << lump_names[static_cast<size_t>(d.lump)] << " " << d.element << ": " << d.message << " (" << lump_names[static_cast<size_t>(d.target)] << ")" << std::endl;
+		if (report.count > report.diagnostics.size())
+			std::cout << "... and " << report.count - report.diagnostics.size() << " more" << std::endl;
+		std::cout << report.count << " problems found, " << std::fixed << std::setprecision(3) << elapsed.count() << " ms" << std::defaultfloat << std::endl;
+		if (!report.ok()) return 1;
+	}
+	
+	// ================================
+	// GARBAGE COLLECTION
+	// ================================
+	
+	if (args["gc"]) {
+		BSPI::IndexedLumps lumps { bspr };
+		BSP::GarbageOptions opts;
+		opts.deluxe = bspr.deluxe_mapped();
+		BSP::GarbageReport report;
+		auto start = std::chrono::steady_clock::now();
+		try {
+			report = BSP::collect_garbage(lumps, opts);
+		} catch (std::logic_error const & e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		
+		for (size_t i = 0; i < 18; i++) {
+			size_t removed = report.removed(static_cast<BSP::LumpIndex>(i));
+			if (removed) std::cout << removed << " of " << report.before[i] << " " << lump_names[i] << " removed"
+				<< (opts.deluxe && i == static_cast<size_t>(BSP::LumpIndex::LIGHTMAPS) ? " as light and deluxe pairs" : "") << std::endl;
+		}
+		std::cout << report.bytes << " bytes reclaimed, " << std::fixed << std::setprecision(3) << elapsed.count() << " ms" << std::defaultfloat << std::endl;
+		
+		BSP::LumpProviderPtr pprov = std::make_shared<BSP::BSPReaderLumpProvider>(bspr);
+		BSP::Assembler bspa { pprov };
+		bspa.provide(std::move(lumps));
+		if (!write_bsp(bspa, output_path, threads)) return 1;
 	}
 	
 	// ================================
@@ -498,14 +1014,224 @@ int main(int argc, char * * argv) {
 	// ================================
 	
 	if (args["lmdump"]) {
-		for (size_t i = 0; i < bspr.lightmaps().size(); i++) {
-			auto const & lm = bspr.lightmaps()[i];
-			std::stringstream ss;
-			ss << "lm_";
-			ss << i;
-			ss << ".png";
-			stbi_write_png(ss.str().data(), 128, 128, 3, &lm.pixels[0], 3 * 128);
+		std::string format = args["lmformat"] ? args["lmformat"].as<std::string>() : "png";
+		if (format != "png" && format != "ppm" && format != "qoi" && format != "atlas") {
+			std::cerr << "unknown lightmap format " << format << ", expected png, ppm, qoi, or atlas" << std::endl;
+			return 1;
+		}
+		
+		std::filesystem::path dir = args["lmdir"] ? args["lmdir"].as<std::string>() : ".";
+		std::error_code ec;
+		std::filesystem::create_directories(dir, ec);
+		if (ec) {
+			std::cerr << "could not create " << dir << ": " << ec.message() << std::endl;
+			return 1;
+		}
+		
+		// set once before any thread writes, stb reads it for every image
+		if (args["pnglevel"]) stbi_write_png_compression_level = std::clamp(args["pnglevel"].as<int>(), 0, 9);
+		
+		auto lightmaps = bspr.lightmaps();
+		std::atomic_bool failed { false };
+		auto start = std::chrono::steady_clock::now();
+		
+		if (format == "atlas") {
+			// every lightmap in a grid as square as the count allows, lightmap i at column i % columns and row i / columns
+			size_t columns = std::max<size_t>(1, std::ceil(std::sqrt(lightmaps.size())));
+			size_t rows = (lightmaps.size() + columns - 1) / columns;
+			size_t width = columns * BSP::LIGHTMAP_DIM, height = rows * BSP::LIGHTMAP_DIM;
+			std::vector<BSP::Color> pixels (width * height, BSP::Color {});
+			BSP::parallel_for(lightmaps.size(), threads, [&](size_t i){
+				BSP::Color * dst = &pixels[(i / columns) * BSP::LIGHTMAP_DIM * width + (i % columns) * BSP::LIGHTMAP_DIM];
+				for (size_t row = 0; row < BSP::LIGHTMAP_DIM; row++)
+					std::memcpy(dst + row * width, lightmaps[i].pixels[row], sizeof(lightmaps[i].pixels[row]));
+			});
+			std::string path = (dir / "lm_atlas.png").string();
+			if (!lightmaps.empty() && !stbi_write_png(path.data(), width, height, 3, pixels.data(), 3 * width)) failed = true;
+		} else {
+			BSP::parallel_for(lightmaps.size(), threads, [&](size_t i){
+				char name[32];
+				std::snprintf(name, sizeof(name), "lm_%zu.%s", i, format.data());
+				std::string path = (dir / name).string();
+				auto const & lm = lightmaps[i];
+				
+				if (format == "png") {
+					if (!stbi_write_png(path.data(), BSP::LIGHTMAP_DIM, BSP::LIGHTMAP_DIM, 3, &lm.pixels[0], 3 * BSP::LIGHTMAP_DIM)) failed = true;
+					return;
+				}
+				
+				std::span<BSP::Color const> pixels { &lm.pixels[0][0], BSP::LIGHTMAP_PIXELS };
+				std::vector<uint8_t> data = format == "qoi"
+					? BSP::encode_qoi(BSP::LIGHTMAP_DIM, BSP::LIGHTMAP_DIM, pixels)
+					: BSP::encode_ppm(BSP::LIGHTMAP_DIM, BSP::LIGHTMAP_DIM, pixels);
+				std::ofstream out { path, std::ios::binary };
+				out.write(reinterpret_cast<char const *>(data.data()), data.size());
+				if (!out) failed = true;
+			});
+		}
+		
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		if (failed) {
+			std::cerr << "failed to write lightmaps to " << dir << std::endl;
+			return 1;
+		}
+		std::cout << lightmaps.size() << " lightmaps written to " << dir.string() << ", "
+			<< std::fixed << std::setprecision(3) << elapsed.count() << " ms" << std::defaultfloat << std::endl;
+	}
+	
+	// ================================
+	// LMDEDUP
+	// ================================
+	
+	if (args["lmdedup"]) {
+		auto lightmaps = std::make_shared<BSPI::LightmapArray>(bspr.lightmaps());
+		auto surfaces = std::make_shared<BSPI::SurfaceArray>(bspr.surfaces());
+		
+		BSP::LightmapDedupOptions opts;
+		opts.deluxe = bspr.deluxe_mapped();
+		opts.threads = threads;
+		
+		BSP::LightmapDedupReport report;
+		auto start = std::chrono::steady_clock::now();
+		try {
+			report = BSP::dedup_lightmaps(*lightmaps, *surfaces, opts);
+		} catch (std::exception const & e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		
+		std::cout
+			<< report.removed() << " of " << report.before << " lightmaps removed" << (opts.deluxe ? " as light and deluxe pairs, " : ", ")
+			<< report.uniform << " of those left are a single color, "
+			<< report.bytes << " bytes saved, "
+			<< std::fixed << std::setprecision(3) << elapsed.count() << " ms" << std::defaultfloat << std::endl;
+		
+		BSP::LumpProviderPtr pprov = std::make_shared<BSP::BSPReaderLumpProvider>(bspr);
+		BSP::Assembler bspa { pprov };
+		bspa[BSP::LumpIndex::LIGHTMAPS] = std::make_shared<BSP::BSPILightmapArrayLumpProvider>(lightmaps);
+		bspa[BSP::LumpIndex::SURFACES] = std::make_shared<BSP::BSPISurfaceArrayLumpProvider>(surfaces);
+		if (!write_bsp(bspa, output_path, threads)) return 1;
+	}
+	
+	// ================================
+	// LMCOLOR
+	// ================================
+	
+	if (args["lmcolor"]) {
+		BSP::ColorTransform xf;
+		if (args["overbright"]) xf.overbright_bits = args["overbright"].as<int32_t>();
+		if (args["gamma"]) xf.gamma = args["gamma"].as<float>();
+		if (args["saturation"]) xf.saturation = args["saturation"].as<float>();
+		if (args["white"]) xf.white = args["white"].as<float>();
+		if (args["tonemap"]) {
+			std::string tonemap = args["tonemap"].as<std::string>();
+			if (tonemap == "clamp") xf.tonemap = BSP::Tonemap::CLAMP;
+			else if (tonemap == "normalize") xf.tonemap = BSP::Tonemap::NORMALIZE;
+			else if (tonemap == "reinhard") xf.tonemap = BSP::Tonemap::REINHARD;
+			else {
+				std::cerr << "unknown tonemap \"" << tonemap << "\", expected clamp, normalize, or reinhard" << std::endl;
+				return 1;
+			}
+		}
+		
+		auto lightmaps = std::make_shared<BSPI::LightmapArray>(bspr.lightmaps());
+		auto lightgrid = std::make_shared<BSPI::LightgridArray>(bspr.lightgrids());
+		
+		bool const deluxe = bspr.deluxe_mapped();
+		
+		auto start = std::chrono::steady_clock::now();
+		try {
+			BSP::transform_lightmaps(*lightmaps, xf, threads, deluxe);
+			BSP::transform_lightgrid(*lightgrid, xf, threads);
+		} catch (std::invalid_argument const & e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		
+		std::cout
+			<< (deluxe ? lightmaps->size() / 2 : lightmaps->size()) << (deluxe ? " light maps of deluxe pairs" : " lightmaps")
+			<< " and " << lightgrid->size() << " lightgrid cells transformed"
+			<< (xf.per_channel() ? " through a lookup table, " : ", ")
+			<< std::fixed << std::setprecision(3) << elapsed.count() << " ms" << std::defaultfloat << std::endl;
+		
+		BSP::LumpProviderPtr pprov = std::make_shared<BSP::BSPReaderLumpProvider>(bspr);
+		BSP::Assembler bspa { pprov };
+		bspa[BSP::LumpIndex::LIGHTMAPS] = std::make_shared<BSP::BSPILightmapArrayLumpProvider>(lightmaps);
+		bspa[BSP::LumpIndex::LIGHTGRID] = std::make_shared<BSP::BSPILightgridArrayLumpProvider>(lightgrid);
+		if (!write_bsp(bspa, output_path, threads)) return 1;
+	}
+	
+	// ================================
+	// LMATLAS
+	// ================================
+	
+	if (args["lmatlas"]) {
+		std::filesystem::path dir = args["lmatlas"].as<std::string>();
+		
+		// the lightmaps lump is emptied, so this never writes over the map it read them from
+		std::error_code same_ec;
+		if (!args["output"] || std::filesystem::equivalent(output_path, bsp_path, same_ec)) {
+			std::cerr << "--lmatlas empties the lightmaps lump, -o must be given and differ from the input" << std::endl;
+			return 1;
+		}
+		
+		BSP::LightmapAtlasOptions opts;
+		opts.threads = threads;
+		opts.deluxe = bspr.deluxe_mapped();
+		if (args["size"]) opts.size = args["size"].as<uint32_t>();
+		
+		auto surfaces = std::make_shared<BSPI::SurfaceArray>(bspr.surfaces());
+		auto vertices = std::make_shared<BSPI::VertexArray>(bspr.drawverts());
+		
+		BSP::LightmapAtlas atlas;
+		auto start = std::chrono::steady_clock::now();
+		try {
+			atlas = BSP::pack_lightmaps(bspr.lightmaps(), opts);
+			BSP::apply_lightmap_atlas(atlas, *surfaces, *vertices, threads);
+		} catch (std::exception const & e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
 		}
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		
+		std::error_code ec;
+		std::filesystem::create_directories(dir, ec);
+		if (ec) {
+			std::cerr << "could not create " << dir << ": " << ec.message() << std::endl;
+			return 1;
+		}
+		
+		std::vector<std::string> page_paths (atlas.pages.size());
+		for (size_t p = 0; p < atlas.pages.size(); p++) {
+			char name[32];
+			std::snprintf(name, sizeof(name), "lm_%04zu.png", p);
+			page_paths[p] = (dir / name).string();
+		}
+		std::atomic_bool failed { false };
+		BSP::parallel_for(atlas.pages.size(), threads, [&](size_t p){
+			BSP::AtlasPage const & page = atlas.pages[p];
+			if (!stbi_write_png(page_paths[p].data(), page.size, page.size, 3, page.pixels.data(), 3 * page.size)) failed = true;
+		});
+		
+		std::ofstream table { dir / "lightmaps.txt" };
+		for (size_t i = 0; i < atlas.placements.size(); i++)
+			table << i << " " << atlas.placements[i].page << " " << atlas.placements[i].x << " " << atlas.placements[i].y << "\n";
+		if (failed || !table) {
+			std::cerr << "failed to write the atlas to " << dir << std::endl;
+			return 1;
+		}
+		
+		std::cout << atlas.placements.size() << " lightmaps packed into " << atlas.pages.size() << " pages" << (atlas.deluxe ? " as light and deluxe pairs" : "") << ", "
+			<< std::fixed << std::setprecision(3) << elapsed.count() << " ms" << std::defaultfloat << std::endl;
+		
+		BSP::LumpProviderPtr pprov = std::make_shared<BSP::BSPReaderLumpProvider>(bspr);
+		BSP::Assembler bspa { pprov };
+		bspa[BSP::LumpIndex::SURFACES] = std::make_shared<BSP::BSPISurfaceArrayLumpProvider>(surfaces);
+		bspa[BSP::LumpIndex::DRAWVERTS] = std::make_shared<BSP::BSPIVertexArrayLumpProvider>(vertices);
+		bspa[BSP::LumpIndex::LIGHTMAPS] = std::make_shared<BSP::BSPILightmapArrayLumpProvider>(std::make_shared<BSPI::LightmapArray>());
+		if (!write_bsp(bspa, output_path, threads)) return 1;
 	}
 	
 	// ================================
@@ -567,8 +1293,8 @@ int main(int argc, char * * argv) {
 			
 		} else {
 			
-			std::shared_ptr<BSPI::SurfaceArray> surfaces = std::make_shared<BSPI::SurfaceArray>(bspr.surfaces());
-			bspa[BSP::LumpIndex::SURFACES] = std::make_shared<BSP::BSPISurfaceArrayLumpProvider>(surfaces);
+			auto surfaces = std::make_shared<BSPI::CowSurfaceArray>(bspr.surfaces());
+			bspa[BSP::LumpIndex::SURFACES] = std::make_shared<BSP::BSPICowSurfaceArrayLumpProvider>(surfaces);
 			
 			int32_t shdst = add_shader(*shaders, dst);
 			
@@ -577,18 +1303,10 @@ int main(int argc, char * * argv) {
 				return 1;
 			}
 			
-			surfaces->at(idx).shader = shdst;
+			surfaces->edit(idx).shader = shdst;
 		}
 		
-		auto bytes = bspa.assemble();
-		
-		std::ofstream fout { output_path, std::ios_base::binary | std::ios_base::out };
-		if (!fout.good()) {
-			std::cerr << "failed to open output for writing" << std::endl;
-			return 1;
-		}
-		fout.write( reinterpret_cast<char const *>(bytes.data()), bytes.size());
-		fout.close();
+		if (!write_bsp(bspa, output_path, threads)) return 1;
 	}
 	
 	// ================================
@@ -602,40 +1320,31 @@ int main(int argc, char * * argv) {
 		
 		BSP::LumpProviderPtr pprov = std::make_shared<BSP::BSPReaderLumpProvider>(bspr);
 		BSP::Assembler bspa { pprov };
-		std::shared_ptr<BSPI::VertexArray> vertices = std::make_shared<BSPI::VertexArray>(bspr.drawverts());
-		bspa[BSP::LumpIndex::DRAWVERTS] = std::make_shared<BSP::BSPIVertexArrayLumpProvider>(vertices);
+		auto vertices = std::make_shared<BSPI::CowVertexArray>(bspr.drawverts());
+		bspa[BSP::LumpIndex::DRAWVERTS] = std::make_shared<BSP::BSPICowVertexArrayLumpProvider>(vertices);
 		
 		auto const & surf = bspr.surfaces()[idx];
 		
 		std::array<float, 2> uv_min, uv_max;
 		
-		BSPI::VertexArray::value_type * vert = &vertices->at(surf.vert_idx);
-		uv_max[0] = uv_min[0] = vert->uv[0];
-		uv_max[1] = uv_min[1] = vert->uv[1];
-		vert++;
-		for (int32_t i = 1; i < surf.vert_count; i++, vert++) {
-			if      (vert->uv[0] < uv_min[0]) uv_min[0] = vert->uv[0];
-			else if (vert->uv[0] > uv_max[0]) uv_max[0] = vert->uv[0];
-			if      (vert->uv[1] < uv_min[1]) uv_min[1] = vert->uv[1];
-			else if (vert->uv[1] > uv_max[1]) uv_max[1] = vert->uv[1];
+		uv_max[0] = uv_min[0] = vertices->at(surf.vert_idx).uv[0];
+		uv_max[1] = uv_min[1] = vertices->at(surf.vert_idx).uv[1];
+		for (int32_t i = 1; i < surf.vert_count; i++) {
+			auto const & vert = vertices->at(surf.vert_idx + i);
+			if      (vert.uv[0] < uv_min[0]) uv_min[0] = vert.uv[0];
+			else if (vert.uv[0] > uv_max[0]) uv_max[0] = vert.uv[0];
+			if      (vert.uv[1] < uv_min[1]) uv_min[1] = vert.uv[1];
+			else if (vert.uv[1] > uv_max[1]) uv_max[1] = vert.uv[1];
 		}
 		
 		std::array<float, 2> diff = { uv_max[0] - uv_min[0], uv_max[1] - uv_min[1] };
-		vert = &vertices->at(surf.vert_idx);
-		for (int32_t i = 0; i < surf.vert_count; i++, vert++) {
-			vert->uv[0] = (vert->uv[0] - uv_min[0]) / diff[0];
-			vert->uv[1] = (vert->uv[1] - uv_min[1]) / diff[1];
+		for (int32_t i = 0; i < surf.vert_count; i++) {
+			auto & vert = vertices->edit(surf.vert_idx + i);
+			vert.uv[0] = (vert.uv[0] - uv_min[0]) / diff[0];
+			vert.uv[1] = (vert.uv[1] - uv_min[1]) / diff[1];
 		}
 		
-		auto bytes = bspa.assemble();
-		
-		std::ofstream fout { output_path, std::ios_base::binary | std::ios_base::out };
-		if (!fout.good()) {
-			std::cerr << "failed to open output for writing" << std::endl;
-			return 1;
-		}
-		fout.write( reinterpret_cast<char const *>(bytes.data()), bytes.size());
-		fout.close();
+		if (!write_bsp(bspa, output_path, threads)) return 1;
 	}
 	
 	// ================================
@@ -662,63 +1371,61 @@ int main(int argc, char * * argv) {
 		BSP::LumpProviderPtr pprov = std::make_shared<BSP::BSPReaderLumpProvider>(bspr);
 		BSP::Assembler bspa { pprov };
 		auto shaders = std::make_shared<BSPI::ShaderArray>(bspr.shaders());
-		auto surfaces = std::make_shared<BSPI::SurfaceArray>(bspr.surfaces());
-		auto brushsides = std::make_shared<BSPI::BrushSideArray>(bspr.brushsides());
-		auto vertices = std::make_shared<BSPI::VertexArray>(bspr.drawverts());
-		auto lightmaps = std::make_shared<BSPI::LightmapArray>(bspr.lightmaps());
+		auto surfaces = std::make_shared<BSPI::CowSurfaceArray>(bspr.surfaces());
+		auto brushsides = std::make_shared<BSPI::CowBrushSideArray>(bspr.brushsides());
+		auto vertices = std::make_shared<BSPI::CowVertexArray>(bspr.drawverts());
+		auto lightmaps = std::make_shared<BSPI::CowLightmapArray>(bspr.lightmaps());
 		bspa[BSP::LumpIndex::SHADERS] = std::make_shared<BSP::BSPIShaderArrayLumpProvider>(shaders);
-		bspa[BSP::LumpIndex::SURFACES] = std::make_shared<BSP::BSPISurfaceArrayLumpProvider>(surfaces);
-		bspa[BSP::LumpIndex::BRUSHSIDES] = std::make_shared<BSP::BSPIBrushSidesArrayLumpProvider>(brushsides);
-		bspa[BSP::LumpIndex::DRAWVERTS] = std::make_shared<BSP::BSPIVertexArrayLumpProvider>(vertices);
-		bspa[BSP::LumpIndex::LIGHTMAPS] = std::make_shared<BSP::BSPILightmapArrayLumpProvider>(lightmaps);
+		bspa[BSP::LumpIndex::SURFACES] = std::make_shared<BSP::BSPICowSurfaceArrayLumpProvider>(surfaces);
+		bspa[BSP::LumpIndex::BRUSHSIDES] = std::make_shared<BSP::BSPICowBrushSideArrayLumpProvider>(brushsides);
+		bspa[BSP::LumpIndex::DRAWVERTS] = std::make_shared<BSP::BSPICowVertexArrayLumpProvider>(vertices);
+		bspa[BSP::LumpIndex::LIGHTMAPS] = std::make_shared<BSP::BSPICowLightmapArrayLumpProvider>(lightmaps);
 		
-		auto & surf = surfaces->at(idx);
+		auto & surf = surfaces->edit(idx);
 		surf.shader = add_shader(*shaders, "textures/colors/white2");
 		
-		for (auto & bs : *brushsides) {
-			if (bs.surface == idx) {
-				bs.shader = surf.shader;
+		for (size_t i = 0; i < brushsides->size(); i++) {
+			if ((*brushsides)[i].surface == idx) {
+				brushsides->edit(i).shader = surf.shader;
 				break;
 			}
 		}
 		
-		BSPI::VertexArray::value_type * vert;
 		std::array<float, 2> uv_min, uv_max, diff;
 		
 		while (true) {
 			
-			BSPI::VertexArray::value_type * vert = &vertices->at(surf.vert_idx);
-			uv_max[0] = uv_min[0] = vert->lightmap[0][0];
-			uv_max[1] = uv_min[1] = vert->lightmap[0][1];
-			vert++;
-			for (int32_t i = 1; i < surf.vert_count; i++, vert++) {
-				if      (vert->lightmap[0][0] < uv_min[0]) uv_min[0] = vert->lightmap[0][0];
-				else if (vert->lightmap[0][0] > uv_max[0]) uv_max[0] = vert->lightmap[0][0];
-				if      (vert->lightmap[0][1] < uv_min[1]) uv_min[1] = vert->lightmap[0][1];
-				else if (vert->lightmap[0][1] > uv_max[1]) uv_max[1] = vert->lightmap[0][1];
+			uv_max[0] = uv_min[0] = vertices->at(surf.vert_idx).lightmap[0][0];
+			uv_max[1] = uv_min[1] = vertices->at(surf.vert_idx).lightmap[0][1];
+			for (int32_t i = 1; i < surf.vert_count; i++) {
+				auto const & vert = vertices->at(surf.vert_idx + i);
+				if      (vert.lightmap[0][0] < uv_min[0]) uv_min[0] = vert.lightmap[0][0];
+				else if (vert.lightmap[0][0] > uv_max[0]) uv_max[0] = vert.lightmap[0][0];
+				if      (vert.lightmap[0][1] < uv_min[1]) uv_min[1] = vert.lightmap[0][1];
+				else if (vert.lightmap[0][1] > uv_max[1]) uv_max[1] = vert.lightmap[0][1];
 			}
 			
 			diff = { uv_max[0] - uv_min[0], uv_max[1] - uv_min[1] };
 			
 			if (diff[0] < 0.001 || diff[1] < 0.001) { // probably no lightmap UVs, hack it from the position and redo
-				vert = &vertices->at(surf.vert_idx);
-				for (int32_t i = 0; i < surf.vert_count; i++, vert++) {
-					vert->lightmap[0][0] = vert->pos[0] + vert->pos[1];
-					vert->lightmap[0][1] = vert->pos[2];
+				for (int32_t i = 0; i < surf.vert_count; i++) {
+					auto & vert = vertices->edit(surf.vert_idx + i);
+					vert.lightmap[0][0] = vert.pos[0] + vert.pos[1];
+					vert.lightmap[0][1] = vert.pos[2];
 				}
 				continue;
 			}
 			break;
 		}
 		
-		vert = &vertices->at(surf.vert_idx);
-		for (int32_t i = 0; i < surf.vert_count; i++, vert++) {
-			vert->lightmap[0][0] = (vert->lightmap[0][0] - uv_min[0]) / diff[0];
-			vert->lightmap[0][1] = 1 - (vert->lightmap[0][1] - uv_min[1]) / diff[1];
+		for (int32_t i = 0; i < surf.vert_count; i++) {
+			auto & vert = vertices->edit(surf.vert_idx + i);
+			vert.lightmap[0][0] = (vert.lightmap[0][0] - uv_min[0]) / diff[0];
+			vert.lightmap[0][1] = 1 - (vert.lightmap[0][1] - uv_min[1]) / diff[1];
 			
-			if (xmult > 1) vert->lightmap[0][0] *= xmult;
-			if (flip_x) vert->lightmap[0][0] = 1 - vert->lightmap[0][0];
-			if (flip_y) vert->lightmap[0][1] = 1 - vert->lightmap[0][1];
+			if (xmult > 1) vert.lightmap[0][0] *= xmult;
+			if (flip_x) vert.lightmap[0][0] = 1 - vert.lightmap[0][0];
+			if (flip_y) vert.lightmap[0][1] = 1 - vert.lightmap[0][1];
 		}
 		
 		surf.lightmap[0] = lightmaps->size();
@@ -741,15 +1448,7 @@ int main(int argc, char * * argv) {
 		
 		stbi_image_free(img_data);
 		
-		auto bytes = bspa.assemble();
-		
-		std::ofstream fout { output_path, std::ios_base::binary | std::ios_base::out };
-		if (!fout.good()) {
-			std::cerr << "failed to open output for writing" << std::endl;
-			return 1;
-		}
-		fout.write( reinterpret_cast<char const *>(bytes.data()), bytes.size());
-		fout.close();
+		if (!write_bsp(bspa, output_path, threads)) return 1;
 	}
 	
 	// ================================
@@ -771,50 +1470,51 @@ int main(int argc, char * * argv) {
 		if (args["model"])
 			midx = args["model"].as<int32_t>();
 		
-		BSP::LumpProviderPtr pprov = std::make_shared<BSP::BSPReaderLumpProvider>(bspr);
-		BSP::Assembler bspa { pprov };
-		auto shaders = std::make_shared<BSPI::ShaderArray>(bspr.shaders());
-		auto surfaces = std::make_shared<BSPI::SurfaceArray>(bspr.surfaces());
-		auto leafs = std::make_shared<BSPI::LeafArray>(bspr.leafs());
-		auto leafsurfs = std::make_shared<BSPI::LeafSurfaceArray>(bspr.leafsurfaces());
-		auto models = std::make_shared<BSPI::ModelArray>(bspr.models());
-		auto brushsides = std::make_shared<BSPI::BrushSideArray>(bspr.brushsides());
-		auto vertices = std::make_shared<BSPI::VertexArray>(bspr.drawverts());
-		auto indices = std::make_shared<BSPI::IndexArray>(bspr.drawindices());
-		auto lightmaps = std::make_shared<BSPI::LightmapArray>(bspr.lightmaps());
-		bspa[BSP::LumpIndex::SHADERS] = std::make_shared<BSP::BSPIShaderArrayLumpProvider>(shaders);
-		bspa[BSP::LumpIndex::SURFACES] = std::make_shared<BSP::BSPISurfaceArrayLumpProvider>(surfaces);
-		bspa[BSP::LumpIndex::LEAFS] = std::make_shared<BSP::BSPILeafArrayLumpProvider>(leafs);
-		bspa[BSP::LumpIndex::LEAFSURFACES] = std::make_shared<BSP::BSPILeafSurfacesArrayLumpProvider>(leafsurfs);
-		bspa[BSP::LumpIndex::MODELS] = std::make_shared<BSP::BSPIModelArrayLumpProvider>(models);
-		bspa[BSP::LumpIndex::BRUSHSIDES] = std::make_shared<BSP::BSPIBrushSidesArrayLumpProvider>(brushsides);
-		bspa[BSP::LumpIndex::DRAWVERTS] = std::make_shared<BSP::BSPIVertexArrayLumpProvider>(vertices);
-		bspa[BSP::LumpIndex::DRAWINDEXES] = std::make_shared<BSP::BSPIIndexArrayLumpProvider>(indices);
-		bspa[BSP::LumpIndex::LIGHTMAPS] = std::make_shared<BSP::BSPILightmapArrayLumpProvider>(lightmaps);
+		BSPI::IndexedLumps lumps { bspr };
+		BSP::EditTransaction edit { lumps };
 		
 		// SURFACE
 		
-		auto & world = models->at(midx);
-		int32_t ipos = world.first_surface + world.num_surfaces;
-		world.num_surfaces++;
+		if (midx < 0 || static_cast<size_t>(midx) >= lumps.models.size()) {
+			std::cerr << "model " << midx << " does not exist" << std::endl;
+			return 1;
+		}
 		
-		auto & surf = *surfaces->emplace( surfaces->begin() + ipos );
-		surf = {};
+		BSP::Surface surf {};
 		surf.type = BSP::SurfaceType::PLANAR;
-		surf.shader = add_shader(*shaders, "textures/colors/white2");
+		surf.shader = add_shader(lumps.shaders, "textures/colors/white2");
 		surf.fog = -1;
 		
-		surf.vert_count = 4;
-		surf.vert_idx = vertices->size();
+		// LIGHTMAP
 		
-		surf.index_count = 12;
-		surf.index_idx = indices->size();
+		surf.lightmap[0] = lumps.lightmaps.size();
+		surf.lightmap[1] = -1;
+		surf.lightmap[2] = -1;
+		surf.lightmap[3] = -1;
+		surf.lightmap_styles[0] = 0;
+		surf.lightmap_styles[1] = 255;
+		surf.lightmap_styles[2] = 255;
+		surf.lightmap_styles[3] = 255;
+		auto & lm = lumps.lightmaps.emplace_back();
 		
-		for (auto & m : *models)
-			if (m.first_surface >= ipos) m.first_surface++;
-			
-		for (auto & bs : *brushsides)
-			if (bs.surface >= ipos) bs.surface++;
+		int img_w, img_h, img_ch;
+		auto * img_data = stbi_load(imgf.data(), &img_w, &img_h, &img_ch, 3);
+		if (!img_data || img_w != 128 || img_h != 128 || img_ch != 3) {
+			std::cerr << "src image MUST be 128x128 RGB" << std::endl;
+			return 1;
+		}
+		
+		auto * img_ptr = img_data;
+		for (size_t y = 0; y < 128; y++) for (size_t x = 0; x < 128; x++) {
+			lm.pixels[y][x].r = img_ptr[0];
+			lm.pixels[y][x].g = img_ptr[1];
+			lm.pixels[y][x].b = img_ptr[2];
+			img_ptr += 3;
+		}
+		
+		stbi_image_free(img_data);
+		
+		int32_t surf_idx = edit.add_surface(midx, surf);
 		
 		// VERTEX
 		
@@ -825,9 +1525,9 @@ int main(int argc, char * * argv) {
 			{1, 1}
 		}};
 		
+		std::array<BSP::DrawVert, 4> verts {};
 		for (size_t i = 0; i < 4; i++) {
-			auto & vert = vertices->emplace_back();
-			vert = {};
+			auto & vert = verts[i];
 			
 			if (dir == "x") {
 				vert.pos[0] = x;
@@ -848,95 +1548,56 @@ int main(int argc, char * * argv) {
 			vert.lightmap[0][0] = pos_base[i][0];
 			vert.lightmap[0][1] = 1 - pos_base[i][1];
 		}
+		edit.add_verts(surf_idx, verts);
 		
 		// INDEX
 		
-		indices->emplace_back(0);
-		indices->emplace_back(1);
-		indices->emplace_back(2);
-		indices->emplace_back(2);
-		indices->emplace_back(1);
-		indices->emplace_back(3);
-		indices->emplace_back(1);
-		indices->emplace_back(0);
-		indices->emplace_back(2);
-		indices->emplace_back(1);
-		indices->emplace_back(2);
-		indices->emplace_back(3);
+		static constexpr std::array<int32_t, 12> index_base { 0, 1, 2, 2, 1, 3, 1, 0, 2, 1, 2, 3 };
+		edit.add_indices(surf_idx, index_base);
 		
 		// LEAF
 		
-		auto is_in_leaf = [&](int32_t const * mins, int32_t const * maxs){
-			if (x < mins[0]) return false;
-			if (y < mins[1]) return false;
-			if (z < mins[2]) return false;
-			if (x > maxs[0]) return false;
-			if (y > maxs[1]) return false;
-			if (z > maxs[2]) return false;
-			return true;
-		};
-		
 		if (!midx) {
 			
-			bool leaf_found = false;
-			std::vector<int32_t> leaf_spos;
-			for (size_t i = 0; i < leafs->size(); i++) {
-				auto & leaf = leafs->at(i);
-				if (!is_in_leaf(leaf.mins, leaf.maxs)) continue;
-				leaf_found = true;
-				leaf.num_surfaces++;
-				leaf_spos.push_back(leaf.first_surface);
-				leafsurfs->emplace(leafsurfs->begin() + leaf_spos.back(), ipos);
+			// the quad sits on a plane, often a wall's, where the point can land in the solid leaf behind it
+			// so try its center and then a unit either side of it, taking the first leaf in a cluster
+			size_t const axis = dir == "x" ? 0 : dir == "y" ? 1 : 2;
+			BSP::vec3_t center {
+				(verts[0].pos[0] + verts[3].pos[0]) / 2,
+				(verts[0].pos[1] + verts[3].pos[1]) / 2,
+				(verts[0].pos[2] + verts[3].pos[2]) / 2,
+			};
+			
+			int32_t leaf = -1;
+			for (float nudge : { 0.0f, 1.0f, -1.0f }) {
+				BSP::vec3_t point = center;
+				point[axis] += nudge;
+				int32_t candidate = bspr.point_leaf(point);
+				if (candidate >= 0 && static_cast<size_t>(candidate) < lumps.leafs.size() && lumps.leafs[candidate].cluster >= 0) {
+					leaf = candidate;
+					break;
+				}
 			}
 			
-			if (!leaf_found) {
+			if (leaf < 0) {
 				std::cerr << "failed to find a suitable leaf" << std::endl;
 				return 1;
 			}
-		
-			for (auto & leaf : *leafs) {
-				for (int32_t spos : leaf_spos) if (leaf.first_surface > spos) leaf.first_surface++;
-			}
+			
+			edit.add_leaf_surface(leaf, surf_idx);
 		}
 		
-		// LIGHTMAP
-		
-		surf.lightmap[0] = lightmaps->size();
-		surf.lightmap[1] = -1;
-		surf.lightmap[2] = -1;
-		surf.lightmap[3] = -1;
-		surf.lightmap_styles[0] = 0;
-		surf.lightmap_styles[1] = 255;
-		surf.lightmap_styles[2] = 255;
-		surf.lightmap_styles[3] = 255;
-		auto & lm = lightmaps->emplace_back();
-		
-		int img_w, img_h, img_ch;
-		auto * img_data = stbi_load(imgf.data(), &img_w, &img_h, &img_ch, 3);
-		if (!img_data || img_w != 128 || img_h != 128 || img_ch != 3) {
-			std::cerr << "src image MUST be 128x128 RGB" << std::endl;
+		try {
+			edit.commit();
+		} catch (std::exception const & e) {
+			std::cerr << e.what() << std::endl;
 			return 1;
 		}
 		
-		auto * img_ptr = img_data;
-		for (size_t y = 0; y < 128; y++) for (size_t x = 0; x < 128; x++) {
-			lm.pixels[y][x].r = img_ptr[0];
-			lm.pixels[y][x].g = img_ptr[1];
-			lm.pixels[y][x].b = img_ptr[2];
-			img_ptr += 3;
-		}
-		
-		stbi_image_free(img_data);
-		
-		auto bytes = bspa.assemble();
-		
-		std::ofstream fout { output_path, std::ios_base::binary | std::ios_base::out };
-		if (!fout.good()) {
-			std::cerr << "failed to open output for writing" << std::endl;
-			return 1;
-		}
-		fout.write( reinterpret_cast<char const *>(bytes.data()), bytes.size());
-		fout.close();
+		BSP::LumpProviderPtr pprov = std::make_shared<BSP::BSPReaderLumpProvider>(bspr);
+		BSP::Assembler bspa { pprov };
+		bspa.provide(std::move(lumps));
+		if (!write_bsp(bspa, output_path, threads)) return 1;
 	}
 	
 	// ================================
@@ -980,15 +1641,7 @@ int main(int argc, char * * argv) {
 			shnew.content_flags = 0;
 		}
 		
-		auto bytes = bspa.assemble();
-		
-		std::ofstream fout { output_path, std::ios_base::binary | std::ios_base::out };
-		if (!fout.good()) {
-			std::cerr << "failed to open output for writing" << std::endl;
-			return 1;
-		}
-		fout.write( reinterpret_cast<char const *>(bytes.data()), bytes.size());
-		fout.close();
+		if (!write_bsp(bspa, output_path, threads)) return 1;
 	}
 	
 	return 0;